@@ -0,0 +1,346 @@
+#include "operations.h"
+#include "betterassert.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Asynchronous I/O contexts.
+ *
+ * Requests and completions go through two bounded rings, which submitters,
+ * workers and reapers use without any lock: each slot has a sequence number,
+ * which tells whether it holds an item for the current lap of the ring (to be
+ * taken) or is free for it (to be filled), and a thread claims a slot by
+ * moving the ring's enqueue (or dequeue) position past it, with a
+ * compare-and-swap. A semaphore counts the items in each ring, so that workers
+ * sleep while there are no requests, and reapers while there are no
+ * completions.
+ *
+ * At most a_entries requests are in flight, from submission until their
+ * completion is reaped, and both rings have room for that many, so pushing to
+ * them never fails.
+ */
+typedef struct {
+    atomic_size_t *r_sequence; // per slot
+    char *r_slots;
+    size_t r_slot_size;
+    size_t r_mask; // the capacity (a power of 2) minus 1
+    atomic_size_t r_enqueue;
+    atomic_size_t r_dequeue;
+} async_ring_t;
+
+struct tfs_async {
+    async_ring_t a_submissions; // of tfs_async_request_t
+    async_ring_t a_completions; // of tfs_async_completion_t
+    sem_t a_submitted;          // requests to take (and workers to stop)
+    sem_t a_completed;          // completions to reap
+    atomic_size_t a_in_flight;
+    size_t a_entries;
+    atomic_bool a_stopping;
+    pthread_t *a_workers;
+    size_t a_worker_count;
+};
+
+static int ring_init(async_ring_t *ring, size_t entries, size_t slot_size) {
+    size_t capacity = 1;
+    while (capacity < entries) {
+        capacity *= 2;
+    }
+
+    ring->r_sequence = malloc(capacity * sizeof(atomic_size_t));
+    ring->r_slots = malloc(capacity * slot_size);
+    if (ring->r_sequence == NULL || ring->r_slots == NULL) {
+        free(ring->r_sequence);
+        free(ring->r_slots);
+        return -1;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&ring->r_sequence[i], i);
+    }
+    ring->r_slot_size = slot_size;
+    ring->r_mask = capacity - 1;
+    atomic_init(&ring->r_enqueue, 0);
+    atomic_init(&ring->r_dequeue, 0);
+    return 0;
+}
+
+static void ring_destroy(async_ring_t *ring) {
+    free(ring->r_sequence);
+    free(ring->r_slots);
+}
+
+/**
+ * Add an item to a ring.
+ *
+ * Returns true if successful, false if the ring is full.
+ */
+static bool ring_push(async_ring_t *ring, void const *item) {
+    size_t position =
+        atomic_load_explicit(&ring->r_enqueue, memory_order_relaxed);
+    while (true) {
+        atomic_size_t *sequence = &ring->r_sequence[position & ring->r_mask];
+        intptr_t lap = (intptr_t)atomic_load_explicit(sequence,
+                                                      memory_order_acquire) -
+                       (intptr_t)position;
+        if (lap < 0) {
+            return false; // the slot still holds an item of the previous lap
+        }
+        if (lap > 0) {
+            // another thread filled the slot: move on
+            position =
+                atomic_load_explicit(&ring->r_enqueue, memory_order_relaxed);
+        } else if (atomic_compare_exchange_weak_explicit(
+                       &ring->r_enqueue, &position, position + 1,
+                       memory_order_relaxed, memory_order_relaxed)) {
+            char *slot =
+                ring->r_slots + (position & ring->r_mask) * ring->r_slot_size;
+            memcpy(slot, item, ring->r_slot_size);
+            atomic_store_explicit(sequence, position + 1, memory_order_release);
+            return true;
+        }
+    }
+}
+
+/**
+ * Take the oldest item from a ring.
+ *
+ * Returns true if successful, false if the ring is empty (or the oldest item
+ * is still being added).
+ */
+static bool ring_pop(async_ring_t *ring, void *item) {
+    size_t position =
+        atomic_load_explicit(&ring->r_dequeue, memory_order_relaxed);
+    while (true) {
+        atomic_size_t *sequence = &ring->r_sequence[position & ring->r_mask];
+        intptr_t lap = (intptr_t)atomic_load_explicit(sequence,
+                                                      memory_order_acquire) -
+                       (intptr_t)(position + 1);
+        if (lap < 0) {
+            return false; // the slot has not been filled for this lap
+        }
+        if (lap > 0) {
+            // another thread took the item: move on
+            position =
+                atomic_load_explicit(&ring->r_dequeue, memory_order_relaxed);
+        } else if (atomic_compare_exchange_weak_explicit(
+                       &ring->r_dequeue, &position, position + 1,
+                       memory_order_relaxed, memory_order_relaxed)) {
+            char const *slot =
+                ring->r_slots + (position & ring->r_mask) * ring->r_slot_size;
+            memcpy(item, slot, ring->r_slot_size);
+            // free the slot for the next lap
+            atomic_store_explicit(sequence, position + ring->r_mask + 1,
+                                  memory_order_release);
+            return true;
+        }
+    }
+}
+
+static void semaphore_wait(sem_t *semaphore) {
+    while (sem_wait(semaphore) == -1) {
+        ALWAYS_ASSERT(errno == EINTR, "semaphore_wait: failed to wait");
+    }
+}
+
+static ssize_t async_run(tfs_async_request_t const *request) {
+    switch (request->op) {
+    case TFS_ASYNC_OPEN:
+        return tfs_open(request->name, request->mode);
+    case TFS_ASYNC_CLOSE:
+        return tfs_close(request->fhandle);
+    case TFS_ASYNC_READ:
+        return tfs_read(request->fhandle, request->buffer, request->len);
+    case TFS_ASYNC_WRITE:
+        return tfs_write(request->fhandle, request->buffer, request->len);
+    case TFS_ASYNC_PREAD:
+        return tfs_pread(request->fhandle, request->buffer, request->len,
+                         request->offset);
+    case TFS_ASYNC_PWRITE:
+        return tfs_pwrite(request->fhandle, request->buffer, request->len,
+                          request->offset);
+    default:
+        return -1;
+    }
+}
+
+static void *async_worker_thread_func(void *arg) {
+    tfs_async_t *async = arg;
+    while (true) {
+        semaphore_wait(&async->a_submitted);
+
+        tfs_async_request_t request;
+        while (!ring_pop(&async->a_submissions, &request)) {
+            if (atomic_load(&async->a_stopping)) {
+                // nothing is submitted while stopping, so every request has
+                // been taken
+                return NULL;
+            }
+            sched_yield(); // the oldest request is still being pushed
+        }
+
+        tfs_async_completion_t completion = {
+            .result = async_run(&request),
+            .user_data = request.user_data,
+        };
+        ALWAYS_ASSERT(ring_push(&async->a_completions, &completion),
+                      "async_worker_thread_func: completion ring overflow");
+        sem_post(&async->a_completed);
+    }
+}
+
+/**
+ * Stop the first count workers of a context (with nothing left to submit).
+ */
+static void async_stop(tfs_async_t *async, size_t count) {
+    atomic_store(&async->a_stopping, true);
+    for (size_t i = 0; i < count; i++) {
+        sem_post(&async->a_submitted);
+    }
+    for (size_t i = 0; i < count; i++) {
+        pthread_join(async->a_workers[i], NULL);
+    }
+}
+
+static void async_free(tfs_async_t *async) {
+    sem_destroy(&async->a_completed);
+    sem_destroy(&async->a_submitted);
+    ring_destroy(&async->a_completions);
+    ring_destroy(&async->a_submissions);
+    free(async->a_workers);
+    free(async);
+}
+
+tfs_async_t *tfs_async_create(size_t entries, size_t nthreads) {
+    if (entries == 0 || nthreads == 0) {
+        return NULL;
+    }
+
+    tfs_async_t *async = malloc(sizeof(tfs_async_t));
+    if (async == NULL) {
+        return NULL;
+    }
+    if (ring_init(&async->a_submissions, entries,
+                  sizeof(tfs_async_request_t)) == -1) {
+        free(async);
+        return NULL;
+    }
+    if (ring_init(&async->a_completions, entries,
+                  sizeof(tfs_async_completion_t)) == -1) {
+        ring_destroy(&async->a_submissions);
+        free(async);
+        return NULL;
+    }
+    if (sem_init(&async->a_submitted, 0, 0) == -1) {
+        ring_destroy(&async->a_completions);
+        ring_destroy(&async->a_submissions);
+        free(async);
+        return NULL;
+    }
+    if (sem_init(&async->a_completed, 0, 0) == -1) {
+        sem_destroy(&async->a_submitted);
+        ring_destroy(&async->a_completions);
+        ring_destroy(&async->a_submissions);
+        free(async);
+        return NULL;
+    }
+    atomic_init(&async->a_in_flight, 0);
+    atomic_init(&async->a_stopping, false);
+    async->a_entries = entries;
+    async->a_worker_count = 0;
+
+    async->a_workers = malloc(nthreads * sizeof(pthread_t));
+    while (async->a_workers != NULL && async->a_worker_count < nthreads &&
+           pthread_create(&async->a_workers[async->a_worker_count], NULL,
+                          async_worker_thread_func, async) == 0) {
+        async->a_worker_count++;
+    }
+    if (async->a_worker_count < nthreads) {
+        if (async->a_workers != NULL) {
+            async_stop(async, async->a_worker_count);
+        }
+        async_free(async);
+        return NULL;
+    }
+    return async;
+}
+
+ssize_t tfs_async_submit(tfs_async_t *async,
+                         tfs_async_request_t const *requests, size_t count) {
+    if (async == NULL || (count > 0 && requests == NULL)) {
+        return -1;
+    }
+
+    size_t submitted = 0;
+    while (submitted < count) {
+        // take a place in flight (which guarantees room in both rings)
+        size_t in_flight = atomic_load(&async->a_in_flight);
+        if (in_flight == async->a_entries) {
+            break;
+        }
+        if (!atomic_compare_exchange_weak(&async->a_in_flight, &in_flight,
+                                          in_flight + 1)) {
+            continue;
+        }
+
+        ALWAYS_ASSERT(ring_push(&async->a_submissions, &requests[submitted]),
+                      "tfs_async_submit: submission ring overflow");
+        sem_post(&async->a_submitted);
+        submitted++;
+    }
+    return (ssize_t)submitted;
+}
+
+/**
+ * Take a completion, which the caller has already counted down (from
+ * a_completed).
+ */
+static void async_reap(tfs_async_t *async,
+                       tfs_async_completion_t *completion) {
+    while (!ring_pop(&async->a_completions, completion)) {
+        sched_yield(); // the oldest completion is still being pushed
+    }
+    atomic_fetch_sub(&async->a_in_flight, 1);
+}
+
+ssize_t tfs_async_poll(tfs_async_t *async, tfs_async_completion_t *completions,
+                       size_t max) {
+    if (async == NULL || (max > 0 && completions == NULL)) {
+        return -1;
+    }
+
+    size_t reaped = 0;
+    while (reaped < max && sem_trywait(&async->a_completed) == 0) {
+        async_reap(async, &completions[reaped++]);
+    }
+    return (ssize_t)reaped;
+}
+
+ssize_t tfs_async_wait(tfs_async_t *async, tfs_async_completion_t *completions,
+                       size_t max) {
+    if (async == NULL || max == 0 || completions == NULL ||
+        atomic_load(&async->a_in_flight) == 0) {
+        return -1;
+    }
+
+    semaphore_wait(&async->a_completed);
+    async_reap(async, &completions[0]);
+    return 1 + tfs_async_poll(async, completions + 1, max - 1);
+}
+
+int tfs_async_destroy(tfs_async_t *async) {
+    if (async == NULL) {
+        return -1;
+    }
+
+    // the workers take every request left before they stop
+    async_stop(async, async->a_worker_count);
+    async_free(async);
+    return 0;
+}
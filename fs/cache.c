@@ -0,0 +1,475 @@
+#include "cache.h"
+#include "betterassert.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Buffer cache model, between the filesystem and its emulated storage.
+ *
+ * The structures themselves are always in memory: the cache only tracks which
+ * of them would be resident in a cache of a given number of frames, so that
+ * the storage latency is paid on misses alone. Each cached object (an inode, a
+ * data block, a free map) has a key; a frame holds one key, and frames are
+ * replaced with the CLOCK algorithm. Objects that changed are marked dirty, and
+ * writing one back costs another access when its frame is reused.
+ *
+ * Hits take no lock. Misses take the cache lock to pick a frame, and pay the
+ * latency after releasing it; meanwhile the frame is loading, and accesses to
+ * its object wait for it (as they would for a buffer being read in).
+ *
+ * Readahead hands runs of objects to a prefetcher thread, which brings each
+ * run in with a single access (one seek), so that the reader finds them cached
+ * (or at least on their way).
+ */
+#define NO_FRAME SIZE_MAX
+#define NO_KEY SIZE_MAX
+
+typedef struct {
+    atomic_size_t cf_key; // NO_KEY while the frame is free
+    atomic_bool cf_referenced;
+    atomic_bool cf_dirty;
+    atomic_bool cf_loading; // the object is still being brought in
+    tfs_struct_t cf_structure;
+    size_t cf_bytes;
+} cache_frame_t;
+
+typedef struct {
+    tfs_struct_t pr_structure;
+    size_t pr_key; // first of a run of pr_count objects
+    size_t pr_count;
+    size_t pr_bytes; // of each object
+} prefetch_request_t;
+
+static tfs_latency_t cache_latency;
+static cache_frame_t *cache_frames;
+static size_t cache_frame_count;
+static atomic_size_t *cache_frame_of; // per key: its frame, or NO_FRAME
+static size_t cache_key_count;
+static size_t cache_hand;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_loaded = PTHREAD_COND_INITIALIZER;
+static atomic_size_t cache_hits;
+static atomic_size_t cache_misses;
+static atomic_size_t cache_writebacks;
+static atomic_size_t cache_prefetches;
+
+// readahead requests, served by the prefetcher thread in order
+static prefetch_request_t prefetch_queue[PREFETCH_QUEUE_SIZE];
+static size_t prefetch_head;
+static size_t prefetch_count;
+static bool prefetch_stop;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_queued = PTHREAD_COND_INITIALIZER;
+static pthread_t prefetcher;
+static bool prefetcher_running;
+
+static void *prefetcher_thread_func(void *arg);
+
+/**
+ * Do nothing, while preventing the compiler from performing any optimizations.
+ *
+ * We need to defeat the optimizer for the insert_delay() function.
+ * Under optimization, the empty loop would be completely optimized away.
+ * This function tells the compiler that the assembly code being run (which is
+ * none) might potentially change *all memory in the process*.
+ *
+ * This prevents the optimizer from optimizing this code away, because it does
+ * not know what it does and it may have side effects.
+ *
+ * Reference with more information: https://youtu.be/nXaxk27zwlk?t=2775
+ *
+ * Exercise: try removing this function and look at the assembly generated to
+ * compare.
+ */
+static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
+
+/**
+ * Artifically delay execution, as the latency model says (see tfs_latency_t).
+ *
+ * Auxiliary function to insert a delay.
+ * Used in accesses to persistent FS state as a way of emulating access
+ * latencies as if such data structures were really stored in secondary memory.
+ *
+ * Input:
+ *   - structure: the kind of structure accessed
+ *   - bytes: how much of it is accessed
+ */
+static void insert_delay(tfs_struct_t structure, size_t bytes) {
+    if (cache_latency.mode == TFS_LATENCY_NONE) {
+        return;
+    }
+
+    uint64_t ns = cache_latency.seek_ns[structure] +
+                  cache_latency.ns_per_kib[structure] * bytes / 1024;
+    if (ns == 0) {
+        return;
+    }
+
+    if (cache_latency.mode == TFS_LATENCY_SLEEP) {
+        struct timespec wait = {.tv_sec = (time_t)(ns / 1000000000),
+                                .tv_nsec = (long)(ns % 1000000000)};
+        while (nanosleep(&wait, &wait) == -1 && errno == EINTR) {
+        }
+        return;
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        touch_all_memory();
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((uint64_t)(now.tv_sec - start.tv_sec) * 1000000000 +
+                 (uint64_t)now.tv_nsec - (uint64_t)start.tv_nsec <
+             ns);
+}
+
+/**
+ * Set up the cache, empty.
+ *
+ * Input:
+ *   - latency: the storage latency model
+ *   - frame_count: number of frames (0 for no cache: every access misses)
+ *   - key_count: number of objects that can be cached (keys are below it)
+ *   - prefetch: whether to start the prefetcher (with a cache)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int cache_init(tfs_latency_t latency, size_t frame_count, size_t key_count,
+               bool prefetch) {
+    if (latency.mode != TFS_LATENCY_NONE &&
+        latency.mode != TFS_LATENCY_SPIN &&
+        latency.mode != TFS_LATENCY_SLEEP) {
+        return -1;
+    }
+
+    cache_latency = latency;
+    cache_frame_count = frame_count;
+    cache_key_count = key_count;
+    cache_hand = 0;
+    atomic_store(&cache_hits, 0);
+    atomic_store(&cache_misses, 0);
+    atomic_store(&cache_writebacks, 0);
+    atomic_store(&cache_prefetches, 0);
+    if (frame_count == 0) {
+        return 0;
+    }
+
+    cache_frames = malloc(frame_count * sizeof(cache_frame_t));
+    cache_frame_of = malloc(key_count * sizeof(atomic_size_t));
+    if (cache_frames == NULL || cache_frame_of == NULL) {
+        cache_destroy();
+        return -1;
+    }
+    for (size_t i = 0; i < frame_count; i++) {
+        atomic_init(&cache_frames[i].cf_key, NO_KEY);
+        atomic_init(&cache_frames[i].cf_referenced, false);
+        atomic_init(&cache_frames[i].cf_dirty, false);
+        atomic_init(&cache_frames[i].cf_loading, false);
+    }
+    for (size_t i = 0; i < key_count; i++) {
+        atomic_init(&cache_frame_of[i], NO_FRAME);
+    }
+
+    prefetch_head = prefetch_count = 0;
+    prefetch_stop = false;
+    if (prefetch) {
+        if (pthread_create(&prefetcher, NULL, prefetcher_thread_func, NULL) !=
+            0) {
+            cache_destroy();
+            return -1;
+        }
+        prefetcher_running = true;
+    }
+    return 0;
+}
+
+/**
+ * Drop the cache (dirty objects need not be written back: the structures are
+ * flushed on their own), once the prefetcher is done.
+ */
+void cache_destroy(void) {
+    if (prefetcher_running) {
+        pthread_mutex_lock(&prefetch_lock);
+        prefetch_stop = true;
+        pthread_cond_signal(&prefetch_queued);
+        pthread_mutex_unlock(&prefetch_lock);
+        pthread_join(prefetcher, NULL);
+        prefetcher_running = false;
+    }
+
+    free(cache_frames);
+    free((void *)cache_frame_of);
+    cache_frames = NULL;
+    cache_frame_of = NULL;
+    cache_frame_count = 0;
+}
+
+/**
+ * Find the frame holding an object, and mark it as used.
+ *
+ * Returns the frame, or NULL if the object is not cached.
+ */
+static cache_frame_t *cache_lookup(size_t key) {
+    size_t frame = atomic_load(&cache_frame_of[key]);
+    if (frame == NO_FRAME || atomic_load(&cache_frames[frame].cf_key) != key) {
+        return NULL;
+    }
+    atomic_store(&cache_frames[frame].cf_referenced, true);
+    return &cache_frames[frame];
+}
+
+/**
+ * Give a frame to an object that is not cached, replacing another one. The
+ * frame is left loading. Must be called with cache_lock held.
+ *
+ * Input:
+ *   - structure, key, bytes: the object
+ *   - victim: where to store the object replaced, if it must be written back
+ *     (with cf_key set to NO_KEY otherwise)
+ *
+ * Returns the frame.
+ */
+static cache_frame_t *cache_install(tfs_struct_t structure, size_t key,
+                                    size_t bytes, cache_frame_t *victim) {
+    // CLOCK: the hand clears reference bits until it finds a frame that was
+    // not used since it last went by (frames being loaded are skipped)
+    cache_frame_t *frame;
+    size_t steps = 0;
+    while (true) {
+        frame = &cache_frames[cache_hand];
+        cache_hand = (cache_hand + 1) % cache_frame_count;
+        if (atomic_load(&frame->cf_key) == NO_KEY ||
+            (!atomic_load(&frame->cf_loading) &&
+             !atomic_exchange(&frame->cf_referenced, false))) {
+            break;
+        }
+        if (++steps > 2 * cache_frame_count) {
+            // every frame is being loaded
+            pthread_cond_wait(&cache_loaded, &cache_lock);
+            steps = 0;
+        }
+    }
+
+    atomic_store(&victim->cf_key, NO_KEY);
+    size_t old_key = atomic_load(&frame->cf_key);
+    if (old_key != NO_KEY) {
+        atomic_store(&cache_frame_of[old_key], NO_FRAME);
+        if (atomic_exchange(&frame->cf_dirty, false)) {
+            atomic_store(&victim->cf_key, old_key);
+            victim->cf_structure = frame->cf_structure;
+            victim->cf_bytes = frame->cf_bytes;
+        }
+    }
+
+    frame->cf_structure = structure;
+    frame->cf_bytes = bytes;
+    atomic_store(&frame->cf_loading, true);
+    atomic_store(&frame->cf_referenced, true);
+    atomic_store(&frame->cf_key, key);
+    atomic_store(&cache_frame_of[key], (size_t)(frame - cache_frames));
+    return frame;
+}
+
+/**
+ * Pay for bringing an object into its frame (and for writing back the one it
+ * replaced), then let the threads waiting for it go on. Must be called without
+ * cache_lock held.
+ */
+static void cache_load(cache_frame_t *frame, cache_frame_t const *victim) {
+    if (atomic_load(&victim->cf_key) != NO_KEY) {
+        atomic_fetch_add(&cache_writebacks, 1);
+        insert_delay(victim->cf_structure, victim->cf_bytes);
+    }
+    insert_delay(frame->cf_structure, frame->cf_bytes);
+
+    pthread_mutex_lock(&cache_lock);
+    atomic_store(&frame->cf_loading, false);
+    pthread_cond_broadcast(&cache_loaded);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Emulate an access to an object in storage: free if it is cached, and costing
+ * a storage access (and the write back of the object it replaces, if that one
+ * is dirty) otherwise. An object still being brought in (by another access,
+ * or by readahead) is waited for.
+ *
+ * Input:
+ *   - structure: the kind of object
+ *   - key: the object's key
+ *   - bytes: the object's size
+ */
+void cache_access(tfs_struct_t structure, size_t key, size_t bytes) {
+    if (cache_frames == NULL) {
+        atomic_fetch_add(&cache_misses, 1);
+        insert_delay(structure, bytes);
+        return;
+    }
+    ALWAYS_ASSERT(key < cache_key_count, "cache_access: invalid key");
+
+    cache_frame_t *frame = cache_lookup(key);
+    if (frame != NULL && !atomic_load(&frame->cf_loading)) {
+        atomic_fetch_add(&cache_hits, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    frame = cache_lookup(key);
+    if (frame != NULL) {
+        while (atomic_load(&frame->cf_loading) &&
+               atomic_load(&frame->cf_key) == key) {
+            pthread_cond_wait(&cache_loaded, &cache_lock);
+        }
+        pthread_mutex_unlock(&cache_lock);
+        atomic_fetch_add(&cache_hits, 1);
+        return;
+    }
+
+    cache_frame_t victim;
+    frame = cache_install(structure, key, bytes, &victim);
+    pthread_mutex_unlock(&cache_lock);
+
+    atomic_fetch_add(&cache_misses, 1);
+    cache_load(frame, &victim);
+}
+
+/**
+ * Bring a run of objects that are stored together into the cache, with a
+ * single storage access for the ones not cached yet (one seek, and the
+ * transfer of them all).
+ */
+static void cache_load_run(prefetch_request_t const *request) {
+    cache_frame_t **frames =
+        malloc(request->pr_count * sizeof(cache_frame_t *));
+    cache_frame_t *victims = malloc(request->pr_count * sizeof(cache_frame_t));
+    if (frames == NULL || victims == NULL) {
+        free(frames);
+        free(victims);
+        return; // only a hint
+    }
+
+    // at most half the frames, so that others can be replaced meanwhile (and
+    // the run never waits for frames it is loading itself)
+    size_t count = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0;
+         i < request->pr_count && count < cache_frame_count / 2; i++) {
+        if (cache_lookup(request->pr_key + i) == NULL) {
+            frames[count] =
+                cache_install(request->pr_structure, request->pr_key + i,
+                              request->pr_bytes, &victims[count]);
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    for (size_t i = 0; i < count; i++) {
+        if (atomic_load(&victims[i].cf_key) != NO_KEY) {
+            atomic_fetch_add(&cache_writebacks, 1);
+            insert_delay(victims[i].cf_structure, victims[i].cf_bytes);
+        }
+    }
+    if (count > 0) {
+        atomic_fetch_add(&cache_prefetches, count);
+        insert_delay(request->pr_structure, count * request->pr_bytes);
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < count; i++) {
+        atomic_store(&frames[i]->cf_loading, false);
+    }
+    pthread_cond_broadcast(&cache_loaded);
+    pthread_mutex_unlock(&cache_lock);
+
+    free(frames);
+    free(victims);
+}
+
+static void *prefetcher_thread_func(void *arg) {
+    (void)arg;
+    while (true) {
+        pthread_mutex_lock(&prefetch_lock);
+        while (prefetch_count == 0 && !prefetch_stop) {
+            pthread_cond_wait(&prefetch_queued, &prefetch_lock);
+        }
+        if (prefetch_stop) {
+            pthread_mutex_unlock(&prefetch_lock);
+            return NULL;
+        }
+        prefetch_request_t request = prefetch_queue[prefetch_head];
+        prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE_SIZE;
+        prefetch_count--;
+        pthread_mutex_unlock(&prefetch_lock);
+
+        cache_load_run(&request);
+    }
+}
+
+/**
+ * Ask for a run of objects stored together to be brought into the cache in
+ * the background, ahead of their use (a hint: it is dropped if too many are
+ * pending).
+ *
+ * Input:
+ *   - structure: the kind of objects
+ *   - key: the first object's key (the others' follow)
+ *   - count: number of objects
+ *   - bytes: the size of each object
+ */
+void cache_prefetch(tfs_struct_t structure, size_t key, size_t count,
+                    size_t bytes) {
+    if (!prefetcher_running || count == 0) {
+        return;
+    }
+    ALWAYS_ASSERT(key + count <= cache_key_count,
+                  "cache_prefetch: invalid key");
+
+    pthread_mutex_lock(&prefetch_lock);
+    if (prefetch_count < PREFETCH_QUEUE_SIZE) {
+        prefetch_queue[(prefetch_head + prefetch_count) % PREFETCH_QUEUE_SIZE] =
+            (prefetch_request_t){.pr_structure = structure,
+                                 .pr_key = key,
+                                 .pr_count = count,
+                                 .pr_bytes = bytes};
+        prefetch_count++;
+        pthread_cond_signal(&prefetch_queued);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+/**
+ * Record that a cached object changed, so that it is written back when it
+ * leaves the cache.
+ *
+ * Input:
+ *   - key: the object's key
+ */
+void cache_mark_dirty(size_t key) {
+    if (cache_frames == NULL) {
+        return;
+    }
+
+    size_t frame = atomic_load(&cache_frame_of[key]);
+    if (frame != NO_FRAME && atomic_load(&cache_frames[frame].cf_key) == key) {
+        atomic_store(&cache_frames[frame].cf_dirty, true);
+    }
+}
+
+/**
+ * Obtain the cache's counters since it was set up.
+ *
+ * Input:
+ *   - stats: where to store them
+ */
+void cache_stats(tfs_cache_stats_t *stats) {
+    stats->hits = atomic_load(&cache_hits);
+    stats->misses = atomic_load(&cache_misses);
+    stats->writebacks = atomic_load(&cache_writebacks);
+    stats->prefetches = atomic_load(&cache_prefetches);
+}
@@ -0,0 +1,18 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "operations.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+int cache_init(tfs_latency_t latency, size_t frame_count, size_t key_count,
+               bool prefetch);
+void cache_destroy(void);
+void cache_access(tfs_struct_t structure, size_t key, size_t bytes);
+void cache_prefetch(tfs_struct_t structure, size_t key, size_t count,
+                    size_t bytes);
+void cache_mark_dirty(size_t key);
+void cache_stats(tfs_cache_stats_t *stats);
+
+#endif // CACHE_H
@@ -6,6 +6,37 @@
 
 #define MAX_FILE_NAME (40)
 
-#define DELAY (5000)
+// number of extents stored directly in each inode
+#define INODE_EXTENTS (8)
+
+// entries per set of the dentry cache
+#define DCACHE_WAYS (4)
+
+// size of the chunks tfs_copy_from_external_fs reads from the host file
+// (rounded down to a multiple of the block size)
+#define IMPORT_CHUNK_SIZE (1 << 20)
+
+// extents tfs_copy_to_external_fs hands to each writev (at most the host's
+// IOV_MAX, which is 1024 on Linux)
+#define EXPORT_IOV_COUNT (1024)
+
+// default emulated cost of each access to the filesystem's structures (see
+// tfs_latency_t), in nanoseconds
+#define DEFAULT_ACCESS_NS (2000)
+
+// default number of frames of the buffer cache (see cache.c)
+#define DEFAULT_CACHE_FRAMES (256)
+
+// readahead window (in blocks) once a handle's reads are found sequential,
+// doubled on each further sequential read, up to
+// tfs_params.readahead_max_blocks (default DEFAULT_READAHEAD_BLOCKS)
+#define READAHEAD_MIN_BLOCKS (4)
+#define DEFAULT_READAHEAD_BLOCKS (32)
+
+// size of the write buffer of TFS_O_BUFFERED handles, in blocks
+#define WRITE_BUFFER_BLOCKS (16)
+
+// runs of blocks the readahead thread may have pending (more are dropped)
+#define PREFETCH_QUEUE_SIZE (256)
 
 #endif // CONFIG_H
@@ -0,0 +1,725 @@
+#include "journal.h"
+#include "betterassert.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*
+ * Metadata journal (redo log), kept in a host file next to the image.
+ *
+ * Operations append their records to a buffer in memory while they still hold
+ * the locks of the inodes they changed, and then wait, with no lock held, for
+ * the records to be written. Group commit: the first waiter becomes the
+ * leader, and writes (and flushes) everything appended so far, its own record
+ * and those of every other operation, with one write and one fdatasync;
+ * operations that append meanwhile wait for the leader, and the next of them
+ * leads the following batch.
+ *
+ * The image is only written by checkpoints (it is mapped privately, see
+ * state.c), so no change reaches it before the records that describe it. A
+ * checkpoint copies what changed in the image since the last one, logs the
+ * copy (J_IMAGE records, closed by a J_CHECKPOINT record), and only then
+ * writes it in place: a checkpoint that a crash cuts short leaves the image
+ * half written, and the next mount finishes it from the journal (see
+ * journal_restore). Once the image is flushed, the journal is emptied (on
+ * mount, after replaying it, on sync, and on unmount).
+ *
+ * Operations hold off checkpoints (journal_begin) from their first change to
+ * the image until they have logged it, so that a checkpoint never copies one
+ * halfway done.
+ */
+typedef struct {
+    char *jb_data;
+    size_t jb_size;
+    size_t jb_capacity;
+} journal_buffer_t;
+
+static int journal_fd = -1;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_flushed = PTHREAD_COND_INITIALIZER;
+static journal_buffer_t journal_pending; // appended, not yet written
+static journal_buffer_t journal_spare;   // the buffer of the previous batch
+static uint64_t journal_next_lsn;
+static uint64_t journal_durable_lsn; // every record up to it is on disk
+static bool journal_flushing;        // a leader is writing a batch
+static bool journal_failed;          // a batch could not be written
+static off_t journal_size;           // of the whole records in the journal
+static int journal_image_fd = -1;    // the image that checkpoints write
+
+// the checkpoint being taken: its J_IMAGE records, and where the image bytes
+// that could not be added to it go
+static journal_buffer_t journal_capture;
+static bool capture_failed;
+static void (*capture_lost)(uint64_t offset, size_t length);
+
+#define JOURNAL_IMAGE_CHUNK ((size_t)1 << 20) // image bytes per record
+
+/*
+ * Checkpoint barrier: the operations between journal_begin and journal_end,
+ * which a checkpoint waits for (and keeps new ones from starting) before it
+ * copies the image. A thread may nest them: only its outermost pair counts.
+ */
+static atomic_size_t journal_active;
+static atomic_bool journal_quiescing; // a checkpoint waits for the operations
+static pthread_mutex_t barrier_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t barrier_changed = PTHREAD_COND_INITIALIZER;
+static _Thread_local unsigned barrier_depth;
+
+static uint32_t journal_checksum(uint32_t hash, void const *data,
+                                 size_t length) {
+    // FNV-1a
+    unsigned char const *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t record_checksum(journal_record_t const *record,
+                                void const *payload) {
+    size_t skip = sizeof(record->jr_checksum);
+    uint32_t hash = journal_checksum(2166136261u, (char const *)record + skip,
+                                     sizeof(*record) - skip);
+    return journal_checksum(hash, payload, record->jr_length);
+}
+
+/**
+ * Open the journal (creating it if needed). Records are only logged while it
+ * is open.
+ *
+ * Input:
+ *   - path: path of the journal (in the host file system)
+ *   - image_fd: the image, which checkpoints write
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_open(char const *path, int image_fd) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    journal_fd = fd;
+    journal_image_fd = image_fd;
+    journal_next_lsn = 1;
+    journal_durable_lsn = 0;
+    journal_failed = false;
+    journal_size = 0;
+    pthread_mutex_unlock(&journal_lock);
+    return 0;
+}
+
+/**
+ * Close the journal. Every operation must have been committed.
+ */
+void journal_close(void) {
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd != -1) {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+    journal_image_fd = -1;
+    free(journal_pending.jb_data);
+    free(journal_spare.jb_data);
+    free(journal_capture.jb_data);
+    journal_pending = (journal_buffer_t){0};
+    journal_spare = (journal_buffer_t){0};
+    journal_capture = (journal_buffer_t){0};
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/**
+ * Read the whole journal into memory.
+ *
+ * Input:
+ *   - log: where to store its contents (NULL if it is empty), to free
+ *   - size: where to store their size
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_load(char **log, size_t *size) {
+    *log = NULL;
+    *size = 0;
+    struct stat st;
+    if (journal_fd == -1 || fstat(journal_fd, &st) == -1) {
+        return -1;
+    }
+    if (st.st_size == 0) {
+        return 0;
+    }
+
+    char *contents = malloc((size_t)st.st_size);
+    if (contents == NULL || pread(journal_fd, contents, (size_t)st.st_size,
+                                  0) != (ssize_t)st.st_size) {
+        free(contents);
+        return -1;
+    }
+    *log = contents;
+    *size = (size_t)st.st_size;
+    return 0;
+}
+
+/**
+ * Read the record at an offset of the journal's contents.
+ *
+ * A record that is not whole (its checksum does not match), or that does not
+ * come after the one before it, was being written when the journal was last
+ * used: it was never committed, nor were the ones after it.
+ *
+ * Input:
+ *   - log, size: the journal's contents
+ *   - offset: where the record starts
+ *   - last_lsn: the LSN of the record before it (0 for none)
+ *   - record: where to store the record
+ *
+ * Returns the offset past the record, or 0 if it is not whole.
+ */
+static size_t record_read(char const *log, size_t size, size_t offset,
+                          uint64_t last_lsn, journal_record_t *record) {
+    if (size - offset < sizeof(*record)) {
+        return 0;
+    }
+
+    memcpy(record, log + offset, sizeof(*record));
+    char const *payload = log + offset + sizeof(*record);
+    if (record->jr_length > size - offset - sizeof(*record) ||
+        record->jr_lsn <= last_lsn ||
+        record_checksum(record, payload) != record->jr_checksum) {
+        return 0; // torn record
+    }
+    return offset + sizeof(*record) + record->jr_length;
+}
+
+/**
+ * Take the next J_IMAGE record from a run of them.
+ *
+ * Input:
+ *   - records, size: the run
+ *   - offset: where the record starts; moved past it
+ *   - at, bytes, length: where to store the offset of its bytes in the image,
+ *     and the bytes
+ *
+ * Returns true if there was one, false at the end of the run.
+ */
+static bool image_record_next(char const *records, size_t size,
+                              size_t *offset, uint64_t *at,
+                              char const **bytes, size_t *length) {
+    journal_record_t record;
+    while (size - *offset >= sizeof(record)) {
+        memcpy(&record, records + *offset, sizeof(record));
+        char const *payload = records + *offset + sizeof(record);
+        *offset += sizeof(record) + record.jr_length;
+        if (record.jr_op == J_IMAGE && record.jr_length >= sizeof(*at)) {
+            memcpy(at, payload, sizeof(*at));
+            *bytes = payload + sizeof(*at);
+            *length = record.jr_length - sizeof(*at);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool write_all(int fd, char const *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+static bool pwrite_all(int fd, char const *data, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= (size_t)written;
+        offset += written;
+    }
+    return true;
+}
+
+/**
+ * Write the image bytes of a run of J_IMAGE records in place, and flush them.
+ *
+ * Returns true if successful, false otherwise.
+ */
+static bool image_write(char const *records, size_t size) {
+    size_t offset = 0;
+    uint64_t at;
+    char const *bytes;
+    size_t length;
+    while (image_record_next(records, size, &offset, &at, &bytes, &length)) {
+        if (!pwrite_all(journal_image_fd, bytes, length, (off_t)at)) {
+            return false;
+        }
+    }
+    return fdatasync(journal_image_fd) == 0;
+}
+
+/**
+ * Finish the checkpoints in the journal: a crash may have cut the last one
+ * short while it wrote the image, so the image bytes of every whole
+ * checkpoint are written again, in order. What follows the last whole record
+ * other than a J_IMAGE (the image bytes of a checkpoint that was not whole, or
+ * a torn record) is dropped, so that new records follow whole ones.
+ *
+ * Called on mount, before the image is mapped (and the journal replayed).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The journal could not be read, or the image or the journal written.
+ */
+int journal_restore(void) {
+    char *log;
+    size_t size;
+    if (journal_load(&log, &size) == -1) {
+        return -1;
+    }
+
+    int result = 0;
+    size_t end = 0;   // past the last record that is not a J_IMAGE
+    size_t first = 0; // the first J_IMAGE record after it
+    uint64_t lsn = 0;
+    journal_record_t record;
+    for (size_t offset = 0, next;
+         log != NULL && (next = record_read(log, size, offset, lsn, &record));
+         offset = next) {
+        lsn = record.jr_lsn;
+        if (record.jr_op == J_IMAGE) {
+            continue;
+        }
+        if (record.jr_op == J_CHECKPOINT &&
+            !image_write(log + first, offset - first)) {
+            result = -1;
+        }
+        first = end = next;
+    }
+    free(log);
+
+    pthread_mutex_lock(&journal_lock);
+    if (end < size && ftruncate(journal_fd, (off_t)end) == -1) {
+        result = -1;
+    }
+    journal_size = (off_t)end;
+    pthread_mutex_unlock(&journal_lock);
+    return result;
+}
+
+/**
+ * Go through the records logged since the last checkpoint in the journal (the
+ * image has the changes of the ones before), in the order they were logged.
+ * Reading stops at the first record that is not whole.
+ *
+ * Input:
+ *   - redo: called for each record
+ *   - last_lsn: where to store the LSN of the last record in the journal
+ *     (untouched if there are none)
+ *
+ * Returns the number of records gone through.
+ */
+size_t journal_replay(void (*redo)(journal_record_t const *record,
+                                   void const *payload),
+                      uint64_t *last_lsn) {
+    char *log;
+    size_t size;
+    if (journal_load(&log, &size) == -1 || log == NULL) {
+        return 0;
+    }
+
+    size_t start = 0;
+    size_t offset = 0;
+    uint64_t lsn = 0;
+    journal_record_t record;
+    for (size_t next; (next = record_read(log, size, offset, lsn, &record));
+         offset = next) {
+        lsn = record.jr_lsn;
+        if (record.jr_op == J_CHECKPOINT) {
+            start = next;
+        }
+    }
+    size_t end = offset;
+
+    size_t count = 0;
+    for (offset = start; offset < end;
+         offset += sizeof(record) + record.jr_length) {
+        memcpy(&record, log + offset, sizeof(record));
+        if (record.jr_op != J_IMAGE && record.jr_op != J_CHECKPOINT) {
+            redo(&record, log + offset + sizeof(record));
+            count++;
+        }
+    }
+    free(log);
+
+    if (lsn > 0) {
+        *last_lsn = lsn;
+    }
+    return count;
+}
+
+/**
+ * Empty the journal; its records must no longer be needed (the image has been
+ * flushed).
+ *
+ * Input:
+ *   - next_lsn: LSN of the next record, greater than any inode's
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_reset(uint64_t next_lsn) {
+    pthread_mutex_lock(&journal_lock);
+    ALWAYS_ASSERT(journal_pending.jb_size == 0 && !journal_flushing,
+                  "journal_reset: records not yet committed");
+    int result = 0;
+    if (journal_fd != -1 &&
+        (ftruncate(journal_fd, 0) == -1 || fsync(journal_fd) == -1)) {
+        result = -1;
+    }
+    journal_next_lsn = next_lsn;
+    journal_durable_lsn = next_lsn - 1;
+    journal_failed = result == -1;
+    journal_size = 0;
+    pthread_mutex_unlock(&journal_lock);
+    return result;
+}
+
+static bool journal_buffer_reserve(journal_buffer_t *buffer, size_t size) {
+    if (buffer->jb_capacity - buffer->jb_size >= size) {
+        return true;
+    }
+
+    size_t capacity = buffer->jb_capacity > 0 ? buffer->jb_capacity : 4096;
+    while (capacity - buffer->jb_size < size) {
+        capacity *= 2;
+    }
+    char *data = realloc(buffer->jb_data, capacity);
+    if (data == NULL) {
+        return false;
+    }
+    buffer->jb_data = data;
+    buffer->jb_capacity = capacity;
+    return true;
+}
+
+/**
+ * Add bytes of the image to the checkpoint being taken: only from the capture
+ * of journal_checkpoint. They are copied, and written to the image once the
+ * copy is logged.
+ *
+ * Input:
+ *   - offset: where the bytes go in the image
+ *   - data, length: the bytes
+ */
+void journal_image(uint64_t offset, void const *data, size_t length) {
+    while (length > 0) {
+        size_t chunk =
+            length < JOURNAL_IMAGE_CHUNK ? length : JOURNAL_IMAGE_CHUNK;
+        journal_record_t record = {
+            .jr_length = (uint32_t)(sizeof(offset) + chunk),
+            .jr_op = J_IMAGE,
+        };
+        if (capture_failed ||
+            !journal_buffer_reserve(&journal_capture,
+                                    sizeof(record) + record.jr_length)) {
+            // (a checkpoint without every change would not be consistent)
+            capture_failed = true;
+            capture_lost(offset, length);
+            return;
+        }
+
+        char *end = journal_capture.jb_data + journal_capture.jb_size;
+        char *payload = end + sizeof(record);
+        memcpy(payload, &offset, sizeof(offset));
+        memcpy(payload + sizeof(offset), data, chunk);
+        record.jr_lsn = journal_next_lsn++;
+        record.jr_checksum = record_checksum(&record, payload);
+        memcpy(end, &record, sizeof(record));
+        journal_capture.jb_size += sizeof(record) + record.jr_length;
+
+        offset += chunk;
+        data = (char const *)data + chunk;
+        length -= chunk;
+    }
+}
+
+/**
+ * Log the checkpoint captured, and write it to the image. Called with
+ * journal_lock held.
+ *
+ * Returns 0 if successful, -1 otherwise (then every byte of the image
+ * captured is handed to capture_lost).
+ */
+static int checkpoint_write(void) {
+    bool logged = !capture_failed; // the checkpoint is whole in the journal
+    if (logged && journal_capture.jb_size > 0) {
+        journal_record_t marker = {.jr_op = J_CHECKPOINT};
+        marker.jr_lsn = journal_next_lsn++;
+        marker.jr_checksum = record_checksum(&marker, NULL);
+
+        // (a batch that failed may have left a torn record, which would hide
+        // the ones after it)
+        logged = (!journal_failed ||
+                  ftruncate(journal_fd, journal_size) == 0) &&
+                 write_all(journal_fd, journal_capture.jb_data,
+                           journal_capture.jb_size) &&
+                 write_all(journal_fd, (char const *)&marker,
+                           sizeof(marker)) &&
+                 fdatasync(journal_fd) == 0;
+        if (logged) {
+            journal_size +=
+                (off_t)(journal_capture.jb_size + sizeof(marker));
+        } else if (ftruncate(journal_fd, journal_size) == -1) {
+            journal_failed = true; // (truncated again by the next one)
+        }
+    }
+
+    if (logged) {
+        // the records logged so far have their changes in the checkpoint
+        journal_pending.jb_size = 0;
+        journal_durable_lsn = journal_next_lsn - 1;
+        journal_failed = false;
+        pthread_cond_broadcast(&journal_flushed);
+    }
+
+    if (logged &&
+        (journal_capture.jb_size == 0 ||
+         image_write(journal_capture.jb_data, journal_capture.jb_size))) {
+        if (ftruncate(journal_fd, 0) == -1 || fsync(journal_fd) == -1) {
+            return -1;
+        }
+        journal_size = 0;
+        return 0;
+    }
+
+    // what was captured must be part of the next checkpoint (which a logged
+    // one, left in the journal, comes before)
+    size_t offset = 0;
+    uint64_t at;
+    char const *bytes;
+    size_t length;
+    while (image_record_next(journal_capture.jb_data, journal_capture.jb_size,
+                             &offset, &at, &bytes, &length)) {
+        capture_lost(at, length);
+    }
+    return -1;
+}
+
+/**
+ * Checkpoint the image: copy what changed in it since the last checkpoint,
+ * with no operation halfway through a change (see journal_begin) nor any
+ * record being written, then log the copy and write it to the image, and
+ * empty the journal. Each record appended so far has its changes in the copy,
+ * and is no longer needed; operations still waiting for theirs are released.
+ *
+ * Must be called without holding any lock (nor between journal_begin and
+ * journal_end), and never by two threads at once.
+ *
+ * Input:
+ *   - capture: hands what changed to journal_image
+ *   - lost: takes back a range of the image that was handed to journal_image,
+ *     and is not written (nor logged) after all
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_checkpoint(void (*capture)(void),
+                       void (*lost)(uint64_t offset, size_t length)) {
+    pthread_mutex_lock(&barrier_lock);
+    atomic_store(&journal_quiescing, true);
+    while (atomic_load(&journal_active) > 0) {
+        pthread_cond_wait(&barrier_changed, &barrier_lock);
+    }
+    pthread_mutex_unlock(&barrier_lock);
+
+    pthread_mutex_lock(&journal_lock);
+    while (journal_flushing) {
+        pthread_cond_wait(&journal_flushed, &journal_lock);
+    }
+
+    journal_capture.jb_size = 0;
+    capture_failed = false;
+    capture_lost = lost;
+    capture();
+
+    // operations go on while the copy is written (appending no record until
+    // it is)
+    pthread_mutex_lock(&barrier_lock);
+    atomic_store(&journal_quiescing, false);
+    pthread_cond_broadcast(&barrier_changed);
+    pthread_mutex_unlock(&barrier_lock);
+
+    int result = checkpoint_write();
+    pthread_mutex_unlock(&journal_lock);
+
+    return result;
+}
+
+/**
+ * Start changing the image: checkpoints wait until journal_end (and this waits
+ * for a checkpoint that is copying the image). Must be called before taking
+ * any lock that other operations may hold while changing the image, unless the
+ * calling thread is between journal_begin and journal_end already.
+ */
+void journal_begin(void) {
+    if (journal_fd == -1 || barrier_depth++ > 0) {
+        return;
+    }
+
+    while (true) {
+        atomic_fetch_add(&journal_active, 1);
+        if (!atomic_load(&journal_quiescing)) {
+            return;
+        }
+
+        // a checkpoint waits: step back until it has its copy
+        if (atomic_fetch_sub(&journal_active, 1) == 1) {
+            pthread_mutex_lock(&barrier_lock);
+            pthread_cond_broadcast(&barrier_changed);
+            pthread_mutex_unlock(&barrier_lock);
+        }
+        pthread_mutex_lock(&barrier_lock);
+        while (atomic_load(&journal_quiescing)) {
+            pthread_cond_wait(&barrier_changed, &barrier_lock);
+        }
+        pthread_mutex_unlock(&barrier_lock);
+    }
+}
+
+/**
+ * Stop changing the image (see journal_begin); its changes must have been
+ * logged (journal_append) by then.
+ */
+void journal_end(void) {
+    if (journal_fd == -1 || --barrier_depth > 0) {
+        return;
+    }
+
+    if (atomic_fetch_sub(&journal_active, 1) == 1 &&
+        atomic_load(&journal_quiescing)) {
+        pthread_mutex_lock(&barrier_lock);
+        pthread_cond_broadcast(&barrier_changed);
+        pthread_mutex_unlock(&barrier_lock);
+    }
+}
+
+/**
+ * Log a metadata operation, which the caller has applied and whose inodes it
+ * still holds locked (so that the records of an inode are logged in the order
+ * in which they took effect). The record is only buffered: it is written by
+ * journal_commit.
+ *
+ * Input:
+ *   - op: the operation
+ *   - dir: directory whose entries changed (-1 for none)
+ *   - name: name of the entry that changed (NULL for none)
+ *   - inumber: inode that was created, linked or unlinked
+ *   - type: type of the new inode (J_CREATE)
+ *   - payload, length: data stored with the record
+ *
+ * Returns the record's LSN (to stamp on the inodes it changed), or 0 if the
+ * journal is not open.
+ */
+uint64_t journal_append(journal_op_t op, int dir, char const *name,
+                        int inumber, int type, void const *payload,
+                        size_t length) {
+    journal_record_t record = {
+        .jr_length = (uint32_t)length,
+        .jr_op = (uint32_t)op,
+        .jr_dir = dir,
+        .jr_inumber = inumber,
+        .jr_type = type,
+    };
+    if (name != NULL) {
+        strncpy(record.jr_name, name, MAX_FILE_NAME - 1);
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd == -1) {
+        pthread_mutex_unlock(&journal_lock);
+        return 0;
+    }
+
+    record.jr_lsn = journal_next_lsn++;
+    record.jr_checksum = record_checksum(&record, payload);
+    if (!journal_buffer_reserve(&journal_pending, sizeof(record) + length)) {
+        journal_failed = true; // the record is lost, so it cannot commit
+    } else {
+        char *end = journal_pending.jb_data + journal_pending.jb_size;
+        memcpy(end, &record, sizeof(record));
+        if (length > 0) {
+            memcpy(end + sizeof(record), payload, length);
+        }
+        journal_pending.jb_size += sizeof(record) + length;
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    return record.jr_lsn;
+}
+
+/**
+ * Wait until a record (and every record before it) is on disk. Must be called
+ * without holding any lock.
+ *
+ * Input:
+ *   - lsn: the record's LSN, as returned by journal_append
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The journal could not be written: the operation took effect, but may
+ *     not survive a crash.
+ */
+int journal_commit(uint64_t lsn) {
+    if (lsn == 0) {
+        return 0; // not journaled
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    while (journal_durable_lsn < lsn && !journal_failed) {
+        if (journal_flushing) {
+            // the batch being written may not have our record: wait and see
+            pthread_cond_wait(&journal_flushed, &journal_lock);
+            continue;
+        }
+
+        // lead the next batch: everything appended up to now
+        journal_flushing = true;
+        journal_buffer_t batch = journal_pending;
+        uint64_t batch_lsn = journal_next_lsn - 1;
+        journal_pending = journal_spare;
+        journal_pending.jb_size = 0;
+        pthread_mutex_unlock(&journal_lock);
+
+        bool written = write_all(journal_fd, batch.jb_data, batch.jb_size) &&
+                       fdatasync(journal_fd) == 0;
+
+        pthread_mutex_lock(&journal_lock);
+        journal_spare = batch;
+        journal_flushing = false;
+        if (written) {
+            journal_durable_lsn = batch_lsn;
+            journal_size += (off_t)batch.jb_size;
+        } else {
+            journal_failed = true;
+        }
+        pthread_cond_broadcast(&journal_flushed);
+    }
+    int result = journal_durable_lsn >= lsn ? 0 : -1;
+    pthread_mutex_unlock(&journal_lock);
+
+    return result;
+}
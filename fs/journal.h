@@ -0,0 +1,64 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Metadata operations recorded in the journal
+ */
+typedef enum {
+    J_CREATE = 1,   // new inode jr_inumber, named jr_name in directory jr_dir
+    J_ENTRY_ADD,    // jr_name in directory jr_dir now names inode jr_inumber
+    J_ENTRY_REMOVE, // jr_name removed from directory jr_dir
+    J_LINK_ADD,     // one more link to inode jr_inumber
+    J_LINK_DROP,    // one link less to inode jr_inumber (deleted at zero)
+    J_RMDIR,        // jr_name removed from jr_dir, directory jr_inumber deleted
+    J_IMAGE,        // bytes of the image, written by a checkpoint
+    J_CHECKPOINT,   // the J_IMAGE records before it are whole
+} journal_op_t;
+
+/**
+ * Journal record, followed in the journal by jr_length bytes of payload (the
+ * target path of a new symbolic link; for J_IMAGE, the offset of the bytes in
+ * the image, as a uint64_t, and then the bytes).
+ *
+ * Every record has a log sequence number (LSN), and the inodes it changes are
+ * stamped with it (i_lsn). A record is redone on an inode only if the inode's
+ * LSN is older, so replaying a record that already took effect, or one that a
+ * later operation already superseded, changes nothing.
+ */
+typedef struct {
+    uint32_t jr_checksum; // of the rest of the record and of its payload
+    uint32_t jr_length;   // of the payload
+    uint64_t jr_lsn;
+    uint32_t jr_op;
+    int32_t jr_dir;
+    int32_t jr_inumber;
+    int32_t jr_type; // J_CREATE: the new inode's type
+    char jr_name[MAX_FILE_NAME];
+} journal_record_t;
+
+int journal_open(char const *path, int image_fd);
+void journal_close(void);
+int journal_restore(void);
+size_t journal_replay(void (*redo)(journal_record_t const *record,
+                                   void const *payload),
+                      uint64_t *last_lsn);
+int journal_reset(uint64_t next_lsn);
+int journal_checkpoint(void (*capture)(void),
+                       void (*lost)(uint64_t offset, size_t length));
+void journal_image(uint64_t offset, void const *data, size_t length);
+
+void journal_begin(void);
+void journal_end(void);
+
+uint64_t journal_append(journal_op_t op, int dir, char const *name,
+                        int inumber, int type, void const *payload,
+                        size_t length);
+int journal_commit(uint64_t lsn);
+
+#endif // JOURNAL_H
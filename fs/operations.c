@@ -1,15 +1,49 @@
 #include "operations.h"
+#include "cache.h"
 #include "config.h"
+#include "journal.h"
 #include "state.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "betterassert.h"
 #include <pthread.h>
 
-static pthread_mutex_t *mutex_global;
+/*
+ * Locking
+ *
+ * Every inode has a rwlock. A directory's lock protects its entries (and the
+ * dentry cache entries under it); a file's lock protects its data, size, and
+ * link count. Each open file entry has a mutex protecting its offset, held by
+ * get_open_file_entry until release_open_file_entry.
+ *
+ * Locks are taken in this order, so that no cycle can form:
+ *   1. directory locks, from the root down (a directory before its children);
+ *   2. the lock of one file (never a second one);
+ *   3. an open file entry;
+ *   4. the internal locks of state.c (allocators and dentry cache), which are
+ *      never held across calls;
+ *   5. the buffer cache's lock (see cache.c), which allocators take.
+ *
+ * A borrowed read does not keep its file locked: it pins the file's blocks
+ * (see inode_pin), which truncating or deleting the file then leaves allocated
+ * until the read is released.
+ *
+ * Metadata operations are journaled (on an image): each operation logs its
+ * records while it holds the locks of the inodes they change, and waits for
+ * them to be written after releasing every lock, so that concurrent operations
+ * share the write (see journal.c). A thread holding any inode lock is inside
+ * the journal's barrier (see journal_begin), so checkpoints, which wait for no
+ * thread to be inside it, never copy an operation halfway through.
+ */
 static pthread_rwlock_t *inode_locks;
 
 static tfs_params PARAMS;
@@ -19,6 +53,16 @@ tfs_params tfs_default_params() {
         .max_block_count = 1024,
         .max_open_files_count =16, 
         .block_size = 1024,
+        .image_path = NULL,
+        .flush_interval_ms = 0,
+        .latency =
+            {
+                .mode = TFS_LATENCY_SPIN,
+                .seek_ns = {DEFAULT_ACCESS_NS, DEFAULT_ACCESS_NS,
+                            DEFAULT_ACCESS_NS},
+            },
+        .cache_frames = DEFAULT_CACHE_FRAMES,
+        .readahead_max_blocks = DEFAULT_READAHEAD_BLOCKS,
     };
 
     // define PARAMS as global
@@ -34,22 +78,21 @@ int tfs_init(tfs_params const *params_ptr) {
     } else {
         params = tfs_default_params();
     }
+    PARAMS = params;
 
     if (state_init(params) != 0) {
         return -1;
     }
 
-    // create root inode
-    if (inode_create(T_DIRECTORY) != ROOT_DIR_INUM) {
-        return -1;
-    }
-
-    mutex_global = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
-    if (mutex_global == NULL)
-        return -1;
-
-    if (pthread_mutex_init(mutex_global, NULL) != 0) {
-        return -1;
+    // create root inode (unless it came with an existing image), inside the
+    // barrier since the flusher may already be checkpointing
+    if (!state_loaded()) {
+        journal_begin();
+        int root = inode_create(T_DIRECTORY);
+        journal_end();
+        if (root != ROOT_DIR_INUM) {
+            return -1;
+        }
     }
 
     inode_locks =
@@ -68,16 +111,36 @@ int tfs_init(tfs_params const *params_ptr) {
     return 0;
 }
 
-int tfs_destroy() {
-    if (state_destroy() != 0) {
+/**
+ * Write out the writes buffered in every open handle (see tfs_flush).
+ *
+ * Returns 0 if successful, -1 if some could not all be written.
+ */
+static int handles_flush(void) {
+    int *fhandles = malloc(PARAMS.max_open_files_count * sizeof(int));
+    if (fhandles == NULL) {
         return -1;
     }
 
-    if (pthread_mutex_destroy(mutex_global) != 0) {
-        return -1;
+    int result = 0;
+    size_t count = open_file_table_handles(fhandles);
+    for (size_t i = 0; i < count; i++) {
+        // (a handle closed meanwhile was flushed by its close)
+        if (tfs_flush(fhandles[i]) == -1 &&
+            find_open_file_entry(fhandles[i]) != NULL) {
+            result = -1;
+        }
     }
+    free(fhandles);
+    return result;
+}
 
-    free(mutex_global);
+int tfs_destroy() {
+    // handles left open lose nothing they buffered
+    int flushed = inode_locks != NULL ? handles_flush() : 0;
+    if (state_destroy() != 0) {
+        return -1;
+    }
 
     // destroy inode locks
     for (int i = 0; i < PARAMS.max_inode_count; i++) {
@@ -87,369 +150,2062 @@ int tfs_destroy() {
     }
 
     free(inode_locks);
-    return 0;
-}
-
-static bool valid_pathname(char const *name) {
-    return name != NULL && strlen(name) > 1 && name[0] == '/';
+    inode_locks = NULL;
+    return flushed;
 }
 
-/**
- * Looks for a file.
- *
- * Note: as a simplification, only a plain directory space (root directory only)
- * is supported.
- *
- * Input:
- *   - name: absolute path name
- *   - root_inode: the root directory inode
- * Returns the inumber of the file, -1 if unsuccessful.
- */
-static int tfs_lookup(char const *name, inode_t const *root_inode) {
-    inode_t *root = inode_get(ROOT_DIR_INUM);
-
-    ALWAYS_ASSERT(root != NULL, "tfs_open: root dir inode must exist");
-
-    if (root != root_inode) {
+int tfs_mount(char const *image_path) {
+    // the geometry comes from the image
+    tfs_params params = tfs_default_params();
+    if (image_path == NULL || state_image_params(image_path, &params) == -1) {
         return -1;
     }
 
-    if (!valid_pathname(name)) {
-        return -1;
-    }
-
-    // skip the initial '/' character
-    name++;
-    return find_in_dir(root_inode, name);
+    params.image_path = image_path;
+    return tfs_init(&params);
 }
 
-int tfs_open(char const *name, tfs_file_mode_t mode) {
-    // Checks if the path name is valid
-    if (!valid_pathname(name)) {
-        return -1;
+int tfs_unmount(void) {
+    if (inode_locks == NULL || PARAMS.image_path == NULL) {
+        return -1; // no image mounted
     }
 
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_dir_inode != NULL,
-                  "tfs_open: root dir inode must exist");
-
-    pthread_mutex_lock(mutex_global);
-    int inum = tfs_lookup(name, root_dir_inode);
-    size_t offset = 0;
-
-    if (inum >= 0) {
-        // The file already exists
-        inode_t *inode = inode_get(inum);
-        pthread_mutex_unlock(mutex_global);
-
-        ALWAYS_ASSERT(inode != NULL,
-                      "tfs_open: directory files must have an inode");
+    return tfs_destroy();
+}
 
-        // handle recursion open of symbolic links
-        if (inode->i_node_type == T_LINK) {
-            // read symlink file content
-            int file = add_to_open_file_table(inum, 0);
+int tfs_sync(void) {
+    if (inode_locks == NULL) {
+        return -1; // not initialized
+    }
 
-            pthread_rwlock_wrlock(&inode_locks[inum]);
-            // copy file data to buffer
-            char buffer[PARAMS.block_size];
-            tfs_read(file, buffer, PARAMS.block_size);
-            pthread_rwlock_unlock(&inode_locks[inum]);
+    // buffered writes are made first, so that the sync includes them
+    int flushed = handles_flush();
+    int synced = state_sync();
+    return flushed == -1 ? -1 : synced;
+}
 
-            // close and remove from open file table the symlink file
-            remove_from_open_file_table(file);
+int tfs_cache_stats(tfs_cache_stats_t *stats) {
+    if (inode_locks == NULL || stats == NULL) {
+        return -1; // not initialized
+    }
 
-            if (valid_pathname(buffer))
-                return tfs_open(buffer, mode);
-        }
+    cache_stats(stats);
+    return 0;
+}
 
-        // Truncate (if requested)
-        if (mode & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                pthread_mutex_lock(mutex_global);
-                data_block_free(inode->i_data_block);
-                inode->i_size = 0;
-                pthread_mutex_unlock(mutex_global);
-            }
-        }
-        // Determine initial offset
-        if (mode & TFS_O_APPEND) {
-            offset = inode->i_size;
-        }
-    } else if (mode & TFS_O_CREAT) {
-        // The file does not exist; the mode specified that it should be created
-        // Create inode
-        inum = inode_create(T_FILE);
-        if (inum == -1) {
-            pthread_mutex_unlock(mutex_global);
-            return -1; // no space in inode table
-        }
+static bool valid_pathname(char const *name) {
+    return name != NULL && strlen(name) > 1 && name[0] == '/';
+}
 
-        // Add entry in the root directory
-        if (add_dir_entry(root_dir_inode, name + 1, inum) == -1) {
-            inode_delete(inum);
-            pthread_mutex_unlock(mutex_global);
-            return -1; // no space in directory
-        }
-        pthread_mutex_unlock(mutex_global);
+static inline void inode_lock(int inumber, bool write) {
+    journal_begin();
+    if (write) {
+        pthread_rwlock_wrlock(&inode_locks[inumber]);
     } else {
-        pthread_mutex_unlock(mutex_global);
-        return -1;
+        pthread_rwlock_rdlock(&inode_locks[inumber]);
     }
+}
 
-    return add_to_open_file_table(inum, offset);
+/**
+ * Lock an inode for writing, unless it is already locked.
+ *
+ * Returns true if it was locked.
+ */
+static inline bool inode_trylock(int inumber) {
+    journal_begin();
+    if (pthread_rwlock_trywrlock(&inode_locks[inumber]) != 0) {
+        journal_end();
+        return false;
+    }
+    return true;
+}
 
-    // Note: for simplification, if file was created with TFS_O_CREAT and there
-    // is an error adding an entry to the open file table, the file is not
-    // opened but it remains created
+static inline void inode_unlock(int inumber) {
+    pthread_rwlock_unlock(&inode_locks[inumber]);
+    journal_end();
 }
 
-int tfs_sym_link(char const *target, char const *link_name) {
-    if (!valid_pathname(link_name))
-        return -1;
+/**
+ * Log a metadata operation that was just applied, and stamp its LSN on the
+ * inodes it changed (see journal.h), which the caller must still hold locked.
+ *
+ * Input:
+ *   - op: the operation
+ *   - dir_inumber: directory whose entries changed (-1 for none)
+ *   - sub_name: name of the entry that changed (NULL for none)
+ *   - inumber: inode that was created, linked or unlinked
+ *   - payload, length: data stored with the record
+ *
+ * Returns the LSN to commit once every lock is released.
+ */
+static uint64_t metadata_log(journal_op_t op, int dir_inumber,
+                             char const *sub_name, int inumber,
+                             void const *payload, size_t length) {
+    inode_t *inode = inode_get(inumber);
+    inode_t *dir = dir_inumber != -1 ? inode_get(dir_inumber) : NULL;
+    bool inode_changed = op != J_ENTRY_ADD && op != J_ENTRY_REMOVE;
 
-    inode_t *root_node = inode_get(ROOT_DIR_INUM);
+    // the changes must be marked dirty before they are logged: a sync that
+    // empties the journal then writes them (see journal_checkpoint)
+    if (dir != NULL) {
+        inode_mark_dirty(dir);
+    }
+    if (inode_changed) {
+        inode_mark_dirty(inode);
+    }
 
-    // check if the target file exists
-    pthread_mutex_lock(mutex_global);
-    if (tfs_lookup(target, root_node) == -1) { // if the file doesnt exist
-        pthread_mutex_unlock(mutex_global);
-        return -1;
+    uint64_t lsn = journal_append(op, dir_inumber, sub_name, inumber,
+                                  (int)inode->i_node_type, payload, length);
+    if (lsn == 0) {
+        return 0; // not journaled
     }
-    pthread_mutex_unlock(mutex_global);
 
-    // create the file (with tfs open trick)
-    int fhandle = tfs_open(link_name, TFS_O_CREAT);
-    if (fhandle == -1)
-        return -1;
+    if (dir != NULL) {
+        dir->i_lsn = lsn;
+        inode_mark_dirty(dir);
+    }
+    if (inode_changed) {
+        inode->i_lsn = lsn;
+        inode_mark_dirty(inode);
+    }
+    return lsn;
+}
 
-    // get the inumber
-    pthread_mutex_lock(mutex_global);
-    int inumber = tfs_lookup(link_name, root_node);
+/**
+ * Create an inode (empty) with an entry for it in a directory, which the
+ * caller holds write-locked, and log it.
+ *
+ * Input:
+ *   - dir_inumber: the directory
+ *   - sub_name: name of the entry (not taken)
+ *   - type: type of the inode
+ *   - lsn: where to store the LSN of the record, to commit
+ *
+ * Returns the inumber of the new inode, or -1 if there is no space for it (in
+ * the inode table, or in the directory).
+ */
+static int dir_create_locked(int dir_inumber, char const *sub_name,
+                             inode_type type, uint64_t *lsn) {
+    int inumber = inode_create(type);
     if (inumber == -1) {
-        pthread_mutex_unlock(mutex_global);
         return -1;
     }
-
-    // get the inode
-    inode_t *inode = inode_get(inumber);
-    if (inode == NULL) {
-        pthread_mutex_unlock(mutex_global);
+    if (add_dir_entry(inode_get(dir_inumber), sub_name, inumber) == -1) {
+        inode_delete(inumber);
         return -1;
     }
+    *lsn = metadata_log(J_CREATE, dir_inumber, sub_name, inumber, NULL, 0);
+    return inumber;
+}
 
-    // set the inode type to T_LINK
-    inode->i_node_type = T_LINK;
-    pthread_mutex_unlock(mutex_global);
-
-    pthread_rwlock_wrlock(&inode_locks[inumber]);
-    // write the path of the target to the file
-    if (tfs_write(fhandle, target, strlen(target) + 1) == -1) {
-        pthread_rwlock_unlock(&inode_locks[inumber]);
+/**
+ * Copy the next component of a path name.
+ *
+ * Input:
+ *   - path: position in the path name, at the '/' before the component; it is
+ *     moved to the end of the component
+ *   - component: where to store the component (MAX_FILE_NAME bytes)
+ *
+ * Returns 0 if successful, -1 if the component is empty or too long.
+ */
+static int next_component(char const **path, char *component) {
+    char const *start = *path + 1; // skip the '/'
+    size_t len = strcspn(start, "/");
+    if (len == 0 || len > MAX_FILE_NAME - 1) {
         return -1;
     }
-    pthread_rwlock_unlock(&inode_locks[inumber]);
 
-    // close the file
-    tfs_close(fhandle);
+    memcpy(component, start, len);
+    component[len] = '\0';
+    *path = start + len;
     return 0;
 }
 
-int tfs_link(char const *target, char const *link_name) {
-    if (!valid_pathname(link_name))
-        return -1;
-
-    pthread_mutex_lock(mutex_global);
-    inode_t *root_node = inode_get(ROOT_DIR_INUM);
-
-    // check if the target file exists
-    int target_inumber = tfs_lookup(target, root_node);
-    if (target_inumber == -1) {
-        pthread_mutex_unlock(mutex_global);
+/**
+ * Walk a path name down to the directory that holds its last component.
+ *
+ * Each directory on the way is read-locked while its entry for the next
+ * component is looked up, and the next directory is locked before the previous
+ * one is released (lock coupling), so no directory can be removed while the
+ * walk goes through it.
+ *
+ * Input:
+ *   - name: absolute path name
+ *   - sub_name: where to store the last component (MAX_FILE_NAME bytes)
+ *   - write: whether to write-lock (instead of read-lock) the directory that
+ *     holds the last component
+ *
+ * Returns the inumber of that directory, which is left locked, or -1 if
+ * unsuccessful (nothing is left locked).
+ */
+static int tfs_lookup_parent(char const *name, char *sub_name, bool write) {
+    if (!valid_pathname(name) || next_component(&name, sub_name) == -1) {
         return -1;
     }
 
-    // check if it is soft_link
-    inode_t *target_node = inode_get(target_inumber);
-    if (target_node->i_node_type == T_LINK) {
-        pthread_mutex_unlock(mutex_global);
-        return -1;
-    }
+    int dir_inumber = ROOT_DIR_INUM;
+    inode_lock(dir_inumber, write && *name == '\0');
 
-    // add hardlink and handle error
-    if (add_dir_entry(root_node, link_name + 1, target_inumber) == -1) {
-        pthread_mutex_unlock(mutex_global);
-        return -1;
+    while (*name != '\0') {
+        // sub_name is a directory in the middle of the path
+        inode_type sub_type;
+        int sub_inumber = dir_lookup(dir_inumber, sub_name, &sub_type);
+        if (sub_inumber == -1 || sub_type != T_DIRECTORY ||
+            next_component(&name, sub_name) == -1) {
+            inode_unlock(dir_inumber);
+            return -1;
+        }
+
+        inode_lock(sub_inumber, write && *name == '\0');
+        inode_unlock(dir_inumber);
+        dir_inumber = sub_inumber;
     }
 
-    target_node->hard_links++;
-    pthread_mutex_unlock(mutex_global);
-    return 0;
+    return dir_inumber;
 }
 
-int tfs_close(int fhandle) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
-        return -1; // invalid fd
+/**
+ * Looks for a file.
+ *
+ * Input:
+ *   - name: absolute path name ("/" for the root directory)
+ *   - write: whether to write-lock (instead of read-lock) the file
+ *
+ * Returns the inumber of the file, which is left locked, or -1 if unsuccessful
+ * (nothing is left locked).
+ */
+static int tfs_lookup(char const *name, bool write) {
+    if (name != NULL && strcmp(name, "/") == 0) {
+        inode_lock(ROOT_DIR_INUM, write);
+        return ROOT_DIR_INUM;
     }
 
-    remove_from_open_file_table(fhandle);
-    return 0;
-}
-
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
+    char sub_name[MAX_FILE_NAME];
+    int dir_inumber = tfs_lookup_parent(name, sub_name, false);
+    if (dir_inumber == -1) {
         return -1;
     }
 
-    //  From the open file table entry, we get the inode
-    inode_t *inode = inode_get(file->of_inumber);
-    ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
-
-    // Determine how many bytes to write
-    size_t block_size = state_block_size();
-    if (to_write + file->of_offset > block_size) {
-        to_write = block_size - file->of_offset;
+    int inumber = dir_lookup(dir_inumber, sub_name, NULL);
+    if (inumber != -1) {
+        inode_lock(inumber, write);
     }
+    inode_unlock(dir_inumber);
+    return inumber;
+}
 
-    if (to_write > 0) {
-        if (inode->i_size == 0) {
-            // If empty file, allocate new block
-            int bnum = data_block_alloc();
-            if (bnum == -1) {
-                return -1; // no space
-            }
-
-            inode->i_data_block = bnum;
+/**
+ * Copy between a range of a file and a list of buffers, with one memcpy per
+ * (extent, buffer) pair.
+ *
+ * Input:
+ *   - inode: the file's inode (with data blocks mapped for the whole range)
+ *   - offset: file offset where the range starts
+ *   - iov: the buffers, in file order; when writing, a NULL iov_base fills its
+ *     part of the range with zeros
+ *   - len: length of the range (at most the total length of the buffers)
+ *   - write: whether to copy from the buffers to the file (or the reverse)
+ */
+static void file_copy_range(inode_t const *inode, size_t offset,
+                            struct iovec const *iov, size_t len, bool write) {
+    size_t block_size = state_block_size();
+    size_t copied = 0;
+    size_t iov_offset = 0; // position within *iov
+    while (copied < len) {
+        size_t block_offset = (offset + copied) % block_size;
+        size_t run;
+        int bnum = inode_block(inode, (offset + copied) / block_size, &run);
+        ALWAYS_ASSERT(bnum != -1, "file_copy_range: range is not mapped");
+
+        // the blocks of an extent are contiguous in memory
+        size_t chunk = run * block_size - block_offset;
+        if (chunk > len - copied) {
+            chunk = len - copied;
         }
 
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
+        char *block = data_block_get_run(
+            bnum, (block_offset + chunk + block_size - 1) / block_size);
+        ALWAYS_ASSERT(block != NULL,
+                      "file_copy_range: data block deleted mid-copy");
+        block += block_offset;
+
+        // Perform the actual copy, spreading the run over the buffers
+        for (size_t done = 0; done < chunk;) {
+            while (iov_offset == iov->iov_len) {
+                iov++;
+                iov_offset = 0;
+            }
 
-        // Perform the actual write
-        memcpy(block + file->of_offset, buffer, to_write);
+            size_t n = iov->iov_len - iov_offset;
+            if (n > chunk - done) {
+                n = chunk - done;
+            }
 
-        // The offset associated with the file handle is incremented
-        // accordingly
-        file->of_offset += to_write;
-        if (file->of_offset > inode->i_size) {
-            inode->i_size = file->of_offset;
+            char *base = iov->iov_base;
+            if (!write) {
+                memcpy(base + iov_offset, block + done, n);
+            } else if (base == NULL) {
+                memset(block + done, 0, n);
+            } else {
+                memcpy(block + done, base + iov_offset, n);
+            }
+            done += n;
+            iov_offset += n;
+        }
+        if (write) {
+            data_block_mark_dirty(
+                bnum, (block_offset + chunk + block_size - 1) / block_size);
         }
+        copied += chunk;
     }
-
-    return (ssize_t)to_write;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
+/**
+ * Add up the lengths of a list of buffers.
+ *
+ * Returns 0 if successful, -1 if the list is invalid (negative count, or the
+ * total does not fit in ssize_t).
+ */
+static int iov_length(struct iovec const *iov, int iovcnt, size_t *len) {
+    if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) {
         return -1;
     }
 
-    // From the open file table entry, we get the inode
-    inode_t const *inode = inode_get(file->of_inumber);
-    ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
+    *len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > SSIZE_MAX - *len) {
+            return -1;
+        }
+        *len += iov[i].iov_len;
+    }
+    return 0;
+}
 
+/**
+ * Read from a file into a list of buffers, starting at a given offset.
+ *
+ * Returns the number of bytes read (lower than len, the total length of the
+ * buffers, if the end of the file is reached).
+ */
+static size_t inode_readv(inode_t const *inode, size_t offset,
+                          struct iovec const *iov, size_t len) {
     // Determine how many bytes to read
-    size_t to_read = inode->i_size - file->of_offset;
+    size_t to_read = 0;
+    if (offset < inode->i_size) {
+        to_read = inode->i_size - offset;
+    }
     if (to_read > len) {
         to_read = len;
     }
 
     if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
-
-        // Perform the actual read
-        memcpy(buffer, block + file->of_offset, to_read);
-        // The offset associated with the file handle is incremented
-        // accordingly
-        file->of_offset += to_read;
+        file_copy_range(inode, offset, iov, to_read, false);
     }
-
-    return (ssize_t)to_read;
+    return to_read;
 }
 
-int tfs_unlink(char const *target) {
-    inode_t *root_node = inode_get(ROOT_DIR_INUM);
+/**
+ * Write a list of buffers to a file, starting at a given offset.
+ *
+ * Returns the number of bytes written (lower than to_write, the total length of
+ * the buffers, if the maximum file size is reached or there are not enough free
+ * blocks), or -1 if no bytes could be written.
+ */
+static ssize_t inode_writev(inode_t *inode, size_t offset,
+                            struct iovec const *iov, size_t to_write) {
+    // Determine how many bytes to write
+    size_t max_size = inode_max_size();
+    if (offset >= max_size) {
+        to_write = 0;
+    } else if (to_write > max_size - offset) {
+        to_write = max_size - offset;
+    }
 
-    pthread_mutex_lock(mutex_global);
-    int inumber = tfs_lookup(target, root_node);
-    if (inumber == -1) {
-        pthread_mutex_unlock(mutex_global);
-        return -1;
+    if (to_write == 0) {
+        return 0;
     }
 
-    inode_t *node = inode_get(inumber);
+    // Map the blocks for the whole range at once (as few extents as possible)
+    size_t block_size = state_block_size();
+    size_t end = offset + to_write;
+    size_t mapped =
+        inode_grow(inode, (end + block_size - 1) / block_size) * block_size;
+    if (mapped <= offset) {
+        return -1; // no space
+    } else if (mapped < end) {
+        to_write = mapped - offset;
+    }
 
-    // Soft-link
-    if (node->i_node_type == T_LINK) {
-        inode_delete(inumber);
-    } else {
-        // Hard-link
-        node->hard_links--;
-        if (node->hard_links == 0) {
-            inode_delete(inumber);
-        }
+    // Bytes between the end of the file and the offset read as zeros
+    if (offset > inode->i_size) {
+        struct iovec zeros = {.iov_base = NULL,
+                              .iov_len = offset - inode->i_size};
+        file_copy_range(inode, inode->i_size, &zeros, zeros.iov_len, true);
     }
+    file_copy_range(inode, offset, iov, to_write, true);
 
-    if (clear_dir_entry(root_node, target + 1) == -1) {
-        pthread_mutex_unlock(mutex_global);
-        return -1;
+    if (offset + to_write > inode->i_size) {
+        inode->i_size = offset + to_write;
+        inode_mark_dirty(inode);
     }
+    return (ssize_t)to_write;
+}
 
-    pthread_mutex_unlock(mutex_global);
-    return 0;
+static size_t inode_read(inode_t const *inode, size_t offset, void *buffer,
+                         size_t len) {
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+    return inode_readv(inode, offset, &iov, len);
 }
 
-int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
-    if (!valid_pathname(dest_path))
+static ssize_t inode_write(inode_t *inode, size_t offset, void const *buffer,
+                           size_t len) {
+    // the buffer is only read from
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = len};
+    return inode_writev(inode, offset, &iov, len);
+}
+
+/**
+ * Open a handle to a file, with a write buffer if the mode asks for one.
+ *
+ * Returns the file handle, or -1 in case of error.
+ */
+static int open_handle(int inumber, size_t offset, tfs_file_mode_t mode) {
+    int fhandle = add_to_open_file_table(inumber, offset);
+    if (fhandle == -1 || !(mode & TFS_O_BUFFERED)) {
+        return fhandle;
+    }
+
+    char *buffer = malloc(WRITE_BUFFER_BLOCKS * state_block_size());
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (buffer == NULL || file == NULL) {
+        free(buffer);
+        if (file != NULL) {
+            release_open_file_entry(file);
+            remove_from_open_file_table(fhandle);
+        }
         return -1;
+    }
+    file->of_buffer = buffer;
+    release_open_file_entry(file);
+    return fhandle;
+}
 
-    // Open the file for reading
-    FILE *fp = fopen(source_path, "r");
-    if (!fp) {
+int tfs_open(char const *name, tfs_file_mode_t mode) {
+    // Finds (and locks) the directory where the file is
+    char sub_name[MAX_FILE_NAME];
+    int dir_inumber = tfs_lookup_parent(name, sub_name, mode & TFS_O_CREAT);
+    if (dir_inumber == -1) {
         return -1;
     }
 
-    // additional logic to check if fopen reads all the bytes of the file
-    fseek(fp, 0, SEEK_END); // moves file pointer to the end of file
-    size_t file_size = (size_t)ftell(fp); // returns current byte
-    rewind(fp); // moves file pointer to the beginning of file
+    inode_type type;
+    int inum = dir_lookup(dir_inumber, sub_name, &type);
+    size_t offset = 0;
 
-    // Allocate a buffer to hold the file contents
-    char buffer[PARAMS.block_size];
+    if (inum >= 0) {
+        // The file already exists
+        if (type == T_DIRECTORY) {
+            inode_unlock(dir_inumber);
+            return -1; // directories cannot be opened
+        }
 
-    // Read the file contents into the buffer
-    size_t bytes_read = fread(buffer, 1, file_size, fp);
-    // close file
-    fclose(fp);
+        // a plain open needs nothing from the inode itself, but the handle
+        // is registered before releasing the directory, so the file cannot be
+        // unlinked (and its inode reused) in between
+        if (type == T_FILE && !(mode & (TFS_O_TRUNC | TFS_O_APPEND))) {
+            int fhandle = open_handle(inum, offset, mode);
+            inode_unlock(dir_inumber);
+            return fhandle;
+        }
 
-    if (bytes_read < file_size) {
-        // Error reading the file
-        return -1;
-    }
+        // lock the file before releasing its directory, so it cannot be
+        // unlinked in between
+        inode_lock(inum, type == T_FILE && (mode & TFS_O_TRUNC));
+        inode_unlock(dir_inumber);
 
-    int file_handle = tfs_open(dest_path, TFS_O_CREAT | TFS_O_TRUNC);
-    if (file_handle == -1) {
-        return -1;
-    }
+        inode_t *inode = inode_get(inum);
+        ALWAYS_ASSERT(inode != NULL,
+                      "tfs_open: directory files must have an inode");
 
-    // get tfs file inumber
-    pthread_mutex_lock(mutex_global);
-    int inumber = tfs_lookup(dest_path, inode_get(ROOT_DIR_INUM));
-    pthread_mutex_unlock(mutex_global);
+        // handle recursion open of symbolic links
+        if (type == T_LINK) {
+            // read symlink file content (the target path)
+            char target[inode->i_size + 1];
+            target[inode_read(inode, 0, target, inode->i_size)] = '\0';
+            inode_unlock(inum);
 
-    pthread_rwlock_wrlock(&inode_locks[inumber]);
-    if (tfs_write(file_handle, buffer, file_size) == -1) {
-        pthread_rwlock_unlock(&inode_locks[inumber]);
-        return -1;
-    }
-    pthread_rwlock_unlock(&inode_locks[inumber]);
+            return valid_pathname(target) ? tfs_open(target, mode) : -1;
+        }
 
-    if (tfs_close(file_handle) == -1) {
-        return -1;
-    }
-    return 0;
-}
\ No newline at end of file
+        // Truncate (if requested)
+        if ((mode & TFS_O_TRUNC) && inode->i_size > 0) {
+            inode_truncate(inode);
+        }
+        // Determine initial offset
+        if (mode & TFS_O_APPEND) {
+            offset = inode->i_size;
+        }
+        int fhandle = open_handle(inum, offset, mode);
+        inode_unlock(inum);
+        return fhandle;
+    } else if (mode & TFS_O_CREAT) {
+        // The file does not exist; the mode specified that it should be created
+        uint64_t lsn;
+        inum = dir_create_locked(dir_inumber, sub_name, T_FILE, &lsn);
+        if (inum == -1) {
+            inode_unlock(dir_inumber);
+            return -1; // no space in inode table or directory
+        }
+        // Note: for simplification, if there is an error adding an entry to
+        // the open file table, the file is not opened but it remains created
+        int fhandle = open_handle(inum, offset, mode);
+        inode_unlock(dir_inumber);
+        if (journal_commit(lsn) == -1) {
+            if (fhandle != -1) {
+                remove_from_open_file_table(fhandle);
+            }
+            return -1;
+        }
+        return fhandle;
+    }
+
+    inode_unlock(dir_inumber);
+    return -1;
+}
+
+int tfs_sym_link(char const *target, char const *link_name) {
+    // check if the target file exists
+    int target_inumber = tfs_lookup(target, false);
+    if (target_inumber == -1) { // if the file doesnt exist
+        return -1;
+    }
+    inode_unlock(target_inumber);
+
+    char sub_name[MAX_FILE_NAME];
+    int dir_inumber = tfs_lookup_parent(link_name, sub_name, true);
+    if (dir_inumber == -1) {
+        return -1;
+    }
+
+    if (dir_lookup(dir_inumber, sub_name, NULL) != -1) {
+        inode_unlock(dir_inumber);
+        return -1; // the link name is taken
+    }
+
+    // create the link, with the path of the target as its contents, before
+    // making it visible in the directory
+    int inumber = inode_create(T_LINK);
+    if (inumber == -1) {
+        inode_unlock(dir_inumber);
+        return -1;
+    }
+
+    size_t target_len = strlen(target) + 1;
+    if (inode_write(inode_get(inumber), 0, target, target_len) !=
+            (ssize_t)target_len ||
+        add_dir_entry(inode_get(dir_inumber), sub_name, inumber) == -1) {
+        inode_delete(inumber);
+        inode_unlock(dir_inumber);
+        return -1;
+    }
+
+    uint64_t lsn = metadata_log(J_CREATE, dir_inumber, sub_name, inumber,
+                                target, target_len);
+    inode_unlock(dir_inumber);
+    return journal_commit(lsn);
+}
+
+/**
+ * Count one more link to a file, ahead of adding a directory entry for it, so
+ * that it cannot be deleted before that entry exists (a crash before the entry
+ * is logged leaves the count one too high, which keeps the file alive, rather
+ * than too low). Must be called without holding any lock.
+ *
+ * Input:
+ *   - target: absolute path name of the file
+ *   - lsn: where to store the LSN of the change
+ *
+ * Returns the inumber of the file, or -1 if it does not exist (or is not a
+ * file).
+ */
+static int link_count_add(char const *target, uint64_t *lsn) {
+    char sub_name[MAX_FILE_NAME];
+    int dir_inumber = tfs_lookup_parent(target, sub_name, false);
+    if (dir_inumber == -1) {
+        return -1;
+    }
+
+    inode_type target_type;
+    int target_inumber = dir_lookup(dir_inumber, sub_name, &target_type);
+    // soft links (and directories) cannot be linked to
+    if (target_inumber == -1 || target_type != T_FILE) {
+        inode_unlock(dir_inumber);
+        return -1;
+    }
+
+    inode_lock(target_inumber, true);
+    inode_get(target_inumber)->hard_links++;
+    *lsn = metadata_log(J_LINK_ADD, -1, NULL, target_inumber, NULL, 0);
+    inode_unlock(target_inumber);
+    inode_unlock(dir_inumber);
+    return target_inumber;
+}
+
+/**
+ * Drop a link to an inode, whose directory entry is already gone (or was never
+ * added), deleting the inode with its last link. Called with the inode
+ * write-locked.
+ *
+ * Input:
+ *   - inumber: the inode
+ *   - type: its type (a soft link only ever has one link)
+ *
+ * Returns the LSN of the change, to commit.
+ */
+static uint64_t link_count_drop_locked(int inumber, inode_type type) {
+    inode_t *node = inode_get(inumber);
+    node->hard_links--;
+    // logged while the inode is still there to be stamped
+    uint64_t lsn = metadata_log(J_LINK_DROP, -1, NULL, inumber, NULL, 0);
+    if (type == T_LINK || node->hard_links == 0) {
+        inode_delete(inumber);
+    }
+    return lsn;
+}
+
+static uint64_t link_count_drop(int inumber, inode_type type) {
+    inode_lock(inumber, true);
+    uint64_t lsn = link_count_drop_locked(inumber, type);
+    inode_unlock(inumber);
+    return lsn;
+}
+
+int tfs_link(char const *target, char const *link_name) {
+    uint64_t lsn;
+    int target_inumber = link_count_add(target, &lsn);
+    if (target_inumber == -1) {
+        return -1;
+    }
+
+    // add hardlink and handle error
+    char sub_name[MAX_FILE_NAME];
+    int dir_inumber = tfs_lookup_parent(link_name, sub_name, true);
+    if (dir_inumber != -1) {
+        if (dir_lookup(dir_inumber, sub_name, NULL) == -1 &&
+            add_dir_entry(inode_get(dir_inumber), sub_name, target_inumber) ==
+                0) {
+            lsn = metadata_log(J_ENTRY_ADD, dir_inumber, sub_name,
+                               target_inumber, NULL, 0);
+            inode_unlock(dir_inumber);
+            return journal_commit(lsn);
+        }
+        inode_unlock(dir_inumber);
+    }
+
+    // undo the link count
+    journal_commit(link_count_drop(target_inumber, T_FILE));
+    return -1;
+}
+
+/**
+ * Write out the writes buffered in a handle. Called with the handle and its
+ * file (write-)locked.
+ *
+ * Returns 0 if successful, -1 if not everything could be written (what was not
+ * is dropped, and the handle's offset is moved back to the end of what was).
+ */
+static int file_flush_locked(open_file_entry_t *file) {
+    if (file->of_buffered == 0) {
+        return 0;
+    }
+
+    size_t offset = file->of_offset - file->of_buffered;
+    ssize_t written = inode_write(inode_get(file->of_inumber), offset,
+                                  file->of_buffer, file->of_buffered);
+    bool complete = written == (ssize_t)file->of_buffered;
+    if (!complete) {
+        file->of_offset = offset + (written > 0 ? (size_t)written : 0);
+    }
+    file->of_buffered = 0;
+    return complete ? 0 : -1;
+}
+
+/**
+ * Lock an open file handle, and the file behind it.
+ *
+ * The file is locked before the handle (see the lock order above), so the
+ * handle is looked up, released while the file is locked, and then locked
+ * again. Writes still buffered in the handle are made first (with the file
+ * write-locked), so that every operation through it sees them.
+ *
+ * Input:
+ *   - fhandle: file handle
+ *   - write: whether to write-lock (instead of read-lock) the file
+ *
+ * Returns the handle's entry, locked (as is its file), or NULL if the handle is
+ * invalid, or its buffered writes could not all be made.
+ */
+static open_file_entry_t *file_lock(int fhandle, bool write) {
+    while (true) {
+        open_file_entry_t *file = get_open_file_entry(fhandle);
+        if (file == NULL) {
+            return NULL;
+        }
+        int inumber = file->of_inumber;
+        bool write_lock = write || file->of_buffered > 0;
+        release_open_file_entry(file);
+
+        inode_lock(inumber, write_lock);
+        // the handle may have been closed meanwhile; if not, it is still the
+        // same open file (and so the same inumber), as the generation matched
+        file = get_open_file_entry(fhandle);
+        if (file == NULL) {
+            inode_unlock(inumber);
+            return NULL;
+        }
+
+        if (file->of_buffered > 0) {
+            if (!write_lock) {
+                // buffered meanwhile: flush with the file write-locked
+                release_open_file_entry(file);
+                inode_unlock(inumber);
+                continue;
+            }
+            if (file_flush_locked(file) == -1) {
+                release_open_file_entry(file);
+                inode_unlock(inumber);
+                return NULL;
+            }
+        }
+        if (write_lock != write) {
+            // flushed: now lock the file as asked
+            release_open_file_entry(file);
+            inode_unlock(inumber);
+            continue;
+        }
+        return file;
+    }
+}
+
+static void file_unlock(open_file_entry_t *file) {
+    // read before the release, after which the handle may be closed
+    int inumber = file->of_inumber;
+    release_open_file_entry(file);
+    inode_unlock(inumber);
+}
+
+int tfs_flush(int fhandle) {
+    // only buffered writes need the file
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+    bool buffered = file->of_buffered > 0;
+    release_open_file_entry(file);
+    if (!buffered) {
+        return 0;
+    }
+
+    file = file_lock(fhandle, true);
+    if (file == NULL) {
+        return -1;
+    }
+    file_unlock(file);
+    return 0;
+}
+
+int tfs_close(int fhandle) {
+    int flushed = tfs_flush(fhandle);
+    // fails for invalid, stale and already closed handles
+    if (remove_from_open_file_table(fhandle) == -1) {
+        return -1;
+    }
+    return flushed;
+}
+
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+    // a buffered write that fits only needs the handle
+    size_t buffer_size = WRITE_BUFFER_BLOCKS * state_block_size();
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+    if (file->of_buffer != NULL &&
+        to_write <= buffer_size - file->of_buffered) {
+        memcpy(file->of_buffer + file->of_buffered, buffer, to_write);
+        file->of_buffered += to_write;
+        file->of_offset += to_write;
+        release_open_file_entry(file);
+        return (ssize_t)to_write;
+    }
+    release_open_file_entry(file);
+
+    // the buffer is flushed (see file_lock); a write smaller than it starts
+    // filling it again
+    file = file_lock(fhandle, true);
+    if (file == NULL) {
+        return -1;
+    }
+    if (file->of_buffer != NULL && to_write < buffer_size) {
+        memcpy(file->of_buffer, buffer, to_write);
+        file->of_buffered = to_write;
+        file->of_offset += to_write;
+        file_unlock(file);
+        return (ssize_t)to_write;
+    }
+
+    //  From the open file table entry, we get the inode
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
+
+    ssize_t written = inode_write(inode, file->of_offset, buffer, to_write);
+    if (written > 0) {
+        // The offset associated with the file handle is incremented
+        // accordingly
+        file->of_offset += (size_t)written;
+    }
+    file_unlock(file);
+
+    return written;
+}
+
+/**
+ * Track the access pattern of the reads through a handle (with its offset, or
+ * with tfs_pread). A read that starts where the previous one ended confirms
+ * sequential access: the readahead window grows, and the blocks in it past the
+ * read are prefetched in the background. Any other read turns readahead off
+ * until reads are sequential again. Called before the read, with the handle
+ * and its file locked.
+ *
+ * Input:
+ *   - file: the handle's entry
+ *   - inode: the file's inode
+ *   - offset, len: the range about to be read
+ */
+static void file_readahead(open_file_entry_t *file, inode_t const *inode,
+                           size_t offset, size_t len) {
+    size_t end = offset;
+    if (offset < inode->i_size) {
+        end += len < inode->i_size - offset ? len : inode->i_size - offset;
+    }
+    bool sequential = offset == file->of_ra_next;
+    file->of_ra_next = end;
+
+    size_t max_window = PARAMS.readahead_max_blocks;
+    if (!sequential || max_window == 0) {
+        file->of_ra_window = 0;
+        file->of_ra_prefetched = 0;
+        return;
+    }
+    if (end == offset) {
+        return;
+    }
+
+    size_t window = file->of_ra_window == 0 ? READAHEAD_MIN_BLOCKS
+                                            : 2 * file->of_ra_window;
+    file->of_ra_window = window < max_window ? window : max_window;
+
+    // from the first block the read does not reach, skipping what was
+    // already requested; only once less than half a window is left ahead, so
+    // that each request is a long run (a single seek)
+    size_t block_size = state_block_size();
+    size_t first = (end + block_size - 1) / block_size;
+    if (file->of_ra_prefetched > first + file->of_ra_window / 2) {
+        return;
+    }
+    size_t last = first + file->of_ra_window;
+    if (last > inode->i_block_count) {
+        last = inode->i_block_count;
+    }
+    if (first < file->of_ra_prefetched) {
+        first = file->of_ra_prefetched;
+    }
+    while (first < last) {
+        size_t run;
+        int bnum = inode_block(inode, first, &run);
+        ALWAYS_ASSERT(bnum != -1, "file_readahead: file data is not mapped");
+        if (run > last - first) {
+            run = last - first;
+        }
+        data_block_prefetch(bnum, run);
+        first += run;
+    }
+    if (last > file->of_ra_prefetched) {
+        file->of_ra_prefetched = last;
+    }
+}
+
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    open_file_entry_t *file = file_lock(fhandle, false);
+    if (file == NULL) {
+        return -1;
+    }
+
+    // From the open file table entry, we get the inode
+    inode_t const *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
+
+    file_readahead(file, inode, file->of_offset, len);
+    size_t read = inode_read(inode, file->of_offset, buffer, len);
+
+    // The offset associated with the file handle is incremented accordingly
+    file->of_offset += read;
+    file_unlock(file);
+
+    return (ssize_t)read;
+}
+
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
+    size_t to_write;
+    if (iov_length(iov, iovcnt, &to_write) == -1) {
+        return -1;
+    }
+
+    // the handle stays locked throughout, so the whole vector lands at one
+    // offset, and the offset moves past all of it at once
+    open_file_entry_t *file = file_lock(fhandle, true);
+    if (file == NULL) {
+        return -1;
+    }
+
+    ssize_t written = inode_writev(inode_get(file->of_inumber),
+                                   file->of_offset, iov, to_write);
+    if (written > 0) {
+        file->of_offset += (size_t)written;
+    }
+    file_unlock(file);
+
+    return written;
+}
+
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt) {
+    size_t len;
+    if (iov_length(iov, iovcnt, &len) == -1) {
+        return -1;
+    }
+
+    open_file_entry_t *file = file_lock(fhandle, false);
+    if (file == NULL) {
+        return -1;
+    }
+
+    inode_t const *inode = inode_get(file->of_inumber);
+    file_readahead(file, inode, file->of_offset, len);
+    size_t read = inode_readv(inode, file->of_offset, iov, len);
+    file->of_offset += read;
+    file_unlock(file);
+
+    return (ssize_t)read;
+}
+
+ssize_t tfs_read_borrow(int fhandle, size_t len, void const **view) {
+    open_file_entry_t *file = file_lock(fhandle, false);
+    if (file == NULL) {
+        return -1;
+    }
+
+    inode_t const *inode = inode_get(file->of_inumber);
+    size_t offset = file->of_offset;
+    size_t available = offset < inode->i_size ? inode->i_size - offset : 0;
+    if (available > len) {
+        available = len;
+    }
+    if (available == 0) {
+        file_unlock(file);
+        *view = NULL;
+        return 0;
+    }
+
+    // the view ends with the extent (the next one is elsewhere in memory)
+    size_t block_size = state_block_size();
+    size_t run;
+    int bnum = inode_block(inode, offset / block_size, &run);
+    ALWAYS_ASSERT(bnum != -1, "tfs_read_borrow: file data is not mapped");
+    size_t borrowed = run * block_size - offset % block_size;
+    if (borrowed > available) {
+        borrowed = available;
+    }
+
+    char const *block = data_block_get_run(
+        bnum, (offset % block_size + borrowed + block_size - 1) / block_size);
+    ALWAYS_ASSERT(block != NULL, "tfs_read_borrow: data block deleted");
+    *view = block + offset % block_size;
+
+    // the blocks are pinned rather than the file kept locked, so that they
+    // outlive a truncation or deletion until the release
+    inode_pin(file->of_inumber);
+    file->of_offset += borrowed;
+    atomic_fetch_add(&file->of_borrows, 1);
+    file_unlock(file);
+
+    return (ssize_t)borrowed;
+}
+
+int tfs_read_release(int fhandle) {
+    // the handle cannot be closed while it has borrows, so it need not be
+    // locked
+    open_file_entry_t *file = find_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    // read before the last borrow goes, after which the slot may be reused
+    int inumber = file->of_inumber;
+    int borrows = atomic_load(&file->of_borrows);
+    do {
+        if (borrows == 0) {
+            return -1; // nothing to release
+        }
+    } while (!atomic_compare_exchange_weak(&file->of_borrows, &borrows,
+                                           borrows - 1));
+
+    inode_unpin(inumber);
+    return 0;
+}
+
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len,
+                   size_t offset) {
+    // the handle itself is not needed past the lookup: keep only the file
+    // locked, so other users of the handle need not wait
+    open_file_entry_t *file = file_lock(fhandle, true);
+    if (file == NULL) {
+        return -1;
+    }
+    int inumber = file->of_inumber;
+    release_open_file_entry(file);
+
+    ssize_t written = inode_write(inode_get(inumber), offset, buffer, len);
+    inode_unlock(inumber);
+    return written;
+}
+
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    open_file_entry_t *file = file_lock(fhandle, false);
+    if (file == NULL) {
+        return -1;
+    }
+    int inumber = file->of_inumber;
+    inode_t const *inode = inode_get(inumber);
+    file_readahead(file, inode, offset, len);
+    release_open_file_entry(file);
+
+    size_t read = inode_read(inode, offset, buffer, len);
+    inode_unlock(inumber);
+    return (ssize_t)read;
+}
+
+int tfs_unlink(char const *target) {
+    char sub_name[MAX_FILE_NAME];
+    int dir_inumber = tfs_lookup_parent(target, sub_name, true);
+    if (dir_inumber == -1) {
+        return -1;
+    }
+
+    inode_type type;
+    int inumber = dir_lookup(dir_inumber, sub_name, &type);
+    if (inumber == -1) {
+        inode_unlock(dir_inumber);
+        return -1;
+    }
+
+    if (type == T_DIRECTORY) {
+        inode_unlock(dir_inumber);
+        return -1; // directories are removed with tfs_rmdir
+    }
+
+    // remove the entry before the inode, so it never refers to a freed inode
+    if (clear_dir_entry(inode_get(dir_inumber), sub_name) == -1) {
+        inode_unlock(dir_inumber);
+        return -1;
+    }
+    metadata_log(J_ENTRY_REMOVE, dir_inumber, sub_name, inumber, NULL, 0);
+    // this name's link keeps the inode alive until it is dropped below, so the
+    // directory can go first
+    inode_unlock(dir_inumber);
+
+    return journal_commit(link_count_drop(inumber, type));
+}
+
+int tfs_mkdir(char const *path) {
+    char sub_name[MAX_FILE_NAME];
+    int dir_inumber = tfs_lookup_parent(path, sub_name, true);
+    if (dir_inumber == -1) {
+        return -1;
+    }
+
+    if (dir_lookup(dir_inumber, sub_name, NULL) != -1) {
+        inode_unlock(dir_inumber);
+        return -1; // name already taken
+    }
+
+    uint64_t lsn;
+    int inumber = dir_create_locked(dir_inumber, sub_name, T_DIRECTORY, &lsn);
+    inode_unlock(dir_inumber);
+    // (no space in the inode table, for its first node, or in the directory)
+    return inumber != -1 ? journal_commit(lsn) : -1;
+}
+
+int tfs_rmdir(char const *path) {
+    char sub_name[MAX_FILE_NAME];
+    int dir_inumber = tfs_lookup_parent(path, sub_name, true);
+    if (dir_inumber == -1) {
+        return -1;
+    }
+
+    inode_type type;
+    int inumber = dir_lookup(dir_inumber, sub_name, &type);
+    if (inumber == -1 || type != T_DIRECTORY) {
+        inode_unlock(dir_inumber);
+        return -1;
+    }
+
+    // wait for any walk still inside the directory; no new one can get there,
+    // as the parent is write-locked
+    inode_lock(inumber, true);
+
+    dir_cursor_t cursor;
+    dir_entry_t entry;
+    if (dir_cursor_seek(inode_get(inumber), NULL, &cursor) == -1 ||
+        dir_cursor_next(&cursor, &entry) == 0) {
+        inode_unlock(inumber);
+        inode_unlock(dir_inumber);
+        return -1; // not empty
+    }
+
+    if (clear_dir_entry(inode_get(dir_inumber), sub_name) == -1) {
+        inode_unlock(inumber);
+        inode_unlock(dir_inumber);
+        return -1;
+    }
+    uint64_t lsn =
+        metadata_log(J_RMDIR, dir_inumber, sub_name, inumber, NULL, 0);
+    inode_unlock(inumber);
+    inode_delete(inumber);
+
+    inode_unlock(dir_inumber);
+    return journal_commit(lsn);
+}
+
+int tfs_readdir(char const *dir_path, char const *after, char *name) {
+    int dir_inumber = tfs_lookup(dir_path, false);
+    if (dir_inumber == -1) {
+        return -1;
+    }
+
+    dir_cursor_t cursor;
+    dir_entry_t entry;
+    int found = -1;
+    if (dir_cursor_seek(inode_get(dir_inumber), after, &cursor) == 0) {
+        found = dir_cursor_next(&cursor, &entry) == 0;
+    }
+    inode_unlock(dir_inumber);
+
+    if (found == 1) {
+        memcpy(name, entry.d_name, MAX_FILE_NAME);
+    }
+    return found;
+}
+
+/*
+ * Import pipeline: a reader thread fills two chunk buffers in turn from the
+ * host file, while the caller writes the other one into TécnicoFS, so host
+ * reads and copies into the filesystem overlap.
+ */
+typedef struct {
+    char *is_data;
+    ssize_t is_length; // bytes read: 0 at the end of the file, -1 on error
+    bool is_full;      // owned by the writer (until it empties it)
+} import_slot_t;
+
+typedef struct {
+    int ir_fd;
+    size_t ir_chunk;
+    import_slot_t ir_slots[2];
+    bool ir_stop; // the writer is done (or gave up)
+    pthread_mutex_t ir_lock;
+    pthread_cond_t ir_changed;
+} import_ring_t;
+
+/**
+ * Read from a host file until a buffer is full or the file ends.
+ *
+ * Returns the number of bytes read, or -1 in case of error.
+ */
+static ssize_t read_chunk(int fd, char *buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, buffer + done, size - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+static void *import_reader_thread_func(void *arg) {
+    import_ring_t *ring = arg;
+    // the caller read the first chunk into slot 0
+    for (size_t i = 1;; i ^= 1) {
+        import_slot_t *slot = &ring->ir_slots[i];
+        pthread_mutex_lock(&ring->ir_lock);
+        while (slot->is_full && !ring->ir_stop) {
+            pthread_cond_wait(&ring->ir_changed, &ring->ir_lock);
+        }
+        bool stop = ring->ir_stop;
+        pthread_mutex_unlock(&ring->ir_lock);
+        if (stop) {
+            return NULL;
+        }
+
+        ssize_t length = read_chunk(ring->ir_fd, slot->is_data, ring->ir_chunk);
+
+        pthread_mutex_lock(&ring->ir_lock);
+        slot->is_length = length;
+        slot->is_full = true;
+        pthread_cond_broadcast(&ring->ir_changed);
+        pthread_mutex_unlock(&ring->ir_lock);
+        if (length <= 0) {
+            return NULL; // end of file (or error)
+        }
+    }
+}
+
+/**
+ * Copy the rest of a host file into an open file, through the pipeline. The
+ * first chunk, read into slot 0 and already written, was full (so there may
+ * be more).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int import_pipelined(import_ring_t *ring, int fhandle) {
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, import_reader_thread_func, ring) != 0) {
+        return -1;
+    }
+
+    int result = 0;
+    for (size_t i = 1;; i ^= 1) {
+        import_slot_t *slot = &ring->ir_slots[i];
+        pthread_mutex_lock(&ring->ir_lock);
+        while (!slot->is_full) {
+            pthread_cond_wait(&ring->ir_changed, &ring->ir_lock);
+        }
+        pthread_mutex_unlock(&ring->ir_lock);
+
+        if (slot->is_length <= 0) {
+            result = (int)slot->is_length; // end of file, or a read error
+            break;
+        }
+        if (tfs_write(fhandle, slot->is_data, (size_t)slot->is_length) !=
+            slot->is_length) {
+            result = -1; // no space left
+            break;
+        }
+
+        pthread_mutex_lock(&ring->ir_lock);
+        slot->is_full = false;
+        pthread_cond_broadcast(&ring->ir_changed);
+        pthread_mutex_unlock(&ring->ir_lock);
+    }
+
+    pthread_mutex_lock(&ring->ir_lock);
+    ring->ir_stop = true;
+    pthread_cond_broadcast(&ring->ir_changed);
+    pthread_mutex_unlock(&ring->ir_lock);
+    pthread_join(reader, NULL);
+    return result;
+}
+
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
+    if (!valid_pathname(dest_path))
+        return -1;
+
+    // Open the file for reading
+    int fd = open(source_path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // whole blocks per chunk, so each write but the last fills its blocks
+    size_t block_size = state_block_size();
+    size_t chunk = IMPORT_CHUNK_SIZE / block_size * block_size;
+    if (chunk == 0) {
+        chunk = block_size;
+    }
+
+    import_ring_t ring = {.ir_fd = fd, .ir_chunk = chunk};
+    void *buffers;
+    if (posix_memalign(&buffers, 4096, 2 * chunk) != 0) {
+        close(fd);
+        return -1;
+    }
+    ring.ir_slots[0].is_data = buffers;
+    ring.ir_slots[1].is_data = (char *)buffers + chunk;
+
+    int result = -1;
+    int file_handle = -1;
+    // a file that fits in one chunk needs no pipeline
+    ssize_t first = read_chunk(fd, ring.ir_slots[0].is_data, chunk);
+    if (first != -1) {
+        file_handle = tfs_open(dest_path, TFS_O_CREAT | TFS_O_TRUNC);
+    }
+    if (file_handle != -1 &&
+        tfs_write(file_handle, ring.ir_slots[0].is_data, (size_t)first) ==
+            first) {
+        if ((size_t)first < chunk) {
+            result = 0;
+        } else {
+            pthread_mutex_init(&ring.ir_lock, NULL);
+            pthread_cond_init(&ring.ir_changed, NULL);
+            result = import_pipelined(&ring, file_handle);
+            pthread_cond_destroy(&ring.ir_changed);
+            pthread_mutex_destroy(&ring.ir_lock);
+        }
+    }
+
+    if (file_handle != -1 && tfs_close(file_handle) == -1) {
+        result = -1;
+    }
+    free(buffers);
+    close(fd);
+    return result;
+}
+
+/**
+ * Write buffers to a host file, retrying after short writes.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int write_iov(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+
+        // skip what was written
+        size_t left = (size_t)written;
+        while (iovcnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
+}
+
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
+    int fhandle = tfs_open(source_path, 0);
+    if (fhandle == -1) {
+        return -1;
+    }
+
+    int fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        tfs_close(fhandle);
+        return -1;
+    }
+
+    // the file's read lock pins its blocks while the host writes from them
+    open_file_entry_t *file = file_lock(fhandle, false);
+    ALWAYS_ASSERT(file != NULL, "tfs_copy_to_external_fs: handle vanished");
+    int inumber = file->of_inumber;
+    release_open_file_entry(file);
+    inode_t const *inode = inode_get(inumber);
+
+    // one buffer per extent, a batch of extents per system call
+    size_t block_size = state_block_size();
+    extent_t extents[EXPORT_IOV_COUNT];
+    struct iovec iov[EXPORT_IOV_COUNT];
+    int result = 0;
+    size_t offset = 0;
+    size_t first = 0;
+    while (result == 0 && offset < inode->i_size) {
+        size_t count = inode_extents(inode, first, extents, EXPORT_IOV_COUNT);
+        ALWAYS_ASSERT(count > 0,
+                      "tfs_copy_to_external_fs: file data is not mapped");
+        int iovcnt = 0;
+        for (size_t i = 0; i < count && offset < inode->i_size; i++) {
+            size_t len = (size_t)extents[i].e_length * block_size;
+            if (len > inode->i_size - offset) {
+                len = inode->i_size - offset;
+            }
+            iov[iovcnt++] = (struct iovec){
+                .iov_base = data_block_get_run(
+                    extents[i].e_block, (len + block_size - 1) / block_size),
+                .iov_len = len};
+            offset += len;
+        }
+        first += count;
+        result = write_iov(fd, iov, iovcnt);
+    }
+    inode_unlock(inumber);
+
+    if (close(fd) == -1) {
+        result = -1;
+    }
+    if (tfs_close(fhandle) == -1) {
+        result = -1;
+    }
+    return result;
+}
+
+typedef enum {
+    BATCH_OPEN,
+    BATCH_MKDIR,
+    BATCH_LINK,
+    BATCH_UNLINK,
+} batch_op_kind_t;
+
+/**
+ * An operation queued in a batch, on the entry bo_name of the directory
+ * bo_dir.
+ */
+typedef struct {
+    batch_op_kind_t bo_kind;
+    size_t bo_index; // position in the queue
+    char *bo_dir;    // NULL if the path name is invalid
+    char bo_name[MAX_FILE_NAME];
+    char *bo_path; // BATCH_OPEN: the path name; BATCH_LINK: the target's
+    tfs_file_mode_t bo_mode;
+    bool bo_handle; // BATCH_OPEN: whether to keep a handle open
+    bool bo_merge;  // BATCH_MKDIR: whether an existing directory will do
+    // BATCH_LINK: the target, once its link is counted; BATCH_UNLINK: the
+    // inode whose link is left to drop
+    int bo_inumber;
+    inode_type bo_type;
+    bool bo_logged;   // the result depends on the batch's records committing
+    bool bo_deferred; // BATCH_OPEN of a soft link: opened with tfs_open
+    int bo_result;
+} batch_op_t;
+
+struct tfs_batch {
+    batch_op_t *b_ops;
+    size_t b_count;
+    size_t b_capacity;
+    bool b_failed; // an operation could not be queued
+};
+
+tfs_batch_t *tfs_batch_begin(void) { return calloc(1, sizeof(tfs_batch_t)); }
+
+/**
+ * Queue an operation on a path name, split into its directory and its last
+ * component.
+ *
+ * Returns the operation (for the caller to fill in), or NULL if it could not
+ * be queued.
+ */
+static batch_op_t *batch_queue(tfs_batch_t *batch, batch_op_kind_t kind,
+                               char const *path) {
+    if (batch == NULL) {
+        return NULL;
+    }
+    if (batch->b_count == batch->b_capacity) {
+        size_t capacity = batch->b_capacity > 0 ? batch->b_capacity * 2 : 16;
+        batch_op_t *ops = realloc(batch->b_ops, capacity * sizeof(batch_op_t));
+        if (ops == NULL) {
+            batch->b_failed = true;
+            return NULL;
+        }
+        batch->b_ops = ops;
+        batch->b_capacity = capacity;
+    }
+
+    batch_op_t *op = &batch->b_ops[batch->b_count];
+    *op = (batch_op_t){
+        .bo_kind = kind,
+        .bo_index = batch->b_count++,
+        .bo_inumber = -1,
+        .bo_result = -1,
+    };
+
+    // an invalid path name only fails its own operation
+    char const *last = valid_pathname(path) ? strrchr(path, '/') : NULL;
+    if (last == NULL || strlen(last + 1) == 0 ||
+        strlen(last + 1) > MAX_FILE_NAME - 1) {
+        return op;
+    }
+    strcpy(op->bo_name, last + 1);
+    size_t dir_len = last == path ? 1 : (size_t)(last - path);
+    op->bo_dir = malloc(dir_len + 1);
+    if (op->bo_dir == NULL) {
+        batch->b_failed = true;
+        return op;
+    }
+    memcpy(op->bo_dir, path, dir_len);
+    op->bo_dir[dir_len] = '\0';
+    return op;
+}
+
+static int batch_queue_open(tfs_batch_t *batch, char const *name,
+                            tfs_file_mode_t mode, bool handle) {
+    batch_op_t *op = batch_queue(batch, BATCH_OPEN, name);
+    if (op == NULL) {
+        return -1;
+    }
+    op->bo_mode = mode;
+    op->bo_handle = handle;
+    op->bo_path = name != NULL ? strdup(name) : NULL;
+    if (name != NULL && op->bo_path == NULL) {
+        batch->b_failed = true;
+    }
+    return (int)op->bo_index;
+}
+
+int tfs_batch_open(tfs_batch_t *batch, char const *name,
+                   tfs_file_mode_t mode) {
+    return batch_queue_open(batch, name, mode, true);
+}
+
+int tfs_batch_create(tfs_batch_t *batch, char const *name) {
+    return batch_queue_open(batch, name, TFS_O_CREAT | TFS_O_TRUNC, false);
+}
+
+static int batch_queue_mkdir(tfs_batch_t *batch, char const *path,
+                             bool merge) {
+    batch_op_t *op = batch_queue(batch, BATCH_MKDIR, path);
+    if (op == NULL) {
+        return -1;
+    }
+    op->bo_merge = merge;
+    return (int)op->bo_index;
+}
+
+int tfs_batch_mkdir(tfs_batch_t *batch, char const *path) {
+    return batch_queue_mkdir(batch, path, false);
+}
+
+int tfs_batch_link(tfs_batch_t *batch, char const *target,
+                   char const *link_name) {
+    batch_op_t *op = batch_queue(batch, BATCH_LINK, link_name);
+    if (op == NULL) {
+        return -1;
+    }
+    op->bo_path = target != NULL ? strdup(target) : NULL;
+    return (int)op->bo_index;
+}
+
+int tfs_batch_unlink(tfs_batch_t *batch, char const *target) {
+    batch_op_t *op = batch_queue(batch, BATCH_UNLINK, target);
+    return op != NULL ? (int)op->bo_index : -1;
+}
+
+static int batch_op_compare(void const *a, void const *b) {
+    batch_op_t const *op_a = *(batch_op_t *const *)a;
+    batch_op_t const *op_b = *(batch_op_t *const *)b;
+    int order = strcmp(op_a->bo_dir, op_b->bo_dir);
+    if (order == 0) {
+        // the operations on a directory keep their queue order
+        order = op_a->bo_index < op_b->bo_index ? -1 : 1;
+    }
+    return order;
+}
+
+/**
+ * Apply a queued operation to its directory, which is write-locked.
+ *
+ * Input:
+ *   - dir_inumber: the directory
+ *   - op: the operation
+ *   - lsn: updated with the LSN of the records logged
+ */
+static void batch_apply(int dir_inumber, batch_op_t *op, uint64_t *lsn) {
+    inode_t *dir = inode_get(dir_inumber);
+    inode_type type;
+    int inumber = dir_lookup(dir_inumber, op->bo_name, &type);
+
+    switch (op->bo_kind) {
+    case BATCH_OPEN: {
+        size_t offset = 0;
+        if (inumber == -1) {
+            if (!(op->bo_mode & TFS_O_CREAT)) {
+                return;
+            }
+            inumber = dir_create_locked(dir_inumber, op->bo_name, T_FILE, lsn);
+            if (inumber == -1) {
+                return;
+            }
+            op->bo_logged = true;
+        } else if (type == T_DIRECTORY) {
+            return; // directories cannot be opened
+        } else if (type == T_LINK) {
+            // resolving it locks other directories
+            op->bo_deferred = true;
+            return;
+        } else if (op->bo_mode & (TFS_O_TRUNC | TFS_O_APPEND)) {
+            inode_t *inode = inode_get(inumber);
+            inode_lock(inumber, op->bo_mode & TFS_O_TRUNC);
+            if ((op->bo_mode & TFS_O_TRUNC) && inode->i_size > 0) {
+                inode_truncate(inode);
+            }
+            if (op->bo_mode & TFS_O_APPEND) {
+                offset = inode->i_size;
+            }
+            inode_unlock(inumber);
+        }
+        op->bo_result =
+            op->bo_handle ? open_handle(inumber, offset, op->bo_mode) : 0;
+        break;
+    }
+    case BATCH_MKDIR:
+        if (inumber != -1) {
+            op->bo_result = op->bo_merge && type == T_DIRECTORY ? 0 : -1;
+            return;
+        }
+        if (dir_create_locked(dir_inumber, op->bo_name, T_DIRECTORY, lsn) ==
+            -1) {
+            return;
+        }
+        op->bo_logged = true;
+        op->bo_result = 0;
+        break;
+    case BATCH_LINK:
+        // the target's link was counted ahead (see batch_link)
+        if (op->bo_inumber == -1 || inumber != -1 ||
+            add_dir_entry(dir, op->bo_name, op->bo_inumber) == -1) {
+            return;
+        }
+        *lsn = metadata_log(J_ENTRY_ADD, dir_inumber, op->bo_name,
+                            op->bo_inumber, NULL, 0);
+        op->bo_logged = true;
+        op->bo_result = 0;
+        break;
+    case BATCH_UNLINK:
+        if (inumber == -1 || type == T_DIRECTORY ||
+            clear_dir_entry(dir, op->bo_name) == -1) {
+            return;
+        }
+        *lsn = metadata_log(J_ENTRY_REMOVE, dir_inumber, op->bo_name, inumber,
+                            NULL, 0);
+        op->bo_logged = true;
+        op->bo_result = 0;
+        // drop the link right away if the file is not in use (so that a file
+        // created next can reuse the inode); otherwise, once the directory is
+        // released, as tfs_unlink does
+        if (inode_trylock(inumber)) {
+            *lsn = link_count_drop_locked(inumber, type);
+            inode_unlock(inumber);
+        } else {
+            op->bo_inumber = inumber;
+            op->bo_type = type;
+        }
+        break;
+    default:
+        PANIC("batch_apply: unknown operation");
+    }
+}
+
+/**
+ * Finish a queued operation once its directory is released: drop the link of
+ * an unlinked inode, or of a target that could not be linked to, and open soft
+ * links.
+ */
+static void batch_finish(batch_op_t *op, uint64_t *lsn) {
+    if (op->bo_kind == BATCH_OPEN && op->bo_deferred) {
+        op->bo_result = tfs_open(op->bo_path, op->bo_mode);
+        if (!op->bo_handle && op->bo_result != -1) {
+            op->bo_result = tfs_close(op->bo_result);
+        }
+    } else if (op->bo_kind == BATCH_UNLINK && op->bo_inumber != -1) {
+        *lsn = link_count_drop(op->bo_inumber, op->bo_type);
+    } else if (op->bo_kind == BATCH_LINK && op->bo_inumber != -1 &&
+               op->bo_result == -1) {
+        *lsn = link_count_drop(op->bo_inumber, T_FILE);
+    }
+}
+
+/**
+ * Apply a run of queued operations (sorted by directory), locking each
+ * directory once for all of its operations.
+ */
+static void batch_apply_run(batch_op_t **ops, size_t count, uint64_t *lsn) {
+    for (size_t first = 0; first < count;) {
+        size_t end = first + 1;
+        while (end < count &&
+               strcmp(ops[end]->bo_dir, ops[first]->bo_dir) == 0) {
+            end++;
+        }
+
+        int dir_inumber = tfs_lookup(ops[first]->bo_dir, true);
+        if (dir_inumber != -1) {
+            if (inode_get(dir_inumber)->i_node_type == T_DIRECTORY) {
+                for (size_t i = first; i < end; i++) {
+                    batch_apply(dir_inumber, ops[i], lsn);
+                }
+            }
+            inode_unlock(dir_inumber);
+        }
+        for (size_t i = first; i < end; i++) {
+            batch_finish(ops[i], lsn);
+        }
+        first = end;
+    }
+}
+
+/**
+ * Apply a queued link: count the target's link ahead, as tfs_link does (with
+ * no directory locked), and then add its entry.
+ */
+static void batch_link(batch_op_t *op, uint64_t *lsn) {
+    uint64_t link_lsn;
+    op->bo_inumber = link_count_add(op->bo_path, &link_lsn);
+    if (op->bo_inumber == -1) {
+        return;
+    }
+    *lsn = link_lsn;
+    batch_apply_run(&op, 1, lsn);
+}
+
+int tfs_batch_submit(tfs_batch_t *batch, int *results) {
+    if (batch == NULL) {
+        return -1;
+    }
+
+    uint64_t lsn = 0;
+    size_t queued = 0;
+    batch_op_t **order = malloc(batch->b_count * sizeof(batch_op_t *));
+    int result = batch->b_failed || order == NULL ? -1 : 0;
+    for (size_t i = 0; order != NULL && i < batch->b_count; i++) {
+        batch_op_t *op = &batch->b_ops[i];
+        if (op->bo_dir == NULL ||
+            ((op->bo_kind == BATCH_OPEN || op->bo_kind == BATCH_LINK) &&
+             op->bo_path == NULL)) {
+            continue; // invalid
+        }
+        order[queued++] = op;
+    }
+
+    // links split the queue: each is applied between the operations queued
+    // before and after it, and those in between are applied directory by
+    // directory, locking each directory once for all of its operations
+    for (size_t first = 0; first < queued;) {
+        if (order[first]->bo_kind == BATCH_LINK) {
+            batch_link(order[first++], &lsn);
+            continue;
+        }
+        size_t end = first + 1;
+        while (end < queued && order[end]->bo_kind != BATCH_LINK) {
+            end++;
+        }
+        qsort(order + first, end - first, sizeof(batch_op_t *),
+              batch_op_compare);
+        batch_apply_run(order + first, end - first, &lsn);
+        first = end;
+    }
+    free(order);
+
+    // committing the last record commits every one before it
+    bool committed = journal_commit(lsn) == 0;
+    for (size_t i = 0; i < batch->b_count; i++) {
+        batch_op_t *op = &batch->b_ops[i];
+        if (op->bo_logged && !committed && op->bo_result != -1) {
+            if (op->bo_kind == BATCH_OPEN && op->bo_handle) {
+                tfs_close(op->bo_result);
+            }
+            op->bo_result = -1;
+        }
+        if (op->bo_result == -1) {
+            result = -1;
+        }
+        if (results != NULL) {
+            results[i] = op->bo_result;
+        }
+        free(op->bo_dir);
+        free(op->bo_path);
+    }
+    free(batch->b_ops);
+    free(batch);
+    return result;
+}
+
+/*
+ * Tree import: the calling thread walks the host tree, creating the entries
+ * of each directory in one batch, and queues the files it creates; a pool of
+ * workers copies their contents meanwhile.
+ */
+typedef struct {
+    char *ie_name;
+    inode_type ie_type;
+    bool ie_created; // (or already there)
+} import_entry_t;
+
+typedef struct import_job {
+    struct import_job *ij_next;
+    char *ij_host_path;
+    char *ij_tfs_path;
+} import_job_t;
+
+typedef struct {
+    import_job_t *it_jobs;
+    bool it_walked; // no more jobs will be queued
+    bool it_failed;
+    pthread_mutex_t it_lock;
+    pthread_cond_t it_queued;
+} import_tree_t;
+
+static char *join_path(char const *dir, char const *name) {
+    // the root directory already ends with a '/'
+    char const *separator = dir[strlen(dir) - 1] == '/' ? "" : "/";
+    size_t size = strlen(dir) + strlen(separator) + strlen(name) + 1;
+    char *path = malloc(size);
+    if (path != NULL) {
+        snprintf(path, size, "%s%s%s", dir, separator, name);
+    }
+    return path;
+}
+
+static void import_tree_fail(import_tree_t *tree) {
+    pthread_mutex_lock(&tree->it_lock);
+    tree->it_failed = true;
+    pthread_mutex_unlock(&tree->it_lock);
+}
+
+static void import_tree_queue(import_tree_t *tree, char const *host_dir,
+                              char const *tfs_dir, char const *name) {
+    import_job_t *job = malloc(sizeof(import_job_t));
+    if (job == NULL) {
+        import_tree_fail(tree);
+        return;
+    }
+    job->ij_host_path = join_path(host_dir, name);
+    job->ij_tfs_path = join_path(tfs_dir, name);
+    if (job->ij_host_path == NULL || job->ij_tfs_path == NULL) {
+        free(job->ij_host_path);
+        free(job->ij_tfs_path);
+        free(job);
+        import_tree_fail(tree);
+        return;
+    }
+
+    pthread_mutex_lock(&tree->it_lock);
+    job->ij_next = tree->it_jobs;
+    tree->it_jobs = job;
+    pthread_cond_signal(&tree->it_queued);
+    pthread_mutex_unlock(&tree->it_lock);
+}
+
+/**
+ * Read the entries of a host directory that can be imported (files and
+ * directories).
+ *
+ * Returns the number of entries stored in *entries (to be freed with their
+ * names), or -1 if the directory cannot be read.
+ */
+static ssize_t host_dir_entries(import_tree_t *tree, char const *host_dir,
+                                import_entry_t **entries) {
+    DIR *dir = opendir(host_dir);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    size_t count = 0;
+    size_t capacity = 0;
+    *entries = NULL;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        char const *name = dirent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+
+        struct stat st;
+        char *host_path = join_path(host_dir, name);
+        bool found = host_path != NULL && lstat(host_path, &st) == 0;
+        free(host_path);
+        if (!found || strlen(name) > MAX_FILE_NAME - 1) {
+            import_tree_fail(tree);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            continue; // symbolic links, devices, ... are not imported
+        }
+
+        if (count == capacity) {
+            capacity = capacity > 0 ? 2 * capacity : 16;
+            import_entry_t *grown =
+                realloc(*entries, capacity * sizeof(import_entry_t));
+            if (grown == NULL) {
+                import_tree_fail(tree);
+                break;
+            }
+            *entries = grown;
+        }
+        (*entries)[count] = (import_entry_t){
+            .ie_name = strdup(name),
+            .ie_type = S_ISDIR(st.st_mode) ? T_DIRECTORY : T_FILE,
+        };
+        if ((*entries)[count].ie_name == NULL) {
+            import_tree_fail(tree);
+            continue;
+        }
+        count++;
+    }
+    closedir(dir);
+
+    return (ssize_t)count;
+}
+
+/**
+ * Create the entries of a directory in one batch: empty files (existing ones
+ * are truncated, their contents are copied next), and directories (existing
+ * ones are merged into).
+ */
+static void import_dir_create(import_tree_t *tree, char const *tfs_dir,
+                              import_entry_t *entries, size_t count) {
+    if (count == 0) {
+        return;
+    }
+
+    tfs_batch_t *batch = tfs_batch_begin();
+    int *indices = malloc(count * sizeof(int));
+    int *results = malloc(count * sizeof(int));
+    if (batch == NULL || indices == NULL || results == NULL) {
+        tfs_batch_submit(batch, NULL);
+        free(indices);
+        free(results);
+        import_tree_fail(tree);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        char *path = join_path(tfs_dir, entries[i].ie_name);
+        if (path == NULL) {
+            indices[i] = -1;
+        } else if (entries[i].ie_type == T_FILE) {
+            indices[i] = tfs_batch_create(batch, path);
+        } else {
+            indices[i] = batch_queue_mkdir(batch, path, true);
+        }
+        free(path);
+    }
+    if (tfs_batch_submit(batch, results) == -1) {
+        import_tree_fail(tree);
+    }
+    for (size_t i = 0; i < count; i++) {
+        entries[i].ie_created = indices[i] != -1 && results[indices[i]] != -1;
+        if (indices[i] == -1) {
+            import_tree_fail(tree);
+        }
+    }
+    free(indices);
+    free(results);
+}
+
+static void import_tree_walk(import_tree_t *tree, char const *host_dir,
+                             char const *tfs_dir) {
+    import_entry_t *entries;
+    ssize_t count = host_dir_entries(tree, host_dir, &entries);
+    if (count == -1) {
+        import_tree_fail(tree);
+        return;
+    }
+
+    import_dir_create(tree, tfs_dir, entries, (size_t)count);
+
+    // queue the files first, so the workers start on them, then go down
+    for (size_t i = 0; i < (size_t)count; i++) {
+        if (entries[i].ie_created && entries[i].ie_type == T_FILE) {
+            import_tree_queue(tree, host_dir, tfs_dir, entries[i].ie_name);
+        }
+    }
+    for (size_t i = 0; i < (size_t)count; i++) {
+        if (entries[i].ie_created && entries[i].ie_type == T_DIRECTORY) {
+            char *host_path = join_path(host_dir, entries[i].ie_name);
+            char *tfs_path = join_path(tfs_dir, entries[i].ie_name);
+            if (host_path != NULL && tfs_path != NULL) {
+                import_tree_walk(tree, host_path, tfs_path);
+            } else {
+                import_tree_fail(tree);
+            }
+            free(host_path);
+            free(tfs_path);
+        }
+        free(entries[i].ie_name);
+    }
+    free(entries);
+}
+
+static void *import_worker_thread_func(void *arg) {
+    import_tree_t *tree = arg;
+    while (true) {
+        pthread_mutex_lock(&tree->it_lock);
+        while (tree->it_jobs == NULL && !tree->it_walked) {
+            pthread_cond_wait(&tree->it_queued, &tree->it_lock);
+        }
+        import_job_t *job = tree->it_jobs;
+        if (job != NULL) {
+            tree->it_jobs = job->ij_next;
+        }
+        pthread_mutex_unlock(&tree->it_lock);
+        if (job == NULL) {
+            return NULL; // the walk is over, and every job taken
+        }
+
+        if (tfs_copy_from_external_fs(job->ij_host_path, job->ij_tfs_path) ==
+            -1) {
+            import_tree_fail(tree);
+        }
+        free(job->ij_host_path);
+        free(job->ij_tfs_path);
+        free(job);
+    }
+}
+
+int tfs_import_tree(char const *host_dir, char const *tfs_prefix,
+                    size_t nthreads) {
+    if (host_dir == NULL || nthreads == 0 ||
+        (!valid_pathname(tfs_prefix) &&
+         (tfs_prefix == NULL || strcmp(tfs_prefix, "/") != 0))) {
+        return -1;
+    }
+
+    // the prefix may exist already (which the first batch checks)
+    if (strcmp(tfs_prefix, "/") != 0) {
+        tfs_mkdir(tfs_prefix);
+    }
+
+    import_tree_t tree = {0};
+    pthread_mutex_init(&tree.it_lock, NULL);
+    pthread_cond_init(&tree.it_queued, NULL);
+
+    // the calling thread walks the tree, then helps the other workers
+    pthread_t *workers = malloc((nthreads - 1) * sizeof(pthread_t));
+    size_t started = 0;
+    while (workers != NULL && started < nthreads - 1 &&
+           pthread_create(&workers[started], NULL, import_worker_thread_func,
+                          &tree) == 0) {
+        started++;
+    }
+
+    import_tree_walk(&tree, host_dir, tfs_prefix);
+
+    pthread_mutex_lock(&tree.it_lock);
+    tree.it_walked = true;
+    pthread_cond_broadcast(&tree.it_queued);
+    pthread_mutex_unlock(&tree.it_lock);
+
+    import_worker_thread_func(&tree);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    pthread_cond_destroy(&tree.it_queued);
+    pthread_mutex_destroy(&tree.it_lock);
+    return tree.it_failed ? -1 : 0;
+}
@@ -3,6 +3,38 @@
 
 #include "config.h"
 #include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * How accesses to the filesystem's structures are delayed, to emulate the
+ * storage device they would be kept in.
+ */
+typedef enum {
+    TFS_LATENCY_NONE,  // no delay (in-memory use)
+    TFS_LATENCY_SPIN,  // busy-wait for the cost of each access
+    TFS_LATENCY_SLEEP, // sleep for it (at the host timer's granularity)
+} tfs_latency_mode_t;
+
+/**
+ * Kinds of structures whose accesses are delayed.
+ */
+typedef enum {
+    TFS_STRUCT_INODE,  // inodes (and the directories' entries)
+    TFS_STRUCT_BITMAP, // free inode and free block maps
+    TFS_STRUCT_DATA,   // data blocks
+    TFS_STRUCT_COUNT,
+} tfs_struct_t;
+
+/**
+ * Storage latency model: an access to a structure costs a fixed time (seek),
+ * plus a time for each KiB transferred (the size of an inode, of a map word,
+ * or of a whole block).
+ */
+typedef struct {
+    tfs_latency_mode_t mode;
+    size_t seek_ns[TFS_STRUCT_COUNT];
+    size_t ns_per_kib[TFS_STRUCT_COUNT];
+} tfs_latency_t;
 
 /**
  * TécnicoFS parameters.
@@ -13,10 +45,37 @@ typedef struct {
     size_t max_open_files_count;
 
     size_t block_size;
+
+    // host file holding the filesystem (created if it does not exist, and
+    // reattached if it does), or NULL to keep it in memory only
+    char const *image_path;
+    // with an image: how often a background thread syncs it (see tfs_sync),
+    // in milliseconds, or 0 for never
+    size_t flush_interval_ms;
+
+    tfs_latency_t latency;
+    // frames of the buffer cache, which holds recently used inodes, blocks
+    // and free maps: only accesses that miss it pay the latency (0 for no
+    // cache)
+    size_t cache_frames;
+    // most blocks read ahead, in the background, of a handle's sequential
+    // reads (0 for no readahead; needs the cache)
+    size_t readahead_max_blocks;
 } tfs_params;
 
 /**
- * Return a sane default set of parameters for tecnicofs.
+ * Buffer cache counters.
+ */
+typedef struct {
+    size_t hits;
+    size_t misses;
+    size_t writebacks; // changed objects written back as their frame is reused
+    size_t prefetches; // objects brought in by readahead
+} tfs_cache_stats_t;
+
+/**
+ * Return a sane default set of parameters for tecnicofs (accesses that miss a
+ * cache of DEFAULT_CACHE_FRAMES frames spin for DEFAULT_ACCESS_NS each).
  */
 tfs_params tfs_default_params();
 
@@ -27,11 +86,60 @@ tfs_params tfs_default_params();
 int tfs_init(tfs_params const *params);
 
 /**
- * Destroy tecnicofs.
+ * Destroy tecnicofs, first writing out what handles left open buffered (see
+ * TFS_O_BUFFERED).
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_destroy();
 
+/**
+ * Mount an existing TécnicoFS image, with the geometry (inode count, block
+ * count, block size) it was created with.
+ *
+ * If the image was not unmounted cleanly, its block allocation bitmap is
+ * rebuilt from the inodes; otherwise only the superblock is checked.
+ *
+ * Metadata operations on an image (creating, linking and unlinking files and
+ * links, creating and removing directories) are logged in a journal next to
+ * it (image_path with ".journal" appended), and only return once their record
+ * is on disk (or -1 if it could not be written). Those logged since the image
+ * was last flushed are redone when it is mounted again.
+ *
+ * Input:
+ *   - image_path: path of the image (in the host file system)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_mount(char const *image_path);
+
+/**
+ * Unmount the mounted image: flush it, mark it clean, and destroy TécnicoFS
+ * (as tfs_destroy).
+ *
+ * Returns 0 if successful, -1 otherwise (no image mounted).
+ */
+int tfs_unmount(void);
+
+/**
+ * Flush the image: write the parts of it that changed since it was last
+ * flushed (and only those), and empty the metadata journal, which they make
+ * unnecessary. The writes buffered in open handles are made first. Does
+ * nothing else without an image.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_sync(void);
+
+/**
+ * Obtain the buffer cache's counters, since tecnicofs was initialized.
+ *
+ * Input:
+ *   - stats: where to store them
+ *
+ * Returns 0 if successful, -1 otherwise (not initialized).
+ */
+int tfs_cache_stats(tfs_cache_stats_t *stats);
+
 /**
  * TécnicoFS file opening modes.
  */
@@ -39,6 +147,7 @@ typedef enum {
     TFS_O_CREAT = 0b001,
     TFS_O_TRUNC = 0b010,
     TFS_O_APPEND = 0b100,
+    TFS_O_BUFFERED = 0b1000,
 } tfs_file_mode_t;
 
 /**
@@ -50,6 +159,13 @@ typedef enum {
  *     - append mode (TFS_O_APPEND)
  *     - truncate file contents (TFS_O_TRUNC)
  *     - create file if it does not exist (TFS_O_CREAT)
+ *     - buffer writes in the handle (TFS_O_BUFFERED): writes that fit in its
+ *       buffer (WRITE_BUFFER_BLOCKS blocks) are only copied there, and the
+ *       file is written (and its blocks allocated) when the buffer fills up,
+ *       on tfs_flush and tfs_close, tfs_sync and tfs_destroy, and before any
+ *       other operation through the handle. Until then, other handles do not
+ *       see them, and errors writing them (no space left) are reported by
+ *       that operation.
  *
  * Returns file handle of the opened file if successful, -1 otherwise.
  */
@@ -87,6 +203,21 @@ int tfs_link(char const *target_file, char const *link_name);
  */
 int tfs_close(int fhandle);
 
+/**
+ * Write out the writes buffered in a handle (see TFS_O_BUFFERED).
+ *
+ * Input:
+ *   - fhandle: file handle
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The handle is invalid.
+ *   - There is not enough space for everything buffered: what fits is
+ *     written, and the handle's offset is left at its end.
+ */
+int tfs_flush(int fhandle);
+
 /**
  * Write to an open file, starting at the current offset.
  *
@@ -113,6 +244,103 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Write a list of buffers to an open file, one after the other, starting at the
+ * current offset.
+ *
+ * The whole list is written as a single write: it is not interleaved with other
+ * writes through the same handle.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: the buffers
+ *   - iovcnt: number of buffers
+ *
+ * Returns the number of bytes that were written (can be lower than the total
+ * length of the buffers if the maximum file size is exceeded), or -1 in case
+ * of error.
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Read from an open file into a list of buffers, filling each one before the
+ * next, starting at the current offset.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: the buffers
+ *   - iovcnt: number of buffers
+ *
+ * Returns the number of bytes that were copied from the file to the buffers
+ * (can be lower than their total length if the file size was reached), or -1
+ * in case of error.
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Write to an open file at a given offset, without using or changing the
+ * handle's offset.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: buffer containing the contents to write
+ *   - len: length of the buffer contents (in bytes)
+ *   - offset: file offset where the write starts (any bytes between the end of
+ *     the file and the offset read as zeros)
+ *
+ * Returns the number of bytes that were written (can be lower than 'len' if the
+ * maximum file size is exceeded), or -1 in case of error.
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/**
+ * Read from an open file at a given offset, without using or changing the
+ * handle's offset. Reads of the same file (even through the same handle) run in
+ * parallel.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: file offset where the read starts
+ *
+ * Returns the number of bytes that were copied from the file to the buffer (can
+ * be lower than 'len' if the file size was reached), or -1 in case of error.
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/**
+ * Borrow a read-only view of an open file's data, starting at the current
+ * offset, instead of copying it out.
+ *
+ * The view covers the data up to the end of the file's current run of
+ * contiguous blocks, so it can be shorter than requested even before the end of
+ * the file; the offset moves past it. The view stays valid until it is
+ * released (by any thread), even if the file is truncated or deleted meanwhile
+ * (its blocks are then only freed with the release), and writes to the range
+ * it covers show through it. The handle cannot be closed until then.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - len: maximum length of the view
+ *   - view: where to store the address of the view
+ *
+ * Returns the length of the view, which must then be released with
+ * tfs_read_release, 0 if the end of the file was reached (and nothing needs to
+ * be released), or -1 in case of error.
+ */
+ssize_t tfs_read_borrow(int fhandle, size_t len, void const **view);
+
+/**
+ * Release a view obtained from tfs_read_borrow.
+ *
+ * Input:
+ *   - fhandle: file handle the view was borrowed through
+ *
+ * Returns 0 if successful, -1 otherwise (no view borrowed through fhandle).
+ */
+int tfs_read_release(int fhandle);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
  * exists in TécnicoFS.
@@ -124,9 +352,45 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len);
  */
 int tfs_unlink(char const *target);
 
+/**
+ * Create a directory.
+ *
+ * Input:
+ *   - path: absolute path name of the directory to create (every directory
+ *     before its last component must exist)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_mkdir(char const *path);
+
+/**
+ * Remove an empty directory.
+ *
+ * Input:
+ *   - path: absolute path name of the directory
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_rmdir(char const *path);
+
+/**
+ * List the entries of a directory, in name order, one at a time.
+ *
+ * Input:
+ *   - dir_path: absolute path name of the directory
+ *   - after: name of the previous entry listed, or NULL for the first one
+ *   - name: where to store the name of the entry (MAX_FILE_NAME bytes)
+ *
+ * Returns 1 if an entry was stored in name, 0 if there are no more entries,
+ * or -1 in case of error.
+ */
+int tfs_readdir(char const *dir_path, char const *after, char *name);
+
 /**
  * Copy the contents of a file that exists in the OS' file system tree
- * (outside TécnicoFS) to the TécnicoFS.
+ * (outside TécnicoFS) to the TécnicoFS. The file is streamed in chunks of
+ * IMPORT_CHUNK_SIZE, whatever its size; it is read by another thread while
+ * the previous chunk is written.
  *
  * Input:
  *   - source_path: path name of the source file (from the OS' file system)
@@ -134,7 +398,245 @@ int tfs_unlink(char const *target);
  *    which is created if needed, and overwritten if it already exists.
  *
  * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The source file cannot be opened or read.
+ *   - The destination cannot be opened, or is full: what was copied until
+ *     then is kept.
  */
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
 
+/**
+ * Copy the contents of a TécnicoFS file to a file in the OS' file system. The
+ * host file is written straight from the file's blocks, one buffer per
+ * extent, with no intermediate copy; writers to the file wait meanwhile.
+ *
+ * Input:
+ *   - source_path: absolute path name of the source file (in TécnicoFS)
+ *   - dest_path: path name of the destination file (in the OS' file system),
+ *    which is created if needed, and overwritten if it already exists.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The source file does not exist, or is not a file.
+ *   - The destination cannot be opened or written.
+ */
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path);
+
+/**
+ * Copy a directory tree from the OS' file system to the TécnicoFS. The entries
+ * of each directory are created in one batch, as the tree is walked, while a
+ * pool of threads copies the contents of the files created so far.
+ *
+ * Only files and directories are copied (not symbolic links, for instance).
+ * Existing files are overwritten, and existing directories merged into.
+ *
+ * Input:
+ *   - host_dir: path name of the directory to copy (in the OS' file system)
+ *   - tfs_prefix: absolute path name of the directory to copy it to (in
+ *     TécnicoFS), which is created if needed (its parent must exist)
+ *   - nthreads: number of threads copying (at least 1, the calling thread)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - An entry could not be read, created or copied (its name is too long, or
+ *     is taken by an entry of another type, or there is no space left): the
+ *     rest of the tree is still copied.
+ */
+int tfs_import_tree(char const *host_dir, char const *tfs_prefix,
+                    size_t nthreads);
+
+/**
+ * Batch of namespace operations, queued with the tfs_batch_* functions below
+ * and applied together by tfs_batch_submit.
+ */
+typedef struct tfs_batch tfs_batch_t;
+
+/**
+ * Start a batch.
+ *
+ * Returns the batch, or NULL if there is no memory for it.
+ */
+tfs_batch_t *tfs_batch_begin(void);
+
+/**
+ * Queue the opening of a file, as tfs_open, in a batch. Its result is a file
+ * handle (or -1).
+ *
+ * Input:
+ *   - batch: the batch
+ *   - name: absolute path name of the file
+ *   - mode: as for tfs_open
+ *
+ * Returns the operation's position in the batch (where tfs_batch_submit
+ * stores its result), or -1 if it could not be queued.
+ */
+int tfs_batch_open(tfs_batch_t *batch, char const *name, tfs_file_mode_t mode);
+
+/**
+ * Queue the creation of an empty file (an existing one is truncated) in a
+ * batch, without opening it. Its result is 0 (or -1).
+ *
+ * Returns the operation's position in the batch, or -1 if it could not be
+ * queued.
+ */
+int tfs_batch_create(tfs_batch_t *batch, char const *name);
+
+/**
+ * Queue the creation of a directory, as tfs_mkdir, in a batch. Its result is 0
+ * (or -1).
+ *
+ * Returns the operation's position in the batch, or -1 if it could not be
+ * queued.
+ */
+int tfs_batch_mkdir(tfs_batch_t *batch, char const *path);
+
+/**
+ * Queue the creation of a hard link, as tfs_link, in a batch. Its result is 0
+ * (or -1).
+ *
+ * Returns the operation's position in the batch, or -1 if it could not be
+ * queued.
+ */
+int tfs_batch_link(tfs_batch_t *batch, char const *target,
+                   char const *link_name);
+
+/**
+ * Queue the removal of a file or link, as tfs_unlink, in a batch. Its result
+ * is 0 (or -1).
+ *
+ * Returns the operation's position in the batch, or -1 if it could not be
+ * queued.
+ */
+int tfs_batch_unlink(tfs_batch_t *batch, char const *target);
+
+/**
+ * Apply the operations queued in a batch, and free it.
+ *
+ * The operations are grouped by the directory their (last) path name is in:
+ * each directory is looked up and locked once, and its operations applied in
+ * the order they were queued, instead of walking the path for each.
+ * Operations on different directories are not ordered with each other, except
+ * around links: a link is applied after every operation queued before it, and
+ * before every one queued after it (its target is looked up then). Other
+ * threads may see some of a batch's operations before the rest (it is not
+ * atomic). Their journal records are committed together.
+ *
+ * Input:
+ *   - batch: the batch
+ *   - results: where to store the result of each operation, by position (as
+ *     the operation would have returned on its own), or NULL
+ *
+ * Returns 0 if every operation succeeded, -1 otherwise.
+ */
+int tfs_batch_submit(tfs_batch_t *batch, int *results);
+
+/**
+ * Asynchronous operations, each run as its tfs_* counterpart.
+ */
+typedef enum {
+    TFS_ASYNC_OPEN,   // tfs_open(name, mode)
+    TFS_ASYNC_CLOSE,  // tfs_close(fhandle)
+    TFS_ASYNC_READ,   // tfs_read(fhandle, buffer, len)
+    TFS_ASYNC_WRITE,  // tfs_write(fhandle, buffer, len)
+    TFS_ASYNC_PREAD,  // tfs_pread(fhandle, buffer, len, offset)
+    TFS_ASYNC_PWRITE, // tfs_pwrite(fhandle, buffer, len, offset)
+} tfs_async_op_t;
+
+/**
+ * Asynchronous request: the operation, its arguments (those it does not take
+ * are ignored), and a value handed back with its completion.
+ */
+typedef struct {
+    tfs_async_op_t op;
+    char const *name;
+    tfs_file_mode_t mode;
+    int fhandle;
+    void *buffer; // TFS_ASYNC_WRITE, TFS_ASYNC_PWRITE: only read from
+    size_t len;
+    size_t offset;
+    void *user_data;
+} tfs_async_request_t;
+
+/**
+ * Completion of an asynchronous request: the value the operation returned,
+ * and the request's user_data.
+ */
+typedef struct {
+    ssize_t result;
+    void *user_data;
+} tfs_async_completion_t;
+
+/**
+ * Asynchronous I/O context: a submission ring, from which a pool of worker
+ * threads takes requests and runs them, and a completion ring, where their
+ * results are posted.
+ */
+typedef struct tfs_async tfs_async_t;
+
+/**
+ * Create an asynchronous I/O context. It must be destroyed before tecnicofs
+ * is.
+ *
+ * Input:
+ *   - entries: most requests in flight (submitted, and not yet reaped)
+ *   - nthreads: number of worker threads (at least 1)
+ *
+ * Returns the context, or NULL if it could not be created.
+ */
+tfs_async_t *tfs_async_create(size_t entries, size_t nthreads);
+
+/**
+ * Submit requests to an asynchronous I/O context. They run in any order, and
+ * concurrently: a request that depends on another (a read of what a write
+ * wrote, or any use of the handle an open returns) must only be submitted once
+ * that one completes.
+ *
+ * Input:
+ *   - async: the context
+ *   - requests: the requests
+ *   - count: their number
+ *
+ * Returns the number of requests submitted (the first ones: fewer than count
+ * if the context has too many in flight), or -1 if the context is invalid.
+ */
+ssize_t tfs_async_submit(tfs_async_t *async,
+                         tfs_async_request_t const *requests, size_t count);
+
+/**
+ * Reap the completions of requests submitted to an asynchronous I/O context,
+ * without waiting.
+ *
+ * Input:
+ *   - async: the context
+ *   - completions: where to store them
+ *   - max: most completions to reap
+ *
+ * Returns the number of completions reaped (0 if none is ready), or -1 if the
+ * context is invalid.
+ */
+ssize_t tfs_async_poll(tfs_async_t *async, tfs_async_completion_t *completions,
+                       size_t max);
+
+/**
+ * Reap the completions of requests submitted to an asynchronous I/O context,
+ * waiting for at least one.
+ *
+ * Returns the number of completions reaped (at least 1), or -1 if the context
+ * is invalid, or has no request in flight.
+ */
+ssize_t tfs_async_wait(tfs_async_t *async, tfs_async_completion_t *completions,
+                       size_t max);
+
+/**
+ * Destroy an asynchronous I/O context, once every request submitted to it has
+ * run (their completions, if not reaped, are dropped). No request may be
+ * submitted meanwhile.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_async_destroy(tfs_async_t *async);
+
 #endif // OPERATIONS_H
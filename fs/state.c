@@ -1,38 +1,226 @@
 #include "state.h"
 #include "betterassert.h"
+#include "cache.h"
+#include "journal.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 /*
  * Persistent FS state
- * (in reality, it should be maintained in secondary memory;
- * for simplicity, this project maintains it in primary memory).
+ * (kept in primary memory, or in a host image file mapped into memory when
+ * fs_params.image_path is set; the mapping is private, so changes only reach
+ * the image when a checkpoint writes them, see journal.c).
+ *
+ * Every persistent region is carved out of a single mapping, in this order:
+ * superblock, inode table, inode allocation states, block bitmap, bitmap
+ * summary, data blocks. They only hold inode and block numbers (never
+ * pointers), so an image can be mapped anywhere.
+ */
+
+/*
+ * Superblock: identifies an image and its geometry. sb_clean is cleared while
+ * the image is mounted and set again once it has been unmounted (and flushed),
+ * so an image that was not unmounted cleanly is detected on the next mount,
+ * and its allocation bitmaps are rebuilt from the inodes.
  */
+typedef struct {
+    uint64_t sb_magic;
+    uint32_t sb_version;
+    uint32_t sb_clean;
+    uint64_t sb_inode_count;
+    uint64_t sb_block_count;
+    uint64_t sb_block_size;
+    uint64_t sb_inode_size; // sizeof(inode_t) of the build that made it
+} superblock_t;
+
+#define SUPERBLOCK_MAGIC UINT64_C(0x5346436f6e636554) // "TecnoCFS"
+#define SUPERBLOCK_VERSION (2)
 
 static tfs_params fs_params;
+static superblock_t *superblock;
+static void *persistent_region;
+static size_t persistent_size;
+static int image_fd = -1;
+static bool image_loaded;  // the state came from an existing image
+static bool image_mounted; // the superblock is marked as in use
 #define INODE_TABLE_SIZE (fs_params.max_inode_count)
 #define DATA_BLOCKS (fs_params.max_block_count)
 #define MAX_OPEN_FILES (fs_params.max_open_files_count)
 #define BLOCK_SIZE (fs_params.block_size)
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+
+// keys of the objects in the buffer cache (see cache.c)
+#define CACHE_KEY_INODE(inumber) ((size_t)(inumber))
+#define CACHE_KEY_BLOCK(block_number)                                          \
+    (INODE_TABLE_SIZE + (size_t)(block_number))
+#define CACHE_KEY_INODE_MAP (INODE_TABLE_SIZE + DATA_BLOCKS)
+#define CACHE_KEY_BLOCK_MAP (CACHE_KEY_INODE_MAP + 1)
+#define CACHE_KEYS (CACHE_KEY_BLOCK_MAP + 1)
+
+/*
+ * Directories are B+trees with one node per data block. Leaves hold the
+ * directory entries, sorted by name, and are linked in that order. Internal
+ * nodes hold (separator name, child block) pairs in dir_entry_t slots (with the
+ * child in d_inumber): each child holds the names >= its separator, and dn_next
+ * is the child for the names lower than the first separator.
+ *
+ * Removing an entry does not rebalance the tree: nodes may become underfull
+ * (even empty), and are only freed with the directory.
+ */
+typedef struct {
+    int dn_leaf;
+    int dn_count;
+    int dn_next; // leaves: next leaf (-1 for none); internal: leftmost child
+    dir_entry_t dn_entries[];
+} dir_node_t;
+
+#define DIR_NODE_ENTRIES                                                       \
+    ((BLOCK_SIZE - sizeof(dir_node_t)) / sizeof(dir_entry_t))
+#define DIR_MAX_DEPTH (32)
+
+/*
+ * Extent block: holds the extents of a file past the ones in its inode, and
+ * links to the next extent block of the same file.
+ */
+typedef struct {
+    int eb_next;
+    int eb_unused;
+    extent_t eb_extents[];
+} extent_block_t;
+
+#define EXTENTS_PER_BLOCK                                                      \
+    ((BLOCK_SIZE - sizeof(extent_block_t)) / sizeof(extent_t))
+
+/*
+ * Lock-free stack of free indices (Treiber stack). The head packs the index on
+ * top of the stack (low 32 bits) with a tag (high 32 bits) that changes on
+ * every update, so that a pop racing with a pop/push of the same index (ABA)
+ * fails its compare-and-swap instead of corrupting the stack.
+ */
+typedef struct {
+    _Atomic uint64_t head;
+    _Atomic int *next;
+} index_stack_t;
+
+#define INDEX_STACK_EMPTY (-1)
 
 // Inode table
 static inode_t *inode_table;
 static allocation_state_t *freeinode_ts;
+static index_stack_t free_inumbers;
 
 // Data blocks
 static char *fs_data; // # blocks * block size
-static allocation_state_t *free_blocks;
+
+/*
+ * Data block allocation map: one bit per block (set means TAKEN), packed in
+ * 64-bit words. A second level keeps one bit per word of the first level, set
+ * when that word is full, so allocation skips full regions 64 words at a time.
+ */
+#define BITMAP_WORD_BITS (64)
+#define BITMAP_WORDS(n) (((n) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+static uint64_t *free_blocks;
+static uint64_t *free_blocks_summary;
+static size_t free_blocks_words;
+static size_t free_blocks_hint; // word where the next allocation starts
+static pthread_mutex_t free_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * Volatile FS state
  */
+
+/*
+ * Pinned files: while reads of a file are borrowed (see tfs_read_borrow), its
+ * data blocks must stay where they are. Truncating (or deleting) a pinned file
+ * detaches its blocks from the inode but leaves them allocated, on a list that
+ * the last unpin frees; a crash in between only leaks them until the bitmap is
+ * rebuilt from the inodes on the next mount.
+ */
+typedef struct pinned_run {
+    int pr_inumber;
+    int pr_block;
+    size_t pr_length;
+    struct pinned_run *pr_next;
+} pinned_run_t;
+
+static _Atomic int *inode_pins; // per inode
+static pinned_run_t *pinned_runs;
+static pthread_mutex_t pinned_runs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Dirty tracking (with an image): one bit per inode (its slot in the inode
+ * table and its allocation state), per data block, and per word of the block
+ * bitmap (with the summary word above it). A bit is set when its part of the
+ * image changes, and taken (cleared) by the next checkpoint, which copies that
+ * part with no operation halfway through a change (see journal_checkpoint),
+ * and sets it again if the copy does not reach the image. Syncing thus writes
+ * what changed since the last sync, in address order.
+ */
+static _Atomic uint64_t *dirty_inodes;
+static _Atomic uint64_t *dirty_blocks;
+static _Atomic uint64_t *dirty_map_words;
+static uint64_t *sync_snapshot; // the bits being taken, one bitmap at a time
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Background flusher (with an image and a flush interval)
+static pthread_t flusher;
+static bool flusher_running;
+static bool flusher_stop;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake;
+
+/*
+ * Dentry cache: maps (directory inumber, name) to the inumber and type of the
+ * entry, or to -1 for names known not to exist (negative entries). It is
+ * set-associative, with DCACHE_WAYS entries and a lock per set, and replaces
+ * entries round-robin within a set.
+ *
+ * It is kept coherent with the directories by add_dir_entry and
+ * clear_dir_entry, which callers already serialize per directory, so it is
+ * never flushed: a directory is only deleted when empty, and then its cached
+ * names are all negative, which still holds if its inumber is reused for a new
+ * (empty) directory.
+ */
+typedef struct {
+    int de_dir; // -1 for an unused entry
+    int de_inumber;
+    inode_type de_type;
+    char de_name[MAX_FILE_NAME];
+} dcache_entry_t;
+
+typedef struct {
+    pthread_mutex_t ds_lock;
+    size_t ds_victim;
+    dcache_entry_t ds_entries[DCACHE_WAYS];
+} dcache_set_t;
+
+static dcache_set_t *dcache;
+static size_t dcache_sets; // a power of two
+
+/*
+ * Open file table. Free slots are kept in a lock-free stack. Each slot has a
+ * state word holding a generation counter (shifted left by one) and a TAKEN
+ * bit. File handles carry the slot index in their low bits and the generation
+ * in the remaining ones, so a handle to a slot that has since been closed (and
+ * maybe reopened) no longer matches the slot state and is rejected.
+ */
 static open_file_entry_t *open_file_table;
-static allocation_state_t *free_open_file_entries;
+static _Atomic uint32_t *open_file_states;
+static index_stack_t free_open_files;
+static int fhandle_index_bits;
+static uint32_t fhandle_generation_mask;
 
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -42,41 +230,607 @@ static inline bool valid_block_number(int block_number) {
     return block_number >= 0 && block_number < DATA_BLOCKS;
 }
 
-static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+/**
+ * Split a file handle into its open file table slot and generation.
+ *
+ * Returns true if the handle may refer to a slot, false otherwise.
+ */
+static inline bool decode_file_handle(int file_handle, size_t *index,
+                                      uint32_t *generation) {
+    if (file_handle < 0) {
+        return false;
+    }
+
+    *index = (size_t)file_handle & ((1U << fhandle_index_bits) - 1);
+    *generation = (uint32_t)file_handle >> fhandle_index_bits;
+    return *index < MAX_OPEN_FILES;
 }
 
 size_t state_block_size(void) { return BLOCK_SIZE; }
 
+static inline void dirty_mark(_Atomic uint64_t *bits, size_t index) {
+    if (bits == NULL) {
+        return; // no image
+    }
+
+    _Atomic uint64_t *word = &bits[index / BITMAP_WORD_BITS];
+    uint64_t bit = UINT64_C(1) << (index % BITMAP_WORD_BITS);
+    // most changes hit something already dirty: avoid writing the shared word
+    if ((atomic_load_explicit(word, memory_order_relaxed) & bit) == 0) {
+        atomic_fetch_or_explicit(word, bit, memory_order_release);
+    }
+}
+
+/**
+ * Record that an inode changed (so that the next sync writes it).
+ */
+void inode_mark_dirty(inode_t const *inode) {
+    dirty_mark(dirty_inodes, (size_t)(inode - inode_table));
+    cache_mark_dirty(CACHE_KEY_INODE(inode - inode_table));
+}
+
+/**
+ * Record that a run of data blocks changed (so that the next sync writes
+ * them).
+ *
+ * Input:
+ *   - block_number: first block of the run
+ *   - count: number of blocks
+ */
+void data_block_mark_dirty(int block_number, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dirty_mark(dirty_blocks, (size_t)block_number + i);
+        cache_mark_dirty(CACHE_KEY_BLOCK(block_number + (int)i));
+    }
+}
+
+static inline uint64_t index_stack_pack(uint64_t tag, int index) {
+    return (tag << 32) | (uint32_t)index;
+}
+
+/**
+ * Initialize a stack holding the free indices in [0, count), lowest on top.
+ *
+ * Input:
+ *   - stack: the stack
+ *   - count: number of indices
+ *   - states: which indices are FREE, or NULL if all of them are
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int index_stack_init(index_stack_t *stack, size_t count,
+                            allocation_state_t const *states) {
+    stack->next = malloc(count * sizeof(*stack->next));
+    if (stack->next == NULL) {
+        return -1;
+    }
+
+    int top = INDEX_STACK_EMPTY;
+    for (size_t i = count; i-- > 0;) {
+        atomic_init(&stack->next[i], top);
+        if (states == NULL || states[i] == FREE) {
+            top = (int)i;
+        }
+    }
+    atomic_init(&stack->head, index_stack_pack(0, top));
+    return 0;
+}
+
+static void index_stack_destroy(index_stack_t *stack) {
+    free(stack->next);
+    stack->next = NULL;
+}
+
+static void index_stack_push(index_stack_t *stack, int index) {
+    uint64_t old = atomic_load_explicit(&stack->head, memory_order_relaxed);
+    uint64_t new;
+    do {
+        atomic_store_explicit(&stack->next[index], (int)(uint32_t)old,
+                              memory_order_relaxed);
+        new = index_stack_pack((old >> 32) + 1, index);
+    } while (!atomic_compare_exchange_weak_explicit(
+        &stack->head, &old, new, memory_order_release, memory_order_relaxed));
+}
+
+/**
+ * Pop an index from the stack.
+ *
+ * Returns the index, or INDEX_STACK_EMPTY if the stack is empty.
+ */
+static int index_stack_pop(index_stack_t *stack) {
+    uint64_t old = atomic_load_explicit(&stack->head, memory_order_acquire);
+    uint64_t new;
+    int index;
+    do {
+        index = (int)(uint32_t)old;
+        if (index == INDEX_STACK_EMPTY) {
+            return INDEX_STACK_EMPTY;
+        }
+        // may read a stale value if another thread popped 'index' meanwhile,
+        // but then the tag changed and the compare-and-swap fails
+        int next =
+            atomic_load_explicit(&stack->next[index], memory_order_relaxed);
+        new = index_stack_pack((old >> 32) + 1, next);
+    } while (!atomic_compare_exchange_weak_explicit(
+        &stack->head, &old, new, memory_order_acquire, memory_order_acquire));
+
+    return index;
+}
+
+#define REGION_ALIGNMENT (64)
+
+static void free_blocks_reset(void);
+static int free_blocks_rebuild(void);
+
+/**
+ * Read the superblock of an image.
+ *
+ * Returns 0 if successful, -1 otherwise (not a TécnicoFS image, or made by an
+ * unsupported version).
+ */
+static int superblock_read(int fd, superblock_t *sb) {
+    if (pread(fd, sb, sizeof(*sb), 0) != (ssize_t)sizeof(*sb) ||
+        sb->sb_magic != SUPERBLOCK_MAGIC ||
+        sb->sb_version != SUPERBLOCK_VERSION ||
+        sb->sb_inode_size != sizeof(inode_t)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Obtain the geometry of an existing image.
+ *
+ * Input:
+ *   - image_path: path of the image (in the host file system)
+ *   - params: where to store the image's inode count, block count and block
+ *     size (other fields are left untouched)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The image cannot be read, or is not a valid image.
+ */
+int state_image_params(char const *image_path, tfs_params *params) {
+    int fd = open(image_path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    superblock_t sb;
+    int result = superblock_read(fd, &sb);
+    close(fd);
+    if (result == -1) {
+        return -1;
+    }
+
+    params->max_inode_count = sb.sb_inode_count;
+    params->max_block_count = sb.sb_block_count;
+    params->block_size = sb.sb_block_size;
+    return 0;
+}
+
+static size_t region_align(size_t size) {
+    return (size + REGION_ALIGNMENT - 1) & ~(size_t)(REGION_ALIGNMENT - 1);
+}
+
+/**
+ * Map the persistent regions, from the image file if there is one.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The image cannot be opened, created or mapped.
+ *   - The image exists but was made with a different geometry (its size does
+ *     not match).
+ *   - malloc failure (without an image).
+ */
+static int persistent_map(void) {
+    free_blocks_words = BITMAP_WORDS(DATA_BLOCKS);
+
+    size_t inode_table_offset = region_align(sizeof(superblock_t));
+    size_t freeinode_ts_offset =
+        inode_table_offset + region_align(INODE_TABLE_SIZE * sizeof(inode_t));
+    size_t free_blocks_offset =
+        freeinode_ts_offset +
+        region_align(INODE_TABLE_SIZE * sizeof(allocation_state_t));
+    size_t summary_offset =
+        free_blocks_offset + region_align(free_blocks_words * sizeof(uint64_t));
+    size_t fs_data_offset =
+        summary_offset +
+        region_align(BITMAP_WORDS(free_blocks_words) * sizeof(uint64_t));
+    persistent_size = fs_data_offset + DATA_BLOCKS * BLOCK_SIZE;
+
+    image_loaded = false;
+    if (fs_params.image_path == NULL) {
+        persistent_region = calloc(1, persistent_size);
+        if (persistent_region == NULL) {
+            return -1;
+        }
+    } else {
+        image_fd = open(fs_params.image_path, O_RDWR | O_CREAT, 0644);
+        struct stat st;
+        if (image_fd == -1 || fstat(image_fd, &st) == -1) {
+            return -1;
+        }
+
+        if (st.st_size == 0) {
+            // a new image (the file reads as zeros once extended)
+            if (ftruncate(image_fd, (off_t)persistent_size) == -1) {
+                return -1;
+            }
+        } else {
+            superblock_t sb;
+            if (superblock_read(image_fd, &sb) == -1 ||
+                sb.sb_inode_count != INODE_TABLE_SIZE ||
+                sb.sb_block_count != DATA_BLOCKS ||
+                sb.sb_block_size != BLOCK_SIZE ||
+                (size_t)st.st_size != persistent_size) {
+                return -1; // not an image, or made with another geometry
+            }
+            image_loaded = true;
+        }
+
+        // the metadata journal lives next to the image, and finishes the
+        // checkpoint a crash may have cut short before it is mapped
+        char journal_path[strlen(fs_params.image_path) + sizeof(".journal")];
+        strcpy(journal_path, fs_params.image_path);
+        strcat(journal_path, ".journal");
+        if (journal_open(journal_path, image_fd) == -1 ||
+            (image_loaded && journal_restore() == -1)) {
+            return -1;
+        }
+
+        void *region = mmap(NULL, persistent_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE, image_fd, 0);
+        if (region == MAP_FAILED) {
+            return -1;
+        }
+        persistent_region = region;
+    }
+
+    char *base = persistent_region;
+    superblock = (superblock_t *)base;
+    inode_table = (inode_t *)(base + inode_table_offset);
+    freeinode_ts = (allocation_state_t *)(base + freeinode_ts_offset);
+    free_blocks = (uint64_t *)(base + free_blocks_offset);
+    free_blocks_summary = (uint64_t *)(base + summary_offset);
+    fs_data = base + fs_data_offset;
+    return 0;
+}
+
+/**
+ * Find the next run of set bits in a bitmap.
+ *
+ * Input:
+ *   - words: the bitmap
+ *   - n_bits: number of bits in the bitmap
+ *   - pos: bit where the search starts; moved past the run found
+ *   - start, length: where to store the run
+ *
+ * Returns true if a run was found, false otherwise.
+ */
+static bool bitmap_next_run(uint64_t const *words, size_t n_bits, size_t *pos,
+                            size_t *start, size_t *length) {
+    size_t b = *pos;
+    // first set bit
+    while (b < n_bits) {
+        uint64_t set = words[b / BITMAP_WORD_BITS] >> (b % BITMAP_WORD_BITS);
+        if (set != 0) {
+            b += (size_t)__builtin_ctzll(set);
+            break;
+        }
+        b += BITMAP_WORD_BITS - b % BITMAP_WORD_BITS;
+    }
+    if (b >= n_bits) {
+        return false;
+    }
+
+    // first clear bit after it
+    size_t end = b;
+    while (end < n_bits) {
+        uint64_t clear =
+            ~words[end / BITMAP_WORD_BITS] >> (end % BITMAP_WORD_BITS);
+        if (clear != 0) {
+            end += (size_t)__builtin_ctzll(clear);
+            break;
+        }
+        end += BITMAP_WORD_BITS - end % BITMAP_WORD_BITS;
+    }
+    if (end > n_bits) {
+        end = n_bits;
+    }
+
+    *start = b;
+    *length = end - b;
+    *pos = end;
+    return true;
+}
+
+/**
+ * Take the dirty bits of a bitmap into sync_snapshot, clearing them.
+ */
+static void dirty_take(_Atomic uint64_t *bits, size_t n_bits) {
+    for (size_t i = 0; i < BITMAP_WORDS(n_bits); i++) {
+        sync_snapshot[i] = 0;
+        if (atomic_load_explicit(&bits[i], memory_order_relaxed) != 0) {
+            sync_snapshot[i] =
+                atomic_exchange_explicit(&bits[i], 0, memory_order_acquire);
+        }
+    }
+}
+
+/**
+ * Hand a range of the image to the checkpoint being taken.
+ */
+static void image_range_capture(void const *start, size_t length) {
+    journal_image((uint64_t)((char const *)start -
+                             (char const *)persistent_region),
+                  start, length);
+}
+
+/**
+ * Hand every part of the image that changed since the last checkpoint to the
+ * one being taken (see journal_checkpoint).
+ */
+static void image_capture(void) {
+    size_t pos, start, length;
+
+    dirty_take(dirty_inodes, INODE_TABLE_SIZE);
+    for (pos = 0; bitmap_next_run(sync_snapshot, INODE_TABLE_SIZE, &pos,
+                                  &start, &length);) {
+        image_range_capture(&inode_table[start], length * sizeof(inode_t));
+    }
+    for (pos = 0; bitmap_next_run(sync_snapshot, INODE_TABLE_SIZE, &pos,
+                                  &start, &length);) {
+        image_range_capture(&freeinode_ts[start],
+                            length * sizeof(allocation_state_t));
+    }
+
+    dirty_take(dirty_map_words, free_blocks_words);
+    for (pos = 0; bitmap_next_run(sync_snapshot, free_blocks_words, &pos,
+                                  &start, &length);) {
+        image_range_capture(&free_blocks[start], length * sizeof(uint64_t));
+    }
+    size_t next = 0; // (runs of words may share a summary word)
+    for (pos = 0; bitmap_next_run(sync_snapshot, free_blocks_words, &pos,
+                                  &start, &length);) {
+        size_t first = start / BITMAP_WORD_BITS;
+        size_t last = (start + length - 1) / BITMAP_WORD_BITS;
+        if (first < next) {
+            first = next;
+        }
+        if (first <= last) {
+            image_range_capture(&free_blocks_summary[first],
+                                (last - first + 1) * sizeof(uint64_t));
+            next = last + 1;
+        }
+    }
+
+    dirty_take(dirty_blocks, DATA_BLOCKS);
+    for (pos = 0;
+         bitmap_next_run(sync_snapshot, DATA_BLOCKS, &pos, &start, &length);) {
+        image_range_capture(fs_data + start * BLOCK_SIZE, length * BLOCK_SIZE);
+    }
+}
+
+/**
+ * Mark the objects of a region that overlap a range of the image as dirty.
+ *
+ * Input:
+ *   - start, end: the range
+ *   - region, size, count: the region, made of count objects of a given size
+ *   - bits: the dirty bits, where object i has bit i * scale
+ */
+static void dirty_mark_overlap(char const *start, char const *end,
+                               void const *region, size_t size, size_t count,
+                               _Atomic uint64_t *bits, size_t scale) {
+    char const *first = region;
+    char const *last = first + count * size;
+    if (end <= first || start >= last) {
+        return;
+    }
+
+    size_t i = start > first ? (size_t)(start - first) / size : 0;
+    size_t stop =
+        end < last ? ((size_t)(end - first) + size - 1) / size : count;
+    for (; i < stop; i++) {
+        dirty_mark(bits, i * scale);
+    }
+}
+
+/**
+ * Take back a range of the image from a checkpoint that did not write it: its
+ * objects are dirty again, for the next one.
+ */
+static void image_lost(uint64_t offset, size_t length) {
+    char const *start = (char const *)persistent_region + offset;
+    char const *end = start + length;
+    dirty_mark_overlap(start, end, inode_table, sizeof(inode_t),
+                       INODE_TABLE_SIZE, dirty_inodes, 1);
+    dirty_mark_overlap(start, end, freeinode_ts, sizeof(allocation_state_t),
+                       INODE_TABLE_SIZE, dirty_inodes, 1);
+    dirty_mark_overlap(start, end, free_blocks, sizeof(uint64_t),
+                       free_blocks_words, dirty_map_words, 1);
+    // (a summary word is taken with any of the words below it)
+    dirty_mark_overlap(start, end, free_blocks_summary, sizeof(uint64_t),
+                       BITMAP_WORDS(free_blocks_words), dirty_map_words,
+                       BITMAP_WORD_BITS);
+    dirty_mark_overlap(start, end, fs_data, BLOCK_SIZE, DATA_BLOCKS,
+                       dirty_blocks, 1);
+}
+
 /**
- * Do nothing, while preventing the compiler from performing any optimizations.
+ * Write the changes made to the image since it was last synced, and empty the
+ * metadata journal, whose records those changes include (see
+ * journal_checkpoint).
+ *
+ * Returns 0 if successful, -1 otherwise.
  *
- * We need to defeat the optimizer for the insert_delay() function.
- * Under optimization, the empty loop would be completely optimized away.
- * This function tells the compiler that the assembly code being run (which is
- * none) might potentially change *all memory in the process*.
+ * Possible errors:
+ *   - The image or the journal could not be written.
+ */
+int state_sync(void) {
+    if (image_fd == -1) {
+        return 0; // nothing to flush
+    }
+
+    pthread_mutex_lock(&sync_lock);
+    int result = journal_checkpoint(image_capture, image_lost);
+    pthread_mutex_unlock(&sync_lock);
+
+    return result;
+}
+
+static void *flusher_thread_func(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&flusher_lock);
+    while (!flusher_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += (time_t)(fs_params.flush_interval_ms / 1000);
+        deadline.tv_nsec +=
+            (long)(fs_params.flush_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        if (pthread_cond_timedwait(&flusher_wake, &flusher_lock, &deadline) ==
+            ETIMEDOUT) {
+            pthread_mutex_unlock(&flusher_lock);
+            state_sync();
+            pthread_mutex_lock(&flusher_lock);
+        }
+    }
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
+/**
+ * Start the background flusher, which syncs the image every
+ * fs_params.flush_interval_ms.
  *
- * This prevents the optimizer from optimizing this code away, because it does
- * not know what it does and it may have side effects.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int flusher_start(void) {
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr) != 0) {
+        return -1;
+    }
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int result = pthread_cond_init(&flusher_wake, &attr);
+    pthread_condattr_destroy(&attr);
+    if (result != 0) {
+        return -1;
+    }
+
+    flusher_stop = false;
+    if (pthread_create(&flusher, NULL, flusher_thread_func, NULL) != 0) {
+        pthread_cond_destroy(&flusher_wake);
+        return -1;
+    }
+    flusher_running = true;
+    return 0;
+}
+
+static void flusher_join(void) {
+    if (!flusher_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&flusher_lock);
+    flusher_stop = true;
+    pthread_cond_signal(&flusher_wake);
+    pthread_mutex_unlock(&flusher_lock);
+    pthread_join(flusher, NULL);
+    pthread_cond_destroy(&flusher_wake);
+    flusher_running = false;
+}
+
+/**
+ * Write the superblock to the image (checkpoints never do), and flush it.
  *
- * Reference with more information: https://youtu.be/nXaxk27zwlk?t=2775
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int superblock_write(void) {
+    if (pwrite(image_fd, superblock, sizeof(*superblock), 0) !=
+            (ssize_t)sizeof(*superblock) ||
+        fdatasync(image_fd) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Mark the image as in use, so that a crash leaves it marked as not clean.
  *
- * Exercise: try removing this function and look at the assembly generated to
- * compare.
+ * Returns whether it was clean.
  */
-static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
+static bool superblock_mount(void) {
+    bool clean = superblock->sb_clean != 0;
+    superblock->sb_magic = SUPERBLOCK_MAGIC;
+    superblock->sb_version = SUPERBLOCK_VERSION;
+    superblock->sb_clean = 0;
+    superblock->sb_inode_count = INODE_TABLE_SIZE;
+    superblock->sb_block_count = DATA_BLOCKS;
+    superblock->sb_block_size = BLOCK_SIZE;
+    superblock->sb_inode_size = sizeof(inode_t);
+    if (image_fd != -1) {
+        superblock_write();
+    }
+    image_mounted = true;
+    return clean;
+}
+
+static void persistent_unmap(void) {
+    if (image_fd != -1) {
+        // everything else must reach the image before it is marked clean,
+        // and then the journal is no longer needed (the LSNs start again from
+        // the inodes' on the next mount); if it does not, the next mount
+        // recovers from the journal
+        if (image_mounted &&
+            journal_checkpoint(image_capture, image_lost) == 0) {
+            superblock->sb_clean = 1;
+            if (superblock_write() == 0) {
+                journal_reset(1);
+            }
+        }
+        journal_close();
+        if (persistent_region != NULL) {
+            munmap(persistent_region, persistent_size);
+        }
+        close(image_fd);
+        image_fd = -1;
+    } else {
+        free(persistent_region);
+    }
+    persistent_region = NULL;
+    superblock = NULL;
+    image_mounted = false;
+}
+
+static void journal_redo(journal_record_t const *record, void const *payload);
 
 /**
- * Artifically delay execution (busy loop).
+ * Redo the metadata operations logged since the image was last checkpointed,
+ * checkpoint it, and start the journal over.
  *
- * Auxiliary function to insert a delay.
- * Used in accesses to persistent FS state as a way of emulating access
- * latencies as if such data structures were really stored in secondary memory.
+ * Returns 0 if successful, -1 otherwise.
  */
-static void insert_delay(void) {
-    for (int i = 0; i < DELAY; i++) {
-        touch_all_memory();
+static int state_recover(void) {
+    // a journal left next to a new image belongs to an image that is gone
+    uint64_t last_lsn = 0;
+    if (image_loaded && journal_replay(journal_redo, &last_lsn) > 0 &&
+        journal_checkpoint(image_capture, image_lost) == -1) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        if (inode_table[i].i_lsn > last_lsn) {
+            last_lsn = inode_table[i].i_lsn;
+        }
     }
+    return journal_reset(last_lsn + 1);
 }
 
 /**
@@ -92,339 +846,1640 @@ static void insert_delay(void) {
  *   - malloc failure when allocating TFS structures.
  */
 int state_init(tfs_params params) {
+    if (persistent_region != NULL) {
+        return -1; // already initialized
+    }
+
     fs_params = params;
+    if (DIR_NODE_ENTRIES < 2) {
+        return -1; // blocks too small for directories
+    }
+    if (cache_init(params.latency, params.cache_frames, CACHE_KEYS,
+                   params.readahead_max_blocks > 0) == -1) {
+        return -1;
+    }
 
-    if (inode_table != NULL) {
-        return -1; // already initialized
+    if (persistent_map() != 0) {
+        persistent_unmap();
+        cache_destroy();
+        return -1;
     }
 
-    inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
-    freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-    fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
-    free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
     open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
-    free_open_file_entries =
-        malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
+    for (size_t i = 0; open_file_table != NULL && i < MAX_OPEN_FILES; i++) {
+        pthread_mutex_init(&open_file_table[i].of_lock, NULL);
+    }
+    open_file_states = calloc(MAX_OPEN_FILES, sizeof(*open_file_states));
+    inode_pins = calloc(INODE_TABLE_SIZE, sizeof(*inode_pins));
+
+    // about one set per inode
+    dcache_sets = 1;
+    while (dcache_sets < INODE_TABLE_SIZE) {
+        dcache_sets <<= 1;
+    }
+    dcache = malloc(dcache_sets * sizeof(dcache_set_t));
+    for (size_t i = 0; dcache != NULL && i < dcache_sets; i++) {
+        pthread_mutex_init(&dcache[i].ds_lock, NULL);
+        dcache[i].ds_victim = 0;
+        for (size_t way = 0; way < DCACHE_WAYS; way++) {
+            dcache[i].ds_entries[way].de_dir = -1;
+        }
+    }
+
+    if (image_fd != -1) {
+        dirty_inodes = calloc(BITMAP_WORDS(INODE_TABLE_SIZE), sizeof(uint64_t));
+        dirty_blocks = calloc(BITMAP_WORDS(DATA_BLOCKS), sizeof(uint64_t));
+        dirty_map_words =
+            calloc(BITMAP_WORDS(free_blocks_words), sizeof(uint64_t));
+        size_t snapshot_bits = INODE_TABLE_SIZE > DATA_BLOCKS
+                                   ? INODE_TABLE_SIZE
+                                   : DATA_BLOCKS;
+        sync_snapshot = malloc(BITMAP_WORDS(snapshot_bits) * sizeof(uint64_t));
+        if (!dirty_inodes || !dirty_blocks || !dirty_map_words ||
+            !sync_snapshot) {
+            return -1; // allocation failed
+        }
+    }
 
-    if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
-        !open_file_table || !free_open_file_entries) {
+    if (!open_file_table || !open_file_states || !inode_pins || !dcache) {
         return -1; // allocation failed
     }
 
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
+    bool clean = superblock_mount();
+    if (!image_loaded) {
+        // a new filesystem: every inode and block is free
+        for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+            freeinode_ts[i] = FREE;
+        }
+        free_blocks_reset();
+    } else if (!clean && free_blocks_rebuild() == -1) {
+        // (the bitmaps may not match the inodes that were written back, and
+        // neither could be trusted): the image is left as it was, unclean
+        image_mounted = false;
+        state_destroy();
+        return -1;
     }
+    free_blocks_hint = 0;
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+    if (image_fd != -1 && state_recover() == -1) {
+        return -1;
     }
 
+    // the free inode list is volatile: it is rebuilt from the inode states
+    if (index_stack_init(&free_inumbers, INODE_TABLE_SIZE, freeinode_ts) != 0 ||
+        index_stack_init(&free_open_files, MAX_OPEN_FILES, NULL) != 0) {
+        return -1; // allocation failed
+    }
+
+    // handles must be non-negative ints: slot bits + generation bits <= 31
+    fhandle_index_bits = 0;
+    while ((1UL << fhandle_index_bits) < MAX_OPEN_FILES) {
+        fhandle_index_bits++;
+    }
+    if (fhandle_index_bits > 24) {
+        return -1; // too few generation bits left
+    }
+    fhandle_generation_mask = (1U << (31 - fhandle_index_bits)) - 1;
+
     for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
+        atomic_init(&open_file_states[i], 0);
+    }
+
+    if (image_fd != -1 && fs_params.flush_interval_ms > 0 &&
+        flusher_start() != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void pinned_runs_free(void);
+
+/**
+ * Destroy FS state.
+ *
+ * Returns 0 if succesful, -1 otherwise.
+ */
+int state_destroy(void) {
+    flusher_join();
+    // views still borrowed go with the state (and their blocks with them)
+    if (persistent_region != NULL) {
+        pinned_runs_free();
+    }
+    persistent_unmap();
+    cache_destroy();
+    free((void *)dirty_inodes);
+    free((void *)dirty_blocks);
+    free((void *)dirty_map_words);
+    free(sync_snapshot);
+    dirty_inodes = dirty_blocks = dirty_map_words = NULL;
+    sync_snapshot = NULL;
+    index_stack_destroy(&free_inumbers);
+    if (open_file_table != NULL) {
+        for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
+            pthread_mutex_destroy(&open_file_table[i].of_lock);
+            // (the buffers of handles left open)
+            if (open_file_states != NULL &&
+                (atomic_load(&open_file_states[i]) & TAKEN)) {
+                free(open_file_table[i].of_buffer);
+            }
+        }
+    }
+    free(open_file_table);
+    free((void *)open_file_states);
+    free((void *)inode_pins);
+    index_stack_destroy(&free_open_files);
+    if (dcache != NULL) {
+        for (size_t i = 0; i < dcache_sets; i++) {
+            pthread_mutex_destroy(&dcache[i].ds_lock);
+        }
+        free(dcache);
+    }
+
+    inode_table = NULL;
+    freeinode_ts = NULL;
+    fs_data = NULL;
+    free_blocks = NULL;
+    free_blocks_summary = NULL;
+    open_file_table = NULL;
+    open_file_states = NULL;
+    inode_pins = NULL;
+    dcache = NULL;
+
+    return 0;
+}
+
+/**
+ * Whether the FS state was loaded from an existing image (rather than starting
+ * as an empty filesystem).
+ */
+bool state_loaded(void) { return image_loaded; }
+
+/**
+ * (Try to) Allocate a new inode in the inode table, without initializing its
+ * data.
+ *
+ * The inumber is popped from the free list, so this takes constant time and
+ * does not need any lock.
+ *
+ * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free slots in inode table.
+ */
+static int inode_alloc(void) {
+    // simulate storage access delay (to the free list head)
+    cache_access(TFS_STRUCT_BITMAP, CACHE_KEY_INODE_MAP, sizeof(uint64_t));
+
+    int inumber = index_stack_pop(&free_inumbers);
+    if (inumber == INDEX_STACK_EMPTY) {
+        return -1; // no free inodes
+    }
+
+    ALWAYS_ASSERT(freeinode_ts[inumber] == FREE,
+                  "inode_alloc: free list returned a taken inode");
+    freeinode_ts[inumber] = TAKEN;
+    dirty_mark(dirty_inodes, (size_t)inumber);
+    cache_mark_dirty(CACHE_KEY_INODE_MAP);
+
+    return inumber;
+}
+
+/**
+ * Initialize an inode that was just allocated.
+ *
+ * Directories will have the root of their B+tree allocated and initialized,
+ * with i_size set to BLOCK_SIZE. Regular files will not have any data block
+ * allocated (i_size will be set to 0, every block pointer to -1). The inode's
+ * LSN is kept: it still tells which journal records it has seen.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - (if creating a directory) No free data blocks.
+ */
+static int inode_init(int inumber, inode_type i_type) {
+    inode_t *inode = &inode_table[inumber];
+    // simulate storage access delay (to inode)
+    cache_access(TFS_STRUCT_INODE, CACHE_KEY_INODE(inumber), sizeof(inode_t));
+
+    inode->i_node_type = i_type;
+    inode->hard_links = 1;
+    inode->i_size = 0;
+    inode->i_extent_block = -1;
+    inode->i_extent_count = 0;
+    inode->i_block_count = 0;
+    inode->i_dir_root = -1;
+
+    switch (i_type) {
+    case T_DIRECTORY: {
+        // Initializes directory (its B+tree is a single, empty, leaf)
+        int b = data_block_alloc();
+        if (b == -1) {
+            return -1;
+        }
+
+        inode->i_dir_root = b;
+        inode->i_size = BLOCK_SIZE;
+
+        dir_node_t *root = (dir_node_t *)data_block_get(b);
+        ALWAYS_ASSERT(root != NULL,
+                      "inode_create: data block freed while in use");
+
+        root->dn_leaf = 1;
+        root->dn_count = 0;
+        root->dn_next = -1;
+        data_block_mark_dirty(b, 1);
+    } break;
+    case T_FILE:
+        // In case of a new file, simply sets its size to 0
+        break;
+
+    case T_LINK:
+        break;
+    default:
+        PANIC("inode_create: unknown file type");
+    }
+
+    inode_mark_dirty(inode);
+    return 0;
+}
+
+/**
+ * Create a new inode in the inode table.
+ *
+ * Allocates and initializes a new inode (see inode_init).
+ *
+ * Input:
+ *   - i_type: the type of the node (file or directory)
+ *
+ * Returns inumber of the new inode, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free slots in inode table.
+ *   - (if creating a directory) No free data blocks.
+ */
+int inode_create(inode_type i_type) {
+    int inumber = inode_alloc();
+    if (inumber == -1) {
+        return -1; // no free slots in inode table
+    }
+
+    if (inode_init(inumber, i_type) == -1) {
+        // run regular deletion process
+        inode_delete(inumber);
+        return -1;
+    }
+
+    return inumber;
+}
+
+static void dir_tree_free(int node_block);
+
+/**
+ * Free an inode's data blocks, and the inode itself (without returning it to
+ * the free list).
+ */
+static void inode_release(int inumber) {
+    if (inode_table[inumber].i_node_type == T_DIRECTORY) {
+        dir_tree_free(inode_table[inumber].i_dir_root);
+        inode_table[inumber].i_dir_root = -1;
+        inode_table[inumber].i_size = 0;
+    } else {
+        inode_truncate(&inode_table[inumber]);
+    }
+
+    freeinode_ts[inumber] = FREE;
+    dirty_mark(dirty_inodes, (size_t)inumber);
+    cache_mark_dirty(CACHE_KEY_INODE_MAP);
+}
+
+/**
+ * Delete an inode.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_delete(int inumber) {
+    // simulate storage access delay (to inode and freeinode_ts)
+    cache_access(TFS_STRUCT_INODE, CACHE_KEY_INODE(inumber), sizeof(inode_t));
+    cache_access(TFS_STRUCT_BITMAP, CACHE_KEY_INODE_MAP, sizeof(uint64_t));
+
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
+
+    ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
+                  "inode_delete: inode already freed");
+
+    inode_release(inumber);
+    index_stack_push(&free_inumbers, inumber);
+}
+
+/**
+ * Obtain a pointer to an inode from its inumber.
+ *
+ * Input:
+ *   - inumber: inode's number
+ *
+ * Returns pointer to inode.
+ */
+inode_t *inode_get(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
+
+    // simulate storage access delay to inode
+    cache_access(TFS_STRUCT_INODE, CACHE_KEY_INODE(inumber), sizeof(inode_t));
+    return &inode_table[inumber];
+}
+
+/**
+ * Obtain a file's extent by its position in the file's extent list.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - index: position of the extent (< i_extent_count, or == i_extent_count
+ *     when appending, once the extent block that holds it is allocated)
+ *
+ * Returns a pointer to the extent.
+ */
+static extent_t *inode_extent(inode_t const *inode, size_t index) {
+    if (index < INODE_EXTENTS) {
+        return (extent_t *)&inode->i_extents[index];
+    }
+
+    index -= INODE_EXTENTS;
+    int block_number = inode->i_extent_block;
+    while (block_number != -1) {
+        extent_block_t *block = (extent_block_t *)data_block_get(block_number);
+        if (index < EXTENTS_PER_BLOCK) {
+            return &block->eb_extents[index];
+        }
+
+        index -= EXTENTS_PER_BLOCK;
+        block_number = block->eb_next;
+    }
+
+    PANIC("inode_extent: extent block missing");
+}
+
+/**
+ * Obtain the data block holding a given block of a file.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - block_index: index of the block within the file (offset / BLOCK_SIZE)
+ *   - run: if not NULL, where to store the number of contiguous blocks of the
+ *     file starting at that data block (up to the end of its extent)
+ *
+ * Returns the block number, or -1 if the file has no such block.
+ */
+int inode_block(inode_t const *inode, size_t block_index, size_t *run) {
+    if (block_index >= inode->i_block_count) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < inode->i_extent_count; i++) {
+        extent_t const *extent = inode_extent(inode, i);
+        if (block_index < (size_t)extent->e_length) {
+            if (run != NULL) {
+                *run = (size_t)extent->e_length - block_index;
+            }
+            return extent->e_block + (int)block_index;
+        }
+        block_index -= (size_t)extent->e_length;
+    }
+
+    PANIC("inode_block: extents do not match the block count");
+}
+
+/**
+ * Copy a file's extents, in file order, walking the extent blocks only once
+ * (unlike looking each one up with inode_block).
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - first: position of the first extent to copy
+ *   - extents: where to copy them
+ *   - count: at most how many to copy
+ *
+ * Returns the number of extents copied (0 past the last one).
+ */
+size_t inode_extents(inode_t const *inode, size_t first, extent_t *extents,
+                     size_t count) {
+    size_t copied = 0;
+    size_t index = first;
+    extent_block_t const *block = NULL;
+    while (copied < count && index < inode->i_extent_count) {
+        if (index < INODE_EXTENTS) {
+            extents[copied++] = inode->i_extents[index++];
+            continue;
+        }
+
+        size_t slot = (index - INODE_EXTENTS) % EXTENTS_PER_BLOCK;
+        if (block == NULL) {
+            // find the extent block that holds it, once
+            block = (extent_block_t const *)data_block_get(
+                inode->i_extent_block);
+            for (size_t i = (index - INODE_EXTENTS) / EXTENTS_PER_BLOCK; i > 0;
+                 i--) {
+                block = (extent_block_t const *)data_block_get(block->eb_next);
+            }
+        } else if (slot == 0) {
+            block = (extent_block_t const *)data_block_get(block->eb_next);
+        }
+        extents[copied++] = block->eb_extents[slot];
+        index++;
+    }
+    return copied;
+}
+
+/**
+ * Append an extent to a file's extent list, allocating an extent block if
+ * needed.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks (for a new extent block).
+ */
+static int inode_extent_append(inode_t *inode, int block_number,
+                               size_t length) {
+    size_t count = inode->i_extent_count;
+    if (count >= INODE_EXTENTS &&
+        (count - INODE_EXTENTS) % EXTENTS_PER_BLOCK == 0) {
+        // the last extent block is full (or there is none): link a new one
+        int new_block = data_block_alloc();
+        if (new_block == -1) {
+            return -1;
+        }
+
+        extent_block_t *block = (extent_block_t *)data_block_get(new_block);
+        block->eb_next = -1;
+
+        if (inode->i_extent_block == -1) {
+            inode->i_extent_block = new_block;
+        } else {
+            int prev_block = inode->i_extent_block;
+            extent_block_t *prev = (extent_block_t *)data_block_get(prev_block);
+            while (prev->eb_next != -1) {
+                prev_block = prev->eb_next;
+                prev = (extent_block_t *)data_block_get(prev_block);
+            }
+            prev->eb_next = new_block;
+            data_block_mark_dirty(prev_block, 1);
+        }
+    }
+
+    extent_t *extent = inode_extent(inode, count);
+    extent->e_block = block_number;
+    extent->e_length = (int)length;
+    inode->i_extent_count++;
+    return 0;
+}
+
+/**
+ * Map more data blocks at the end of a file, allocating them as extents.
+ *
+ * The new blocks are allocated right after the file's last block whenever
+ * possible, so that the last extent just grows. The contents of the new blocks
+ * are not initialized.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - block_count: number of blocks the file should have mapped
+ *
+ * Returns the number of blocks mapped after growing, which is lower than
+ * block_count if there are not enough free data blocks.
+ */
+size_t inode_grow(inode_t *inode, size_t block_count) {
+    while (inode->i_block_count < block_count) {
+        extent_t *last = NULL;
+        int goal = -1;
+        if (inode->i_extent_count > 0) {
+            last = inode_extent(inode, inode->i_extent_count - 1);
+            goal = last->e_block + last->e_length;
+        }
+
+        size_t got;
+        int start = data_block_alloc_extent(
+            goal, block_count - inode->i_block_count, &got);
+        if (start == -1) {
+            break; // no space
+        }
+
+        if (last != NULL && start == goal) {
+            last->e_length += (int)got;
+        } else if (inode_extent_append(inode, start, got) == -1) {
+            data_block_free_extent(start, got);
+            break; // no space for the extent itself
+        }
+        inode->i_block_count += got;
+    }
+
+    // the extents that changed: the last one, in the inode or in the last
+    // extent block
+    inode_mark_dirty(inode);
+    if (inode->i_extent_count > INODE_EXTENTS) {
+        int block_number = inode->i_extent_block;
+        int next;
+        while ((next = ((extent_block_t const *)data_block_get(block_number))
+                           ->eb_next) != -1) {
+            block_number = next;
+        }
+        data_block_mark_dirty(block_number, 1);
+    }
+    return inode->i_block_count;
+}
+
+/**
+ * Free every data block of a file and set its size to 0.
+ *
+ * Input:
+ *   - inode: the file's inode
+ */
+void inode_truncate(inode_t *inode) {
+    // only a borrow's release unpins concurrently (borrowing needs the file,
+    // which the caller holds), so a file seen unpinned stays unpinned
+    int inumber = (int)(inode - inode_table);
+    bool locked = atomic_load(&inode_pins[inumber]) > 0;
+    if (locked) {
+        pthread_mutex_lock(&pinned_runs_lock);
+    }
+    bool pinned = locked && atomic_load(&inode_pins[inumber]) > 0;
+    for (size_t i = 0; i < inode->i_extent_count; i++) {
+        extent_t const *extent = inode_extent(inode, i);
+        if (!pinned) {
+            data_block_free_extent(extent->e_block, (size_t)extent->e_length);
+            continue;
+        }
+        // (a run that cannot be listed stays allocated until a rebuild)
+        pinned_run_t *run = malloc(sizeof(pinned_run_t));
+        if (run != NULL) {
+            *run = (pinned_run_t){
+                .pr_inumber = inumber,
+                .pr_block = extent->e_block,
+                .pr_length = (size_t)extent->e_length,
+                .pr_next = pinned_runs,
+            };
+            pinned_runs = run;
+        }
+    }
+    if (locked) {
+        pthread_mutex_unlock(&pinned_runs_lock);
+    }
+
+    int block_number = inode->i_extent_block;
+    while (block_number != -1) {
+        extent_block_t const *block =
+            (extent_block_t const *)data_block_get(block_number);
+        int next = block->eb_next;
+        data_block_free(block_number);
+        block_number = next;
+    }
+
+    inode->i_extent_block = -1;
+    inode->i_extent_count = 0;
+    inode->i_block_count = 0;
+    inode->i_size = 0;
+    inode_mark_dirty(inode);
+}
+
+/**
+ * Pin a file's data blocks, so that they stay allocated (and in place) even if
+ * the file is truncated or deleted, until it is unpinned as many times. Called
+ * with the file locked.
+ *
+ * Input:
+ *   - inumber: the file's inumber
+ */
+void inode_pin(int inumber) { atomic_fetch_add(&inode_pins[inumber], 1); }
+
+/**
+ * Undo an inode_pin, freeing the blocks the file lost while pinned with its
+ * last pin. Called without any lock.
+ *
+ * Input:
+ *   - inumber: the file's inumber
+ */
+void inode_unpin(int inumber) {
+    if (atomic_fetch_sub(&inode_pins[inumber], 1) > 1) {
+        return;
+    }
+
+    journal_begin(); // (the caller may hold no inode lock)
+    pthread_mutex_lock(&pinned_runs_lock);
+    // (the inode may be pinned again already, through a new borrow)
+    pinned_run_t **link = &pinned_runs;
+    while (*link != NULL) {
+        pinned_run_t *run = *link;
+        if (run->pr_inumber != inumber ||
+            atomic_load(&inode_pins[inumber]) > 0) {
+            link = &run->pr_next;
+            continue;
+        }
+        data_block_free_extent(run->pr_block, run->pr_length);
+        *link = run->pr_next;
+        free(run);
+    }
+    pthread_mutex_unlock(&pinned_runs_lock);
+    journal_end();
+}
+
+/**
+ * Free the blocks of every pinned run, whether or not its file is still
+ * pinned.
+ */
+static void pinned_runs_free(void) {
+    while (pinned_runs != NULL) {
+        pinned_run_t *run = pinned_runs;
+        pinned_runs = run->pr_next;
+        data_block_free_extent(run->pr_block, run->pr_length);
+        free(run);
+    }
+}
+
+/**
+ * Returns the maximum size of a file, in bytes.
+ */
+size_t inode_max_size(void) { return DATA_BLOCKS * BLOCK_SIZE; }
+
+static inline dir_node_t *dir_node_get(int block_number) {
+    dir_node_t *node = (dir_node_t *)data_block_get(block_number);
+    ALWAYS_ASSERT(node != NULL, "dir_node_get: directory node freed");
+    return node;
+}
+
+/**
+ * Binary search for a name in a directory node.
+ *
+ * Returns the index of the first entry whose name is not lower than sub_name
+ * (dn_count if there is none).
+ */
+static size_t dir_node_search(dir_node_t const *node, char const *sub_name) {
+    size_t low = 0;
+    size_t high = (size_t)node->dn_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (strncmp(node->dn_entries[middle].d_name, sub_name, MAX_FILE_NAME) <
+            0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static inline bool dir_node_match(dir_node_t const *node, size_t index,
+                                  char const *sub_name) {
+    return index < node->dn_count &&
+           strncmp(node->dn_entries[index].d_name, sub_name, MAX_FILE_NAME) ==
+               0;
+}
+
+/**
+ * Descend a directory's B+tree to the leaf where a name is (or would be).
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: name to look for, or NULL for the leftmost leaf
+ *   - path: if not NULL, where to store the internal nodes visited, from the
+ *     root down (at most DIR_MAX_DEPTH)
+ *   - depth: if not NULL, where to store the number of nodes in path
+ *
+ * Returns the block number of the leaf.
+ */
+static int dir_find_leaf(inode_t const *inode, char const *sub_name, int *path,
+                         size_t *depth) {
+    int block_number = inode->i_dir_root;
+    size_t level = 0;
+
+    dir_node_t const *node = dir_node_get(block_number);
+    while (!node->dn_leaf) {
+        ALWAYS_ASSERT(level < DIR_MAX_DEPTH, "dir_find_leaf: tree too deep");
+        if (path != NULL) {
+            path[level] = block_number;
+        }
+        level++;
+
+        size_t index = 0;
+        if (sub_name != NULL) {
+            index = dir_node_search(node, sub_name);
+            if (dir_node_match(node, index, sub_name)) {
+                index++; // the separator itself belongs to its child
+            }
+        }
+        block_number =
+            index == 0 ? node->dn_next : node->dn_entries[index - 1].d_inumber;
+        node = dir_node_get(block_number);
+    }
+
+    if (depth != NULL) {
+        *depth = level;
+    }
+    return block_number;
+}
+
+static void dir_entry_set(dir_entry_t *entry, char const *name, int number) {
+    strncpy(entry->d_name, name, MAX_FILE_NAME - 1);
+    entry->d_name[MAX_FILE_NAME - 1] = '\0';
+    entry->d_inumber = number;
+}
+
+/**
+ * Free every node of a directory's B+tree.
+ *
+ * Input:
+ *   - node_block: root of the (sub)tree, or -1 for none
+ */
+static void dir_tree_free(int node_block) {
+    if (node_block == -1) {
+        return;
+    }
+
+    dir_node_t const *node = dir_node_get(node_block);
+    if (!node->dn_leaf) {
+        dir_tree_free(node->dn_next);
+        for (size_t i = 0; i < node->dn_count; i++) {
+            dir_tree_free(node->dn_entries[i].d_inumber);
+        }
+    }
+    data_block_free(node_block);
+}
+
+static dcache_set_t *dcache_set(int dir_inumber, char const *sub_name) {
+    // FNV-1a over the name, seeded with the directory
+    uint32_t hash = 2166136261U ^ (uint32_t)dir_inumber;
+    for (char const *c = sub_name; *c != '\0'; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619U;
+    }
+    return &dcache[hash & (dcache_sets - 1)];
+}
+
+// the set's lock must be held
+static dcache_entry_t *dcache_find(dcache_set_t *set, int dir_inumber,
+                                   char const *sub_name) {
+    for (size_t way = 0; way < DCACHE_WAYS; way++) {
+        dcache_entry_t *entry = &set->ds_entries[way];
+        if (entry->de_dir == dir_inumber &&
+            strncmp(entry->de_name, sub_name, MAX_FILE_NAME) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Record a name in the dentry cache, replacing any previous entry for it.
+ *
+ * Input:
+ *   - dir_inumber: inumber of the directory
+ *   - sub_name: name in the directory (shorter than MAX_FILE_NAME)
+ *   - sub_inumber: inumber of the entry, or -1 if there is none
+ *   - sub_type: type of the entry's inode (ignored if there is none)
+ */
+static void dcache_store(int dir_inumber, char const *sub_name,
+                         int sub_inumber, inode_type sub_type) {
+    dcache_set_t *set = dcache_set(dir_inumber, sub_name);
+    pthread_mutex_lock(&set->ds_lock);
+
+    dcache_entry_t *entry = dcache_find(set, dir_inumber, sub_name);
+    if (entry == NULL) {
+        entry = &set->ds_entries[set->ds_victim];
+        set->ds_victim = (set->ds_victim + 1) % DCACHE_WAYS;
+        entry->de_dir = dir_inumber;
+        strncpy(entry->de_name, sub_name, MAX_FILE_NAME - 1);
+        entry->de_name[MAX_FILE_NAME - 1] = '\0';
+    }
+    entry->de_inumber = sub_inumber;
+    entry->de_type = sub_type;
+
+    pthread_mutex_unlock(&set->ds_lock);
+}
+
+static inline int dir_inumber_of(inode_t const *inode) {
+    return (int)(inode - inode_table);
+}
+
+/**
+ * Clear the directory entry associated with a sub file.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory does not contain an entry for sub_name.
+ */
+int clear_dir_entry(inode_t *inode, char const *sub_name) {
+    cache_access(TFS_STRUCT_INODE, CACHE_KEY_INODE(inode - inode_table),
+                 sizeof(inode_t));
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    // Locates the leaf that holds the entry
+    int leaf_block = dir_find_leaf(inode, sub_name, NULL, NULL);
+    dir_node_t *leaf = dir_node_get(leaf_block);
+
+    size_t index = dir_node_search(leaf, sub_name);
+    if (!dir_node_match(leaf, index, sub_name)) {
+        return -1; // sub_name not found
+    }
+
+    memmove(&leaf->dn_entries[index], &leaf->dn_entries[index + 1],
+            ((size_t)leaf->dn_count - index - 1) * sizeof(dir_entry_t));
+    leaf->dn_count--;
+    data_block_mark_dirty(leaf_block, 1);
+
+    dcache_store(dir_inumber_of(inode), sub_name, -1, T_FILE);
+    return 0;
+}
+
+/**
+ * Entry k of a full directory node with an entry inserted at index (as if the
+ * node had room for it).
+ */
+static dir_entry_t const *dir_split_entry(dir_node_t const *node, size_t index,
+                                          dir_entry_t const *insert, size_t k) {
+    if (k == index) {
+        return insert;
+    }
+    return &node->dn_entries[k < index ? k : k - 1];
+}
+
+/**
+ * Store the inumber for a sub file in a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *   - sub_inumber: inumber of the sub inode
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
+ *   - Directory already contains an entry for sub_name.
+ *   - No free data blocks to grow the directory.
+ */
+int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
+    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
+        return -1; // invalid sub_name
+    }
+
+    // simulate storage access delay to inode
+    cache_access(TFS_STRUCT_INODE, CACHE_KEY_INODE(inode - inode_table),
+                 sizeof(inode_t));
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    // Locates the leaf where the entry goes
+    int path[DIR_MAX_DEPTH];
+    size_t depth;
+    int block_number = dir_find_leaf(inode, sub_name, path, &depth);
+    dir_node_t *node = dir_node_get(block_number);
+    if (dir_node_match(node, dir_node_search(node, sub_name), sub_name)) {
+        return -1; // name already taken
+    }
+
+    // Every full node on the way up splits (and a full root needs a new root
+    // above it), so allocate all the new nodes before changing anything
+    int new_blocks[DIR_MAX_DEPTH + 2];
+    size_t splits = 0;
+    for (size_t level = depth + 1; level > 0; level--) {
+        if (level <= depth) {
+            node = dir_node_get(path[level - 1]);
+        }
+        if (node->dn_count < DIR_NODE_ENTRIES) {
+            break;
+        }
+        splits += level == 1 ? 2 : 1;
+    }
+    for (size_t i = 0; i < splits; i++) {
+        new_blocks[i] = data_block_alloc();
+        if (new_blocks[i] == -1) {
+            while (i-- > 0) {
+                data_block_free(new_blocks[i]);
+            }
+            return -1; // no space to grow the directory
+        }
+    }
+    if (splits > 0) {
+        inode->i_size += splits * BLOCK_SIZE;
+        inode_mark_dirty(inode);
+    }
+
+    // From here on the insertion cannot fail
+    dcache_store(dir_inumber_of(inode), sub_name, sub_inumber,
+                 inode_table[sub_inumber].i_node_type);
+
+    // Insert the entry in its leaf, and then each split's separator in the
+    // parent node
+    dir_entry_t insert;
+    dir_entry_set(&insert, sub_name, sub_inumber);
+    size_t level = depth;
+    size_t used = 0;
+    while (true) {
+        node = dir_node_get(block_number);
+        size_t index = dir_node_search(node, insert.d_name);
+        size_t count = (size_t)node->dn_count;
+
+        if (count < DIR_NODE_ENTRIES) {
+            memmove(&node->dn_entries[index + 1], &node->dn_entries[index],
+                    (count - index) * sizeof(dir_entry_t));
+            node->dn_entries[index] = insert;
+            node->dn_count++;
+            data_block_mark_dirty(block_number, 1);
+            return 0;
+        }
+
+        // Split in place: the node keeps the lower half of its entries with
+        // the new one, a new right sibling gets the upper one
+        int right_block = new_blocks[used++];
+        dir_node_t *right = dir_node_get(right_block);
+        size_t half = (count + 1) / 2;
+
+        // (leaves copy their first upper name up as separator, internal nodes
+        // move their middle separator up)
+        size_t first = node->dn_leaf ? half : half + 1;
+        for (size_t k = first; k <= count; k++) {
+            right->dn_entries[k - first] =
+                *dir_split_entry(node, index, &insert, k);
+        }
+        dir_entry_t separator = *dir_split_entry(node, index, &insert, half);
+        right->dn_leaf = node->dn_leaf;
+        right->dn_count = (int)(count + 1 - first);
+        if (node->dn_leaf) {
+            right->dn_next = node->dn_next;
+            node->dn_next = right_block;
+        } else {
+            // the middle separator's child becomes the leftmost
+            right->dn_next = separator.d_inumber;
+        }
+
+        if (index < half) {
+            memmove(&node->dn_entries[index + 1], &node->dn_entries[index],
+                    (half - 1 - index) * sizeof(dir_entry_t));
+            node->dn_entries[index] = insert;
+        }
+        node->dn_count = (int)half;
+        data_block_mark_dirty(block_number, 1);
+        data_block_mark_dirty(right_block, 1);
+
+        insert = separator;
+        insert.d_inumber = right_block;
+
+        if (level == 0) {
+            // the root split: grow the tree by one level
+            int root_block = new_blocks[used++];
+            dir_node_t *root = dir_node_get(root_block);
+            root->dn_leaf = 0;
+            root->dn_count = 1;
+            root->dn_next = block_number;
+            root->dn_entries[0] = insert;
+            inode->i_dir_root = root_block;
+            data_block_mark_dirty(root_block, 1);
+            return 0;
+        }
+        block_number = path[--level];
+    }
+}
+
+/**
+ * Obtain the inumber for a sub file inside a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *
+ * Returns inumber linked to the target name, -1 if errors occur.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory does not contain a file named sub_name.
+ */
+int find_in_dir(inode_t const *inode, char const *sub_name) {
+    ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
+    ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
+
+    // simulate storage access delay to inode
+    cache_access(TFS_STRUCT_INODE, CACHE_KEY_INODE(inode - inode_table),
+                 sizeof(inode_t));
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    // Descends the directory's B+tree to the leaf that may hold the name
+    dir_node_t const *leaf =
+        dir_node_get(dir_find_leaf(inode, sub_name, NULL, NULL));
+
+    size_t index = dir_node_search(leaf, sub_name);
+    if (!dir_node_match(leaf, index, sub_name)) {
+        return -1; // entry not found
+    }
+
+    return leaf->dn_entries[index].d_inumber;
+}
+
+/**
+ * Obtain the inumber for a sub file inside a directory, going through the
+ * dentry cache.
+ *
+ * On a hit, neither the directory nor the sub file is accessed. The caller
+ * must keep the directory from changing (hold its lock) during the call.
+ *
+ * Input:
+ *   - dir_inumber: directory inumber
+ *   - sub_name: sub file name
+ *   - sub_type: where to store the type of the sub file (may be NULL)
+ *
+ * Returns inumber linked to the target name, -1 if errors occur.
+ *
+ * Possible errors:
+ *   - dir_inumber is not a directory.
+ *   - Directory does not contain a file named sub_name.
+ */
+int dir_lookup(int dir_inumber, char const *sub_name, inode_type *sub_type) {
+    ALWAYS_ASSERT(valid_inumber(dir_inumber), "dir_lookup: invalid inumber");
+    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
+        return -1; // cannot be in any directory
+    }
+
+    dcache_set_t *set = dcache_set(dir_inumber, sub_name);
+    pthread_mutex_lock(&set->ds_lock);
+    dcache_entry_t const *entry = dcache_find(set, dir_inumber, sub_name);
+    if (entry != NULL) {
+        int sub_inumber = entry->de_inumber;
+        if (sub_type != NULL) {
+            *sub_type = entry->de_type;
+        }
+        pthread_mutex_unlock(&set->ds_lock);
+        return sub_inumber;
+    }
+    pthread_mutex_unlock(&set->ds_lock);
+
+    inode_t const *inode = inode_get(dir_inumber);
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory (not cached: it may become one)
+    }
+
+    int sub_inumber = find_in_dir(inode, sub_name);
+    inode_type type = T_FILE;
+    if (sub_inumber != -1) {
+        type = inode_get(sub_inumber)->i_node_type;
+        if (sub_type != NULL) {
+            *sub_type = type;
+        }
+    }
+    dcache_store(dir_inumber, sub_name, sub_inumber, type);
+    return sub_inumber;
+}
+
+/**
+ * Position a cursor for iterating over a directory's entries in name order.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - after: the cursor starts at the first name greater than this one, or at
+ *     the first entry if NULL
+ *   - cursor: the cursor to position
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ */
+int dir_cursor_seek(inode_t const *inode, char const *after,
+                    dir_cursor_t *cursor) {
+    // simulate storage access delay to inode
+    cache_access(TFS_STRUCT_INODE, CACHE_KEY_INODE(inode - inode_table),
+                 sizeof(inode_t));
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    cursor->dc_node = dir_find_leaf(inode, after, NULL, NULL);
+    cursor->dc_index = 0;
+    if (after != NULL) {
+        dir_node_t const *leaf = dir_node_get(cursor->dc_node);
+        size_t index = dir_node_search(leaf, after);
+        if (dir_node_match(leaf, index, after)) {
+            index++;
+        }
+        cursor->dc_index = (int)index;
+    }
+    return 0;
+}
+
+/**
+ * Obtain the entry at a cursor's position and move to the next one.
+ *
+ * Input:
+ *   - cursor: a cursor positioned with dir_cursor_seek
+ *   - entry: where to copy the entry
+ *
+ * Returns 0 if an entry was copied, -1 if there are no more entries.
+ */
+int dir_cursor_next(dir_cursor_t *cursor, dir_entry_t *entry) {
+    while (cursor->dc_node != -1) {
+        dir_node_t const *leaf = dir_node_get(cursor->dc_node);
+        if (cursor->dc_index < leaf->dn_count) {
+            *entry = leaf->dn_entries[cursor->dc_index++];
+            return 0;
+        }
+
+        // move on to the next leaf (skipping empty ones)
+        cursor->dc_node = leaf->dn_next;
+        cursor->dc_index = 0;
+    }
+
+    return -1;
+}
+
+/**
+ * Fill a file that has no data blocks yet.
+ */
+static void inode_fill(inode_t *inode, void const *data, size_t length) {
+    size_t blocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (inode_grow(inode, blocks) < blocks) {
+        return; // no space: the file stays empty
     }
 
-    return 0;
+    size_t done = 0;
+    while (done < length) {
+        size_t run;
+        int bnum = inode_block(inode, done / BLOCK_SIZE, &run);
+        size_t n = run * BLOCK_SIZE;
+        if (n > length - done) {
+            n = length - done;
+        }
+        memcpy(data_block_get(bnum), (char const *)data + done, n);
+        data_block_mark_dirty(bnum, (n + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        done += n;
+    }
+    inode->i_size = length;
 }
 
 /**
- * Destroy FS state.
+ * Redo a journal record on the inodes that have not seen it yet (their LSN is
+ * older). Runs at mount, before the free inode list is built, so inodes are
+ * created and freed in place.
  *
- * Returns 0 if succesful, -1 otherwise.
+ * Input:
+ *   - record: the record
+ *   - payload: the record's payload (J_CREATE of a link: its target path)
  */
-int state_destroy(void) {
-    free(inode_table);
-    free(freeinode_ts);
-    free(fs_data);
-    free(free_blocks);
-    free(open_file_table);
-    free(free_open_file_entries);
-
-    inode_table = NULL;
-    freeinode_ts = NULL;
-    fs_data = NULL;
-    free_blocks = NULL;
-    open_file_table = NULL;
-    free_open_file_entries = NULL;
+static void journal_redo(journal_record_t const *record, void const *payload) {
+    uint64_t lsn = record->jr_lsn;
+    int inumber = record->jr_inumber;
+    inode_t *dir = NULL;
+    inode_t *inode = NULL;
+    int dir_inumber = record->jr_dir;
+    if (valid_inumber(dir_inumber) && freeinode_ts[dir_inumber] == TAKEN &&
+        inode_table[dir_inumber].i_node_type == T_DIRECTORY &&
+        inode_table[dir_inumber].i_lsn < lsn) {
+        dir = &inode_table[dir_inumber];
+    }
+    if (valid_inumber(inumber) && inode_table[inumber].i_lsn < lsn) {
+        inode = &inode_table[inumber];
+    }
 
-    return 0;
+    switch ((journal_op_t)record->jr_op) {
+    case J_CREATE:
+        if (inode != NULL) {
+            if (freeinode_ts[inumber] == TAKEN) {
+                inode_release(inumber); // created, but never logged
+            }
+            freeinode_ts[inumber] = TAKEN;
+            if (inode_init(inumber, (inode_type)record->jr_type) == -1) {
+                freeinode_ts[inumber] = FREE;
+                break;
+            }
+            if (record->jr_type == T_LINK) {
+                inode_fill(inode, payload, record->jr_length);
+            }
+            inode->i_lsn = lsn;
+            inode_mark_dirty(inode);
+        }
+        // fallthrough
+    case J_ENTRY_ADD:
+        if (dir != NULL && valid_inumber(inumber) &&
+            freeinode_ts[inumber] == TAKEN) {
+            add_dir_entry(dir, record->jr_name, inumber);
+            dir->i_lsn = lsn;
+            inode_mark_dirty(dir);
+        }
+        break;
+    case J_ENTRY_REMOVE:
+        if (dir != NULL) {
+            clear_dir_entry(dir, record->jr_name);
+            dir->i_lsn = lsn;
+            inode_mark_dirty(dir);
+        }
+        break;
+    case J_LINK_ADD:
+        if (inode != NULL && freeinode_ts[inumber] == TAKEN) {
+            inode->hard_links++;
+            inode->i_lsn = lsn;
+            inode_mark_dirty(inode);
+        }
+        break;
+    case J_RMDIR:
+        if (dir != NULL) {
+            clear_dir_entry(dir, record->jr_name);
+            dir->i_lsn = lsn;
+            inode_mark_dirty(dir);
+        }
+        // fallthrough
+    case J_LINK_DROP:
+        if (inode != NULL && freeinode_ts[inumber] == TAKEN) {
+            if (--inode->hard_links <= 0 || inode->i_node_type != T_FILE) {
+                inode_release(inumber);
+            }
+            inode->i_lsn = lsn;
+            inode_mark_dirty(inode);
+        }
+        break;
+    case J_IMAGE:
+    case J_CHECKPOINT:
+        break; // (checkpoints are restored before replaying, see journal.c)
+    default:
+        break; // not a record this build knows: skip it
+    }
 }
 
 /**
- * (Try to) Allocate a new inode in the inode table, without initializing its
- * data.
+ * Find the first free bit in a bitmap, starting at bit 'from' and wrapping
+ * around to the beginning.
  *
- * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ * Input:
+ *   - words: the bitmap (set bits are taken)
+ *   - n_words: number of words in the bitmap
+ *   - from: bit where the search starts
  *
- * Possible errors:
- *   - No free slots in inode table.
+ * Returns the index of the free bit, or -1 if every bit is set.
  */
-static int inode_alloc(void) {
-    for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
+static ssize_t bitmap_find_free(uint64_t const *words, size_t n_words,
+                                size_t from) {
+    size_t start = from / BITMAP_WORD_BITS;
+    // bits below 'from' in the first word are only looked at after wrapping
+    uint64_t below = (UINT64_C(1) << (from % BITMAP_WORD_BITS)) - 1;
+
+    for (size_t n = 0; n <= n_words; n++) {
+        size_t w = (start + n) % n_words;
+        uint64_t taken = words[w];
+        if (n == 0) {
+            taken |= below;
+        } else if (n == n_words) {
+            taken |= ~below;
         }
 
-        // Finds first free entry in inode table
-        if (freeinode_ts[inumber] == FREE) {
-            //  Found a free entry, so takes it for the new inode
-            freeinode_ts[inumber] = TAKEN;
-
-            return (int)inumber;
+        if (taken != ~UINT64_C(0)) {
+            return (ssize_t)(w * BITMAP_WORD_BITS +
+                             (size_t)__builtin_ctzll(~taken));
         }
     }
 
-    // no free inodes
     return -1;
 }
 
 /**
- * Create a new inode in the inode table.
- *
- * Allocates and initializes a new inode.
- * Directories will have their data block allocated and initialized, with i_size
- * set to BLOCK_SIZE. Regular files will not have their data block allocated
- * (i_size will be set to 0, i_data_block to -1).
+ * Allocate a new data block.
  *
- * Input:
- *   - i_type: the type of the node (file or directory)
+ * Uses next-fit: the search resumes at the word of the last allocation, and
+ * words that are full are skipped through the summary level.
  *
- * Returns inumber of the new inode, or -1 in the case of error.
+ * Returns block number/index if successful, -1 otherwise.
  *
  * Possible errors:
- *   - No free slots in inode table.
- *   - (if creating a directory) No free data blocks.
+ *   - No free data blocks.
  */
-int inode_create(inode_type i_type) {
-    int inumber = inode_alloc();
-    if (inumber == -1) {
-        return -1; // no free slots in inode table
+int data_block_alloc(void) {
+    pthread_mutex_lock(&free_blocks_lock);
+    // simulate storage access delay to free_blocks
+    cache_access(TFS_STRUCT_BITMAP, CACHE_KEY_BLOCK_MAP, sizeof(uint64_t));
+
+    ssize_t word = bitmap_find_free(free_blocks_summary,
+                                    BITMAP_WORDS(free_blocks_words),
+                                    free_blocks_hint);
+    if (word == -1) {
+        pthread_mutex_unlock(&free_blocks_lock);
+        return -1; // every word is full
     }
 
-    inode_t *inode = &inode_table[inumber];
-    insert_delay(); // simulate storage access delay (to inode)
+    size_t w = (size_t)word;
+    int bit = __builtin_ctzll(~free_blocks[w]);
+    free_blocks[w] |= UINT64_C(1) << bit;
+    if (free_blocks[w] == ~UINT64_C(0)) {
+        free_blocks_summary[w / BITMAP_WORD_BITS] |=
+            UINT64_C(1) << (w % BITMAP_WORD_BITS);
+    }
+    dirty_mark(dirty_map_words, w);
+    cache_mark_dirty(CACHE_KEY_BLOCK_MAP);
+    free_blocks_hint = w;
 
-    inode->i_node_type = i_type;
-    inode->hard_links = 1;
-    switch (i_type) {
-    case T_DIRECTORY: {
-        // Initializes directory (filling its block with empty entries, labeled
-        // with inumber==-1)
-        int b = data_block_alloc();
-        if (b == -1) {
-            // ensure fields are initialized
-            inode->i_size = 0;
-            inode->i_data_block = -1;
+    pthread_mutex_unlock(&free_blocks_lock);
+    return (int)(w * BITMAP_WORD_BITS + (size_t)bit);
+}
 
-            // run regular deletion process
-            inode_delete(inumber);
-            return -1;
+/**
+ * Find the first free block at or after a given block, skipping full words
+ * through the summary level.
+ *
+ * Returns the block number, or DATA_BLOCKS if there is none.
+ */
+static size_t next_free_block(size_t from) {
+    while (from < DATA_BLOCKS) {
+        size_t w = from / BITMAP_WORD_BITS;
+        uint64_t full = free_blocks_summary[w / BITMAP_WORD_BITS] >>
+                        (w % BITMAP_WORD_BITS);
+        if (full & 1) {
+            // skip this word and the full ones that follow it
+            size_t full_words = ~full == 0 ? BITMAP_WORD_BITS
+                                           : (size_t)__builtin_ctzll(~full);
+            from = (w + full_words) * BITMAP_WORD_BITS;
+            continue;
         }
 
-        inode_table[inumber].i_size = BLOCK_SIZE;
-        inode_table[inumber].i_data_block = b;
-
-        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-        ALWAYS_ASSERT(dir_entry != NULL,
-                      "inode_create: data block freed while in use");
-
-        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-            dir_entry[i].d_inumber = -1;
+        uint64_t taken =
+            free_blocks[w] | ((UINT64_C(1) << (from % BITMAP_WORD_BITS)) - 1);
+        if (taken != ~UINT64_C(0)) {
+            return w * BITMAP_WORD_BITS + (size_t)__builtin_ctzll(~taken);
         }
-    } break;
-    case T_FILE:
-        // In case of a new file, simply sets its size to 0
-        inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
-        break;
-
-    case T_LINK:
-        inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
-        break;
-    default:
-        PANIC("inode_create: unknown file type");
+        from = (w + 1) * BITMAP_WORD_BITS;
     }
 
-    return inumber;
+    return DATA_BLOCKS;
 }
 
 /**
- * Delete an inode.
- *
- * Input:
- *   - inumber: inode's number
+ * Count the free blocks in the run starting at a given block, looking at most
+ * at 'max' blocks.
  */
-void inode_delete(int inumber) {
-    // simulate storage access delay (to inode and freeinode_ts)
-    insert_delay();
-    insert_delay();
-
-    ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
-
-    ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
-                  "inode_delete: inode already freed");
-
-    if (inode_table[inumber].i_size > 0) {
-        data_block_free(inode_table[inumber].i_data_block);
+static size_t free_run_length(size_t start, size_t max) {
+    size_t length = 0;
+    while (length < max && start + length < DATA_BLOCKS) {
+        size_t b = start + length;
+        uint64_t taken = free_blocks[b / BITMAP_WORD_BITS] >>
+                         (b % BITMAP_WORD_BITS);
+        if (taken != 0) {
+            length += (size_t)__builtin_ctzll(taken);
+            break; // the run ends in this word
+        }
+        length += BITMAP_WORD_BITS - b % BITMAP_WORD_BITS;
     }
 
-    freeinode_ts[inumber] = FREE;
+    return length < max ? length : max;
 }
 
 /**
- * Obtain a pointer to an inode from its inumber.
- *
- * Input:
- *   - inumber: inode's number
- *
- * Returns pointer to inode.
+ * Mark every block as free, except for the bits past the last block (and past
+ * the last word, in the summary), which are marked as taken so they are never
+ * handed out.
  */
-inode_t *inode_get(int inumber) {
-    ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
+static void free_blocks_reset(void) {
+    memset(free_blocks, 0, free_blocks_words * sizeof(uint64_t));
+    memset(free_blocks_summary, 0,
+           BITMAP_WORDS(free_blocks_words) * sizeof(uint64_t));
+
+    size_t tail_bits = DATA_BLOCKS % BITMAP_WORD_BITS;
+    if (tail_bits != 0) {
+        free_blocks[free_blocks_words - 1] = ~UINT64_C(0) << tail_bits;
+    }
+    tail_bits = free_blocks_words % BITMAP_WORD_BITS;
+    if (tail_bits != 0) {
+        free_blocks_summary[BITMAP_WORDS(free_blocks_words) - 1] =
+            ~UINT64_C(0) << tail_bits;
+    }
 
-    insert_delay(); // simulate storage access delay to inode
-    return &inode_table[inumber];
+    for (size_t w = 0; w < free_blocks_words; w++) {
+        dirty_mark(dirty_map_words, w);
+    }
 }
 
+static void block_run_set(size_t start, size_t length, bool taken);
+
 /**
- * Clear the directory entry associated with a sub file.
- *
- * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
- *
- * Returns 0 if successful, -1 otherwise.
+ * Take a run of blocks that an inode of the image refers to, unless it is out
+ * of range or some of its blocks are taken already (by another inode, or
+ * twice by the same one).
  *
- * Possible errors:
- *   - inode is not a directory inode.
- *   - Directory does not contain an entry for sub_name.
+ * Returns true if successful, false if the image is damaged.
  */
-int clear_dir_entry(inode_t *inode, char const *sub_name) {
-    insert_delay();
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+static bool block_run_claim(int block_number, int length) {
+    if (!valid_block_number(block_number) || length <= 0 ||
+        (size_t)length > DATA_BLOCKS - (size_t)block_number) {
+        return false;
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "clear_dir_entry: directory must have a data block");
-
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
-            dir_entry[i].d_inumber = -1;
-            memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
-            return 0;
+    size_t end = (size_t)block_number + (size_t)length;
+    for (size_t b = (size_t)block_number; b < end; b++) {
+        if (free_blocks[b / BITMAP_WORD_BITS] &
+            (UINT64_C(1) << (b % BITMAP_WORD_BITS))) {
+            return false;
         }
     }
-    return -1; // sub_name not found
+    block_run_set((size_t)block_number, (size_t)length, true);
+    return true;
 }
 
 /**
- * Store the inumber for a sub file in a directory.
- *
- * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
- *   - sub_inumber: inumber of the sub inode
- *
- * Returns 0 if successful, -1 otherwise.
+ * Take the nodes of a directory's B+tree, root down (each one before its
+ * children, so that a cycle shows as a node claimed twice).
  *
- * Possible errors:
- *   - inode is not a directory inode.
- *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
- *   - Directory is already full of entries.
+ * Returns true if successful, false if the tree is damaged.
  */
-int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
-    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
-        return -1; // invalid sub_name
+static bool dir_tree_mark(int node_block, int depth) {
+    if (depth >= DIR_MAX_DEPTH || !block_run_claim(node_block, 1)) {
+        return false;
     }
 
-    insert_delay(); // simulate storage access delay to inode with inumber
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+    dir_node_t const *node = dir_node_get(node_block);
+    if (node->dn_count < 0 || (size_t)node->dn_count > DIR_NODE_ENTRIES) {
+        return false;
     }
+    if (!node->dn_leaf) {
+        if (!dir_tree_mark(node->dn_next, depth + 1)) {
+            return false;
+        }
+        for (size_t i = 0; i < (size_t)node->dn_count; i++) {
+            if (!dir_tree_mark(node->dn_entries[i].d_inumber, depth + 1)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "add_dir_entry: directory must have a data block");
+/**
+ * Rebuild the block bitmap from the blocks that the inodes in use refer to:
+ * file extents, extent blocks and directory nodes.
+ *
+ * Returns 0 if successful, -1 if the image is damaged: some block is referred
+ * to twice, or out of range, or some inode's extents or directory tree cannot
+ * be followed.
+ */
+static int free_blocks_rebuild(void) {
+    free_blocks_reset();
+
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        inode_t const *inode = &inode_table[i];
+        if (freeinode_ts[i] != TAKEN) {
+            continue;
+        }
 
-    // Finds and fills the first empty entry
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
+        if (inode->i_node_type == T_DIRECTORY) {
+            if (!dir_tree_mark(inode->i_dir_root, 0)) {
+                return -1;
+            }
+            continue;
+        }
 
-            return 0;
+        // the extent blocks first, so that their chain is known to end (and
+        // to hold every extent) before the extents are looked up in it
+        size_t extents = INODE_EXTENTS;
+        for (int b = inode->i_extent_block; b != -1;
+             b = ((extent_block_t const *)data_block_get(b))->eb_next) {
+            if (!block_run_claim(b, 1)) {
+                return -1;
+            }
+            extents += EXTENTS_PER_BLOCK;
+        }
+        if (inode->i_extent_count > extents) {
+            return -1;
+        }
+        for (size_t j = 0; j < inode->i_extent_count; j++) {
+            extent_t const *extent = inode_extent(inode, j);
+            if (!block_run_claim(extent->e_block, extent->e_length)) {
+                return -1;
+            }
         }
     }
+    return 0;
+}
+
+/**
+ * Set (take) or clear (free) the bits of a run of blocks, one word at a time,
+ * keeping the summary level up to date.
+ */
+static void block_run_set(size_t start, size_t length, bool taken) {
+    size_t end = start + length;
+    while (start < end) {
+        size_t w = start / BITMAP_WORD_BITS;
+        size_t first = start % BITMAP_WORD_BITS;
+        size_t bits = BITMAP_WORD_BITS - first;
+        if (bits > end - start) {
+            bits = end - start;
+        }
+        uint64_t mask = (bits == BITMAP_WORD_BITS)
+                            ? ~UINT64_C(0)
+                            : ((UINT64_C(1) << bits) - 1) << first;
+
+        uint64_t summary_bit = UINT64_C(1) << (w % BITMAP_WORD_BITS);
+        if (taken) {
+            ALWAYS_ASSERT((free_blocks[w] & mask) == 0,
+                          "block_run_set: block already taken");
+            free_blocks[w] |= mask;
+            if (free_blocks[w] == ~UINT64_C(0)) {
+                free_blocks_summary[w / BITMAP_WORD_BITS] |= summary_bit;
+            }
+        } else {
+            ALWAYS_ASSERT((free_blocks[w] & mask) == mask,
+                          "data_block_free: block already freed");
+            free_blocks[w] &= ~mask;
+            free_blocks_summary[w / BITMAP_WORD_BITS] &= ~summary_bit;
+        }
+        dirty_mark(dirty_map_words, w);
+        cache_mark_dirty(CACHE_KEY_BLOCK_MAP);
 
-    return -1; // no space for entry
+        start += bits;
+    }
 }
 
 /**
- * Obtain the inumber for a sub file inside a directory.
+ * Allocate a run of contiguous data blocks (an extent).
  *
- * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
+ * If 'goal' is free, the run starts there (so that a file growing at the end of
+ * its last extent stays contiguous). Otherwise, the first run with 'want' free
+ * blocks is taken, searching next-fit from the last allocation; if there is
+ * none, the longest run found is taken instead.
  *
- * Returns inumber linked to the target name, -1 if errors occur.
+ * Input:
+ *   - goal: preferred first block, or -1 for none
+ *   - want: number of blocks wanted (> 0)
+ *   - got: where to store the number of blocks actually allocated (<= want)
  *
- * Possible errors:
- *   - inode is not a directory inode.
- *   - Directory does not contain a file named sub_name.
+ * Returns the first block number of the run, or -1 if there are no free
+ * blocks.
  */
-int find_in_dir(inode_t const *inode, char const *sub_name) {
-    ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
-    ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
-
-    insert_delay(); // simulate storage access delay to inode with inumber
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+int data_block_alloc_extent(int goal, size_t want, size_t *got) {
+    ALWAYS_ASSERT(want > 0, "data_block_alloc_extent: empty extent");
+
+    pthread_mutex_lock(&free_blocks_lock);
+    // simulate storage access delay to free_blocks
+    cache_access(TFS_STRUCT_BITMAP, CACHE_KEY_BLOCK_MAP, sizeof(uint64_t));
+
+    size_t start = DATA_BLOCKS;
+    size_t length = 0;
+    if (valid_block_number(goal)) {
+        start = (size_t)goal;
+        length = free_run_length(start, want);
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "find_in_dir: directory inode must have a data block");
+    if (length == 0) {
+        // two passes: from the hint to the end, then from the beginning
+        size_t hint = free_blocks_hint * BITMAP_WORD_BITS;
+        for (int pass = 0; pass < 2 && length < want; pass++) {
+            size_t b = next_free_block(pass == 0 ? hint : 0);
+            size_t end = pass == 0 ? DATA_BLOCKS : hint;
+            while (b < end) {
+                size_t run = free_run_length(b, want);
+                if (run > length) {
+                    start = b;
+                    length = run;
+                    if (length == want) {
+                        break;
+                    }
+                }
+                b = next_free_block(b + run);
+            }
+        }
+    }
 
-    // Iterates over the directory entries looking for one that has the target
-    // name
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+    if (length == 0) {
+        pthread_mutex_unlock(&free_blocks_lock);
+        return -1; // no free blocks
+    }
 
-            int sub_inumber = dir_entry[i].d_inumber;
-            return sub_inumber;
-        }
+    block_run_set(start, length, true);
+    free_blocks_hint = (start + length - 1) / BITMAP_WORD_BITS;
 
-    return -1; // entry not found
+    pthread_mutex_unlock(&free_blocks_lock);
+    *got = length;
+    return (int)start;
 }
 
 /**
- * Allocate a new data block.
- *
- * Returns block number/index if successful, -1 otherwise.
+ * Free a run of contiguous data blocks.
  *
- * Possible errors:
- *   - No free data blocks.
+ * Input:
+ *   - block_number: first block of the run
+ *   - length: number of blocks in the run
  */
-int data_block_alloc(void) {
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        if (i * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
-        }
-
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
+void data_block_free_extent(int block_number, size_t length) {
+    ALWAYS_ASSERT(valid_block_number(block_number) &&
+                      length <= DATA_BLOCKS - (size_t)block_number,
+                  "data_block_free: invalid block number");
 
-            return (int)i;
-        }
-    }
-    return -1;
+    pthread_mutex_lock(&free_blocks_lock);
+    // simulate storage access delay to free_blocks
+    cache_access(TFS_STRUCT_BITMAP, CACHE_KEY_BLOCK_MAP, sizeof(uint64_t));
+    block_run_set((size_t)block_number, length, false);
+    pthread_mutex_unlock(&free_blocks_lock);
 }
 
 /**
@@ -434,12 +2489,7 @@ int data_block_alloc(void) {
  *   - block_number: the block number/index
  */
 void data_block_free(int block_number) {
-    ALWAYS_ASSERT(valid_block_number(block_number),
-                  "data_block_free: invalid block number");
-
-    insert_delay(); // simulate storage access delay to free_blocks
-
-    free_blocks[block_number] = FREE;
+    data_block_free_extent(block_number, 1);
 }
 
 /**
@@ -451,16 +2501,55 @@ void data_block_free(int block_number) {
  * Returns a pointer to the first byte of the block.
  */
 void *data_block_get(int block_number) {
-    ALWAYS_ASSERT(valid_block_number(block_number),
+    return data_block_get_run(block_number, 1);
+}
+
+/**
+ * Obtain a pointer to the contents of a run of contiguous blocks, accessing
+ * each of them.
+ *
+ * Input:
+ *   - block_number: the first block of the run
+ *   - count: number of blocks in the run
+ *
+ * Returns a pointer to the first byte of the first block.
+ */
+void *data_block_get_run(int block_number, size_t count) {
+    ALWAYS_ASSERT(valid_block_number(block_number) &&
+                      count <= DATA_BLOCKS - (size_t)block_number,
                   "data_block_get: invalid block number");
 
-    insert_delay(); // simulate storage access delay to block
+    // simulate storage access delay to each block
+    for (size_t i = 0; i < count; i++) {
+        cache_access(TFS_STRUCT_DATA, CACHE_KEY_BLOCK((size_t)block_number + i),
+                     BLOCK_SIZE);
+    }
     return &fs_data[(size_t)block_number * BLOCK_SIZE];
 }
 
+/**
+ * Start bringing a run of contiguous blocks into the buffer cache, in the
+ * background and with a single access (readahead).
+ *
+ * Input:
+ *   - block_number: the first block of the run
+ *   - count: number of blocks in the run
+ */
+void data_block_prefetch(int block_number, size_t count) {
+    ALWAYS_ASSERT(valid_block_number(block_number) &&
+                      count <= DATA_BLOCKS - (size_t)block_number,
+                  "data_block_prefetch: invalid block number");
+
+    cache_prefetch(TFS_STRUCT_DATA, CACHE_KEY_BLOCK(block_number), count,
+                   BLOCK_SIZE);
+}
+
 /**
  * Add a new entry to the open file table.
  *
+ * The slot is taken from the free-slot stack, so this takes constant time and
+ * can run concurrently with any other open file table operation.
+ *
  * Input:
  *   - inumber: inode number of the file to open
  *   - offset: initial offset
@@ -471,17 +2560,32 @@ void *data_block_get(int block_number) {
  *   - No space in open file table for a new open file.
  */
 int add_to_open_file_table(int inumber, size_t offset) {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
-
-            return i;
-        }
+    int index = index_stack_pop(&free_open_files);
+    if (index == INDEX_STACK_EMPTY) {
+        return -1;
     }
 
-    return -1;
+    // the slot is ours until it is pushed back, so it can be filled in before
+    // it is published as TAKEN
+    open_file_table[index].of_inumber = inumber;
+    open_file_table[index].of_offset = offset;
+    open_file_table[index].of_ra_next = offset;
+    open_file_table[index].of_ra_window = 0;
+    open_file_table[index].of_ra_prefetched = 0;
+    open_file_table[index].of_buffer = NULL;
+    open_file_table[index].of_buffered = 0;
+    atomic_store_explicit(&open_file_table[index].of_borrows, 0,
+                          memory_order_relaxed);
+
+    uint32_t state =
+        atomic_load_explicit(&open_file_states[index], memory_order_relaxed);
+    ALWAYS_ASSERT((state & TAKEN) == 0,
+                  "add_to_open_file_table: free slot is taken");
+    atomic_store_explicit(&open_file_states[index], state | TAKEN,
+                          memory_order_release);
+
+    uint32_t generation = state >> 1;
+    return (int)((generation << fhandle_index_bits) | (uint32_t)index);
 }
 
 /**
@@ -489,19 +2593,98 @@ int add_to_open_file_table(int inumber, size_t offset) {
  *
  * Input:
  *   - fhandle: file handle to free/close
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - fhandle is invalid/closed/never opened (e.g., closed concurrently).
+ *   - Reads borrowed through fhandle have not been released.
+ */
+int remove_from_open_file_table(int fhandle) {
+    size_t index;
+    uint32_t generation;
+    if (!decode_file_handle(fhandle, &index, &generation)) {
+        return -1;
+    }
+
+    // only one of several concurrent closes of the same handle succeeds; the
+    // next generation invalidates every copy of the handle. Taking the entry's
+    // lock waits for any operation still using the handle
+    pthread_mutex_t *lock = &open_file_table[index].of_lock;
+    uint32_t expected = (generation << 1) | TAKEN;
+    uint32_t next = ((generation + 1) & fhandle_generation_mask) << 1;
+    pthread_mutex_lock(lock);
+    bool closed =
+        atomic_load(&open_file_table[index].of_borrows) == 0 &&
+        atomic_compare_exchange_strong_explicit(
+            &open_file_states[index], &expected, next, memory_order_acq_rel,
+            memory_order_relaxed);
+    pthread_mutex_unlock(lock);
+    if (!closed) {
+        return -1;
+    }
+
+    free(open_file_table[index].of_buffer);
+    open_file_table[index].of_buffer = NULL;
+    index_stack_push(&free_open_files, (int)index);
+    return 0;
+}
+
+/**
+ * List the handles of the open files.
+ *
+ * Input:
+ *   - fhandles: where to store them (room for max_open_files_count)
+ *
+ * Returns how many were stored (files opened or closed meanwhile may or may
+ * not be listed).
+ */
+size_t open_file_table_handles(int *fhandles) {
+    size_t count = 0;
+    for (size_t index = 0; index < MAX_OPEN_FILES; index++) {
+        uint32_t state = atomic_load_explicit(&open_file_states[index],
+                                              memory_order_acquire);
+        if (state & TAKEN) {
+            uint32_t generation = state >> 1;
+            fhandles[count++] =
+                (int)((generation << fhandle_index_bits) | (uint32_t)index);
+        }
+    }
+    return count;
+}
+
+/**
+ * Obtain pointer to a given entry in the open file table, without locking it.
+ *
+ * Only safe while something else keeps the handle from being closed (such as
+ * a borrowed read).
+ *
+ * Input:
+ *   - fhandle: file handle
+ *
+ * Returns pointer to the entry, or NULL if the fhandle is invalid/closed/never
+ * opened.
  */
-void remove_from_open_file_table(int fhandle) {
-    ALWAYS_ASSERT(valid_file_handle(fhandle),
-                  "remove_from_open_file_table: file handle must be valid");
+open_file_entry_t *find_open_file_entry(int fhandle) {
+    size_t index;
+    uint32_t generation;
+    if (!decode_file_handle(fhandle, &index, &generation)) {
+        return NULL;
+    }
 
-    ALWAYS_ASSERT(free_open_file_entries[fhandle] == TAKEN,
-                  "remove_from_open_file_table: file handle must be taken");
+    if (atomic_load_explicit(&open_file_states[index], memory_order_acquire) !=
+        ((generation << 1) | TAKEN)) {
+        return NULL; // stale or closed handle
+    }
 
-    free_open_file_entries[fhandle] = FREE;
+    return &open_file_table[index];
 }
 
 /**
- * Obtain pointer to a given entry in the open file table.
+ * Obtain pointer to a given entry in the open file table, and lock it.
+ *
+ * The entry stays locked (so its handle cannot be closed, nor its offset
+ * changed by other threads) until it is given to release_open_file_entry.
  *
  * Input:
  *   - fhandle: file handle
@@ -510,13 +2693,27 @@ void remove_from_open_file_table(int fhandle) {
  * opened.
  */
 open_file_entry_t *get_open_file_entry(int fhandle) {
-    if (!valid_file_handle(fhandle)) {
+    open_file_entry_t *file = find_open_file_entry(fhandle);
+    if (file == NULL) {
         return NULL;
     }
 
-    if (free_open_file_entries[fhandle] != TAKEN) {
+    // check again with the lock held: it may have been closed meanwhile
+    pthread_mutex_lock(&file->of_lock);
+    if (find_open_file_entry(fhandle) != file) {
+        pthread_mutex_unlock(&file->of_lock);
         return NULL;
     }
 
-    return &open_file_table[fhandle];
+    return file;
+}
+
+/**
+ * Unlock an entry obtained from get_open_file_entry.
+ *
+ * Input:
+ *   - file: the entry
+ */
+void release_open_file_entry(open_file_entry_t *file) {
+    pthread_mutex_unlock(&file->of_lock);
 }
@@ -4,7 +4,10 @@
 #include "config.h"
 #include "operations.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -20,46 +23,107 @@ typedef struct {
 // added extra type to handle soft links
 typedef enum { T_FILE, T_DIRECTORY, T_LINK } inode_type;
 
+/**
+ * Extent: a run of contiguous data blocks
+ */
+typedef struct {
+    int e_block;
+    int e_length;
+} extent_t;
+
 /**
  * Inode
+ *
+ * File data is mapped by a list of extents, in file order and without holes:
+ * the first INODE_EXTENTS are stored in the inode, the rest in a chain of
+ * extent blocks starting at i_extent_block (-1 if there is none).
  */
 typedef struct {
     inode_type i_node_type;
 
     size_t i_size;
-    int i_data_block;
+    extent_t i_extents[INODE_EXTENTS];
+    int i_extent_block;
+    size_t i_extent_count;
+    size_t i_block_count; // blocks mapped by all the extents
+    int i_dir_root;       // root node of a directory's B+tree (-1 if none)
     int hard_links;
+    uint64_t i_lsn; // last journal record that changed it (see journal.h)
 } inode_t;
 
 typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 
+/**
+ * Position in the ordered iteration of a directory's entries
+ */
+typedef struct {
+    int dc_node;
+    int dc_index;
+} dir_cursor_t;
+
 /**
  * Open file entry (in open file table)
  */
 typedef struct {
     int of_inumber;
     size_t of_offset;
+    pthread_mutex_t of_lock; // held while the handle is in use
+    _Atomic int of_borrows;  // borrowed reads not yet released
+    // readahead: where a sequential read would go on, how many blocks to read
+    // ahead of it (0 while reads are not sequential), and the first block not
+    // yet prefetched
+    size_t of_ra_next;
+    size_t of_ra_window;
+    size_t of_ra_prefetched;
+    // TFS_O_BUFFERED: writes not yet made to the file, which end at of_offset
+    // (of_buffer is NULL for other handles)
+    char *of_buffer;
+    size_t of_buffered;
 } open_file_entry_t;
 
 int state_init(tfs_params);
 int state_destroy(void);
+bool state_loaded(void);
+int state_image_params(char const *image_path, tfs_params *params);
+int state_sync(void);
 
 size_t state_block_size(void);
 
 int inode_create(inode_type n_type);
 void inode_delete(int inumber);
 inode_t *inode_get(int inumber);
+void inode_mark_dirty(inode_t const *inode);
+int inode_block(inode_t const *inode, size_t block_index, size_t *run);
+size_t inode_extents(inode_t const *inode, size_t first, extent_t *extents,
+                     size_t count);
+size_t inode_grow(inode_t *inode, size_t block_count);
+void inode_truncate(inode_t *inode);
+void inode_pin(int inumber);
+void inode_unpin(int inumber);
+size_t inode_max_size(void);
 
 int clear_dir_entry(inode_t *inode, char const *sub_name);
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
 int find_in_dir(inode_t const *inode, char const *sub_name);
+int dir_lookup(int dir_inumber, char const *sub_name, inode_type *sub_type);
+int dir_cursor_seek(inode_t const *inode, char const *after,
+                    dir_cursor_t *cursor);
+int dir_cursor_next(dir_cursor_t *cursor, dir_entry_t *entry);
 
 int data_block_alloc(void);
+int data_block_alloc_extent(int goal, size_t want, size_t *got);
 void data_block_free(int block_number);
+void data_block_free_extent(int block_number, size_t length);
 void *data_block_get(int block_number);
+void *data_block_get_run(int block_number, size_t count);
+void data_block_prefetch(int block_number, size_t count);
+void data_block_mark_dirty(int block_number, size_t count);
 
 int add_to_open_file_table(int inumber, size_t offset);
-void remove_from_open_file_table(int fhandle);
+int remove_from_open_file_table(int fhandle);
+size_t open_file_table_handles(int *fhandles);
 open_file_entry_t *get_open_file_entry(int fhandle);
+open_file_entry_t *find_open_file_entry(int fhandle);
+void release_open_file_entry(open_file_entry_t *file);
 
 #endif // STATE_H
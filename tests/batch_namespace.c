@@ -0,0 +1,197 @@
+#include "fs/operations.h"
+#include "fs/journal.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILE_COUNT (64)
+#define IMAGE_INODES (4)
+
+atomic_bool synced;
+
+void *sync_thread_func() {
+    assert(tfs_sync() != -1);
+    atomic_store(&synced, true);
+    return NULL;
+}
+
+static void check_file(char const *path, char const *contents) {
+    char buffer[16];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)strlen(contents));
+    assert(memcmp(buffer, contents, strlen(contents)) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 4 * FILE_COUNT;
+    params.max_open_files_count = 2 * FILE_COUNT;
+    assert(tfs_init(&params) != -1);
+    assert(tfs_mkdir("/a") != -1);
+    assert(tfs_mkdir("/b") != -1);
+
+    // creations in two directories, interleaved: each gets its own result
+    char path[MAX_FILE_NAME];
+    int results[2 * FILE_COUNT];
+    tfs_batch_t *batch = tfs_batch_begin();
+    assert(batch != NULL);
+    for (int i = 0; i < FILE_COUNT; i++) {
+        sprintf(path, "/a/f%d", i);
+        assert(tfs_batch_create(batch, path) == 2 * i);
+        sprintf(path, "/b/f%d", i);
+        assert(tfs_batch_open(batch, path, TFS_O_CREAT) == 2 * i + 1);
+    }
+    assert(tfs_batch_submit(batch, results) != -1);
+    for (int i = 0; i < FILE_COUNT; i++) {
+        assert(results[2 * i] == 0);
+        assert(tfs_write(results[2 * i + 1], "b", 1) == 1);
+        assert(tfs_close(results[2 * i + 1]) != -1);
+        sprintf(path, "/a/f%d", i);
+        check_file(path, "");
+        sprintf(path, "/b/f%d", i);
+        check_file(path, "b");
+    }
+
+    // the operations on a directory are applied in order: a rotation unlinks
+    // and recreates the same names
+    int f = tfs_open("/a/f0", 0);
+    assert(f != -1);
+    assert(tfs_write(f, "old", 3) == 3);
+    assert(tfs_close(f) != -1);
+    batch = tfs_batch_begin();
+    assert(tfs_batch_link(batch, "/a/f0", "/b/old") == 0);
+    assert(tfs_batch_unlink(batch, "/a/f0") == 1);
+    assert(tfs_batch_create(batch, "/a/f0") == 2);
+    assert(tfs_batch_submit(batch, results) != -1);
+    assert(results[0] == 0 && results[1] == 0 && results[2] == 0);
+    check_file("/a/f0", "");
+    check_file("/b/old", "old");
+
+    // operations queued before a link are applied before its target is
+    // looked up, and those queued after it, after
+    batch = tfs_batch_begin();
+    assert(tfs_batch_create(batch, "/a/new") == 0);
+    assert(tfs_batch_link(batch, "/a/new", "/a/new_link") == 1);
+    assert(tfs_batch_unlink(batch, "/a/f1") == 2);
+    assert(tfs_batch_link(batch, "/a/f1", "/a/f1_link") == 3);
+    assert(tfs_batch_link(batch, "/a/new", "/b/new_link") == 4);
+    assert(tfs_batch_link(batch, "/b/new", "/a/early_link") == 5);
+    assert(tfs_batch_create(batch, "/b/new") == 6);
+    assert(tfs_batch_submit(batch, results) == -1);
+    assert(results[0] == 0 && results[1] == 0 && results[2] == 0);
+    assert(results[3] == -1 && results[4] == 0 && results[5] == -1);
+    assert(results[6] == 0);
+    assert(tfs_open("/a/f1", 0) == -1 && tfs_open("/a/f1_link", 0) == -1);
+    assert(tfs_open("/a/early_link", 0) == -1);
+    f = tfs_open("/a/new", 0);
+    assert(f != -1);
+    assert(tfs_write(f, "new", 3) == 3);
+    assert(tfs_close(f) != -1);
+    check_file("/a/new_link", "new");
+    check_file("/b/new_link", "new");
+    // (/a/f1 is expected to exist below)
+    f = tfs_open("/a/f1", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+
+    // failures are reported per operation, and do not stop the others
+    assert(tfs_sym_link("/b/old", "/a/sym") != -1);
+    batch = tfs_batch_begin();
+    assert(tfs_batch_unlink(batch, "/a/missing") == 0);
+    assert(tfs_batch_link(batch, "/a/sym", "/a/link") == 1);
+    assert(tfs_batch_link(batch, "/b/old", "/a/f1") == 2);
+    assert(tfs_batch_open(batch, "no_slash", TFS_O_CREAT) == 3);
+    assert(tfs_batch_open(batch, "/c/f", TFS_O_CREAT) == 4);
+    assert(tfs_batch_unlink(batch, "/a") == 5);
+    assert(tfs_batch_open(batch, "/a/sym", TFS_O_APPEND) == 6);
+    assert(tfs_batch_unlink(batch, "/a/f2") == 7);
+    assert(tfs_batch_open(batch, NULL, 0) == 8);
+    assert(tfs_batch_link(batch, NULL, "/a/f3") == 9);
+    assert(tfs_batch_submit(batch, results) == -1);
+    for (int i = 0; i < 6; i++) {
+        assert(results[i] == -1);
+    }
+    assert(results[6] != -1); // soft links are followed
+    assert(tfs_write(results[6], "er", 2) == 2);
+    assert(tfs_close(results[6]) != -1);
+    assert(results[7] == 0);
+    assert(results[8] == -1 && results[9] == -1);
+    check_file("/b/old", "older");
+    assert(tfs_open("/a/f2", 0) == -1);
+    assert(tfs_open("/a/link", 0) == -1);
+
+    // a link that could not be added does not keep its target alive
+    assert(tfs_unlink("/b/old") != -1);
+    assert(tfs_open("/a/sym", 0) == -1);
+
+    // directories are made as with tfs_mkdir
+    batch = tfs_batch_begin();
+    assert(tfs_batch_mkdir(batch, "/d") == 0);
+    assert(tfs_batch_mkdir(batch, "/a") == 1);
+    assert(tfs_batch_create(batch, "/d/f") == 2);
+    assert(tfs_batch_submit(batch, results) == -1);
+    assert(results[0] == 0 && results[1] == -1 && results[2] == 0);
+    check_file("/d/f", "");
+
+    assert(tfs_batch_submit(NULL, results) == -1);
+    assert(tfs_batch_submit(tfs_batch_begin(), NULL) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    // on an image, unlinking a closed file drops it for good
+    char image[64];
+    char journal[80];
+    sprintf(image, "/tmp/tfs_batch_namespace_%d", (int)getpid());
+    sprintf(journal, "%s.journal", image);
+    unlink(image);
+    params = tfs_default_params();
+    params.max_inode_count = IMAGE_INODES;
+    params.image_path = image;
+    assert(tfs_init(&params) != -1);
+    f = tfs_open("/x", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "x", 1) == 1);
+    assert(tfs_close(f) != -1);
+    batch = tfs_batch_begin();
+    assert(tfs_batch_unlink(batch, "/x") == 0);
+    assert(tfs_batch_submit(batch, results) != -1);
+    assert(results[0] == 0);
+
+    // and leaves the thread's later operations inside the checkpoint barrier,
+    // which a sync waits for
+    atomic_store(&synced, false);
+    journal_begin();
+    pthread_t syncer;
+    assert(pthread_create(&syncer, NULL, sync_thread_func, NULL) == 0);
+    struct timespec wait = {.tv_sec = 0, .tv_nsec = 50000000};
+    nanosleep(&wait, NULL);
+    assert(!atomic_load(&synced));
+    journal_end();
+    assert(pthread_join(syncer, NULL) == 0);
+    assert(atomic_load(&synced));
+    assert(tfs_unmount() != -1);
+
+    // the entry and the inode are gone from the image: every inode but the
+    // root's can be used again
+    assert(tfs_mount(image) != -1);
+    assert(tfs_open("/x", 0) == -1);
+    for (int i = 1; i < IMAGE_INODES; i++) {
+        sprintf(path, "/y%d", i);
+        f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_unmount() != -1);
+    unlink(image);
+    unlink(journal);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
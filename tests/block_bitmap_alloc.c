@@ -0,0 +1,55 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// spans more than two bitmap words, with a partial last word
+#define BLOCK_COUNT (150)
+
+uint8_t const file_contents[] = "AAA!";
+
+static void path_of(char *path, size_t i) { sprintf(path, "/f%zu", i); }
+
+// creates a file with one data block; returns -1 if no block was available
+static ssize_t create_with_block(size_t i) {
+    char path[MAX_FILE_NAME];
+    path_of(path, i);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    ssize_t r = tfs_write(f, file_contents, sizeof(file_contents));
+    assert(tfs_close(f) != -1);
+    return r;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 2 * BLOCK_COUNT;
+    params.max_block_count = BLOCK_COUNT;
+    params.block_size = 16384; // the root directory must fit every name
+    assert(tfs_init(&params) != -1);
+
+    // the root directory takes one block
+    for (size_t i = 0; i < BLOCK_COUNT - 1; i++) {
+        assert(create_with_block(i) == sizeof(file_contents));
+    }
+    assert(create_with_block(BLOCK_COUNT) == -1);
+
+    // free blocks scattered across every word, then use them all again
+    for (size_t i = 0; i < BLOCK_COUNT - 1; i += 7) {
+        char path[MAX_FILE_NAME];
+        path_of(path, i);
+        assert(tfs_unlink(path) != -1);
+    }
+    for (size_t i = 0; i < BLOCK_COUNT - 1; i += 7) {
+        assert(create_with_block(i) == sizeof(file_contents));
+    }
+    assert(create_with_block(BLOCK_COUNT + 1) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
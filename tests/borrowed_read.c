@@ -0,0 +1,90 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK_SIZE (128)
+#define FILE_SIZE (10 * BLOCK_SIZE + 5)
+#define BLOCK_COUNT (12) // the file's and the root directory's
+
+char const path[] = "/f1";
+uint8_t contents[FILE_SIZE];
+atomic_bool truncated;
+
+void *truncate_thread_func() {
+    int f = tfs_open(path, TFS_O_TRUNC);
+    assert(f != -1);
+    atomic_store(&truncated, true);
+    assert(tfs_close(f) != -1);
+    return NULL;
+}
+
+int main() {
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        contents[i] = (uint8_t)(i * 7);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = BLOCK_COUNT;
+    assert(tfs_init(&params) != -1);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    // the file is a single extent, so one view covers it
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    void const *view;
+    assert(tfs_read_borrow(f, 10, &view) == 10);
+    assert(memcmp(view, contents, 10) == 0);
+    assert(tfs_read_release(f) != -1);
+    assert(tfs_read_release(f) == -1);
+
+    assert(tfs_read_borrow(f, FILE_SIZE, &view) == FILE_SIZE - 10);
+    assert(memcmp(view, contents + 10, FILE_SIZE - 10) == 0);
+
+    // writes to the range show through the view, even the borrower's own
+    int g = tfs_open(path, 0);
+    assert(g != -1);
+    assert(tfs_pwrite(g, "XY", 2, 10) == 2);
+    assert(memcmp(view, "XY", 2) == 0);
+    assert(tfs_pwrite(g, contents + 10, 2, 10) == 2);
+    assert(tfs_close(g) != -1);
+
+    // the handle cannot be closed while borrowed, but the file can be
+    // truncated: its blocks stay with the view until it is released
+    assert(tfs_close(f) == -1);
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, truncate_thread_func, NULL) == 0);
+    assert(pthread_join(thread, NULL) == 0);
+    assert(atomic_load(&truncated));
+    assert(memcmp(view, contents + 10, FILE_SIZE - 10) == 0);
+
+    // (every block is taken, so a new file only gets one after the release)
+    g = tfs_open("/f2", TFS_O_CREAT);
+    assert(g != -1);
+    assert(tfs_write(g, "x", 1) == -1);
+    assert(tfs_read_release(f) != -1);
+    assert(tfs_write(g, "x", 1) == 1);
+    assert(tfs_close(g) != -1);
+
+    // at the end of the file nothing is borrowed
+    assert(tfs_read_borrow(f, 1, &view) == 0);
+    assert(view == NULL);
+    assert(tfs_read_release(f) == -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_read_borrow(f, 1, &view) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
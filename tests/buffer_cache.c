@@ -0,0 +1,84 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK_SIZE (256)
+#define FILE_BLOCKS (16)
+#define ACCESS_NS (1000000)
+
+char contents[FILE_BLOCKS * BLOCK_SIZE];
+char buffer[sizeof(contents)];
+
+static void read_file(void) {
+    int f = tfs_open("/f", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, contents, sizeof(contents)) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+static void write_file(char const *path) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)(i * 7);
+    }
+
+    tfs_cache_stats_t stats, before;
+    assert(tfs_cache_stats(&stats) == -1);
+
+    // a cache larger than the file: once read, reading it again only hits,
+    // and costs (almost) nothing
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.latency.seek_ns[TFS_STRUCT_DATA] = ACCESS_NS;
+    assert(tfs_init(&params) != -1);
+    write_file("/f");
+    read_file();
+    assert(tfs_cache_stats(&before) != -1);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    read_file();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(tfs_cache_stats(&stats) != -1);
+    assert(stats.misses == before.misses);
+    assert(stats.hits > before.hits);
+    assert((end.tv_sec - start.tv_sec) * 1000000000 +
+               (end.tv_nsec - start.tv_nsec) <
+           ACCESS_NS);
+    assert(tfs_destroy() != -1);
+
+    // a small cache: writing another file replaces what the first one used,
+    // writing back what changed, and reading the first one misses again
+    params.latency.mode = TFS_LATENCY_NONE;
+    params.cache_frames = 4;
+    assert(tfs_init(&params) != -1);
+    write_file("/f");
+    write_file("/g");
+    assert(tfs_cache_stats(&before) != -1);
+    assert(before.writebacks > 0);
+    read_file();
+    assert(tfs_cache_stats(&stats) != -1);
+    assert(stats.misses > before.misses);
+    assert(tfs_destroy() != -1);
+
+    // without a cache everything misses
+    params.cache_frames = 0;
+    assert(tfs_init(&params) != -1);
+    write_file("/f");
+    read_file();
+    assert(tfs_cache_stats(&stats) != -1);
+    assert(stats.hits == 0 && stats.misses > 0 && stats.writebacks == 0);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
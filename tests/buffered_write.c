@@ -0,0 +1,138 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE (128)
+#define RECORD_SIZE (10)
+#define RECORD_COUNT (100)
+
+char const path[] = "/log";
+char contents[RECORD_COUNT * RECORD_SIZE];
+
+static size_t accesses(void) {
+    tfs_cache_stats_t stats;
+    assert(tfs_cache_stats(&stats) != -1);
+    return stats.hits + stats.misses;
+}
+
+static void check_file(size_t size) {
+    char buffer[sizeof(contents) + 1];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)size);
+    assert(memcmp(buffer, contents, size) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.latency.mode = TFS_LATENCY_NONE;
+    assert(tfs_init(&params) != -1);
+
+    // small appends only fill the handle's buffer: no block is allocated,
+    // nor any structure accessed, and other handles do not see them yet
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_BUFFERED);
+    assert(f != -1);
+    size_t before = accesses();
+    for (size_t i = 0; i < RECORD_COUNT; i++) {
+        assert(tfs_write(f, contents + i * RECORD_SIZE, RECORD_SIZE) ==
+               RECORD_SIZE);
+    }
+    assert(accesses() == before);
+    check_file(0);
+
+    // flushing writes them at once
+    assert(tfs_flush(f) != -1);
+    check_file(sizeof(contents));
+    assert(tfs_flush(f) != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_flush(f) == -1);
+
+    // any other operation through the handle flushes it first
+    f = tfs_open(path, TFS_O_TRUNC | TFS_O_BUFFERED);
+    assert(f != -1);
+    assert(tfs_write(f, contents, 5) == 5);
+    check_file(0);
+    char c;
+    assert(tfs_read(f, &c, 1) == 0);
+    check_file(5);
+
+    // and so does closing it
+    assert(tfs_write(f, contents + 5, 7) == 7);
+    assert(tfs_close(f) != -1);
+    check_file(12);
+    f = tfs_open(path, TFS_O_APPEND | TFS_O_BUFFERED);
+    assert(f != -1);
+    assert(tfs_write(f, contents + 12, sizeof(contents) - 12) ==
+           sizeof(contents) - 12);
+    assert(tfs_close(f) != -1);
+    check_file(sizeof(contents));
+
+    // a view borrowed through the handle does not keep it from buffering, nor
+    // from flushing for the next read
+    f = tfs_open(path, TFS_O_BUFFERED);
+    assert(f != -1);
+    void const *view;
+    assert(tfs_read_borrow(f, RECORD_SIZE, &view) == RECORD_SIZE);
+    assert(tfs_pwrite(f, "z", 1, 0) == 1);
+    assert(tfs_write(f, "yy", 2) == 2);
+    assert(memcmp(view, "z", 1) == 0);
+    assert(tfs_read(f, &c, 1) == 1);
+    assert(c == contents[RECORD_SIZE + 2]);
+    assert(tfs_read_release(f) != -1);
+    assert(tfs_close(f) != -1);
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_pwrite(f, contents, 1, 0) == 1);
+    assert(tfs_pwrite(f, contents + RECORD_SIZE, 2, RECORD_SIZE) == 2);
+    assert(tfs_close(f) != -1);
+    check_file(sizeof(contents));
+    assert(tfs_destroy() != -1);
+
+    // syncing, and unmounting, write out what handles left open buffered
+    char image[64];
+    char journal[80];
+    sprintf(image, "/tmp/tfs_buffered_write_%d", (int)getpid());
+    sprintf(journal, "%s.journal", image);
+    unlink(image);
+    params.image_path = image;
+    assert(tfs_init(&params) != -1);
+    f = tfs_open(path, TFS_O_CREAT | TFS_O_BUFFERED);
+    assert(f != -1);
+    assert(tfs_write(f, contents, RECORD_SIZE) == RECORD_SIZE);
+    assert(tfs_sync() != -1);
+    check_file(RECORD_SIZE);
+    assert(tfs_write(f, contents + RECORD_SIZE, RECORD_SIZE) ==
+           RECORD_SIZE);
+    assert(tfs_unmount() != -1);
+    assert(tfs_mount(image) != -1);
+    check_file(2 * RECORD_SIZE);
+    assert(tfs_unmount() != -1);
+    unlink(image);
+    unlink(journal);
+    params.image_path = NULL;
+
+    // blocks are only allocated when flushing, so that is when running out of
+    // them is reported
+    params.max_block_count = 4;
+    assert(tfs_init(&params) != -1);
+    f = tfs_open(path, TFS_O_CREAT | TFS_O_BUFFERED);
+    assert(f != -1);
+    for (size_t i = 0; i < RECORD_COUNT; i++) {
+        assert(tfs_write(f, contents + i * RECORD_SIZE, RECORD_SIZE) ==
+               RECORD_SIZE);
+    }
+    assert(tfs_close(f) == -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE (4096)
+#define BLOCK_COUNT (1024)
+// several import chunks, and a partial one
+#define FILE_SIZE (3 * IMPORT_CHUNK_SIZE + 1234)
+
+char host_path[64];
+
+static uint8_t pattern(size_t i) { return (uint8_t)(i * 31 + i / 4093); }
+
+static void write_host_file(size_t size) {
+    FILE *fp = fopen(host_path, "w");
+    assert(fp != NULL);
+    for (size_t i = 0; i < size; i++) {
+        assert(fputc(pattern(i), fp) != EOF);
+    }
+    assert(fclose(fp) == 0);
+}
+
+int main() {
+    sprintf(host_path, "/tmp/tfs_copy_stream_%d", (int)getpid());
+    write_host_file(FILE_SIZE);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = BLOCK_COUNT;
+    assert(tfs_init(&params) != -1);
+
+    // the file is much larger than a block, and than a chunk
+    int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "old contents", 12) == 12);
+    assert(tfs_close(f) != -1);
+    assert(tfs_copy_from_external_fs(host_path, "/f1") != -1);
+
+    uint8_t *buffer = malloc(FILE_SIZE + 1);
+    assert(buffer != NULL);
+    f = tfs_open("/f1", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, FILE_SIZE + 1) == FILE_SIZE);
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        assert(buffer[i] == pattern(i));
+    }
+    assert(tfs_close(f) != -1);
+
+    // a second copy does not fit: it fails
+    assert(tfs_copy_from_external_fs(host_path, "/f2") == -1);
+    assert(tfs_unlink("/f2") != -1);
+
+    // a file of exactly one chunk
+    write_host_file(IMPORT_CHUNK_SIZE);
+    assert(tfs_copy_from_external_fs(host_path, "/f1") != -1);
+    f = tfs_open("/f1", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, FILE_SIZE) == IMPORT_CHUNK_SIZE);
+    for (size_t i = 0; i < IMPORT_CHUNK_SIZE; i++) {
+        assert(buffer[i] == pattern(i));
+    }
+    assert(tfs_close(f) != -1);
+
+    free(buffer);
+    assert(tfs_destroy() != -1);
+    unlink(host_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
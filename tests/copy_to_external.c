@@ -0,0 +1,88 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE (100)
+// several extent blocks per file
+#define BLOCKS_PER_FILE (40)
+#define TAIL (37)
+#define FILE_SIZE (BLOCKS_PER_FILE * BLOCK_SIZE + TAIL)
+
+char const *paths[] = {"/f1", "/f2"};
+char host_path[64];
+
+static uint8_t pattern(size_t file, size_t i) {
+    return (uint8_t)(i * 13 + file * 101 + i / BLOCK_SIZE);
+}
+
+static void check_host_file(size_t file, size_t size) {
+    FILE *fp = fopen(host_path, "r");
+    assert(fp != NULL);
+    for (size_t i = 0; i < size; i++) {
+        assert(fgetc(fp) == pattern(file, i));
+    }
+    assert(fgetc(fp) == EOF);
+    assert(fclose(fp) == 0);
+}
+
+int main() {
+    sprintf(host_path, "/tmp/tfs_copy_to_external_%d", (int)getpid());
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 4 * BLOCKS_PER_FILE;
+    assert(tfs_init(&params) != -1);
+
+    int f[2];
+    for (size_t file = 0; file < 2; file++) {
+        f[file] = tfs_open(paths[file], TFS_O_CREAT);
+        assert(f[file] != -1);
+    }
+
+    // interleaved appends: every block becomes an extent of its own
+    uint8_t block[BLOCK_SIZE];
+    for (size_t i = 0; i <= BLOCKS_PER_FILE; i++) {
+        size_t len = i < BLOCKS_PER_FILE ? BLOCK_SIZE : TAIL;
+        for (size_t file = 0; file < 2; file++) {
+            for (size_t j = 0; j < len; j++) {
+                block[j] = pattern(file, i * BLOCK_SIZE + j);
+            }
+            assert(tfs_write(f[file], block, len) == (ssize_t)len);
+        }
+    }
+    for (size_t file = 0; file < 2; file++) {
+        assert(tfs_close(f[file]) != -1);
+    }
+
+    // the host file is overwritten
+    assert(tfs_copy_to_external_fs("/f1", host_path) != -1);
+    check_host_file(0, FILE_SIZE);
+    assert(tfs_copy_to_external_fs("/f2", host_path) != -1);
+    check_host_file(1, FILE_SIZE);
+
+    // and round trips
+    assert(tfs_copy_from_external_fs(host_path, "/f3") != -1);
+    assert(tfs_unlink("/f1") != -1);
+    assert(tfs_copy_to_external_fs("/f3", host_path) != -1);
+    check_host_file(1, FILE_SIZE);
+
+    int empty = tfs_open("/empty", TFS_O_CREAT);
+    assert(empty != -1);
+    assert(tfs_close(empty) != -1);
+    assert(tfs_copy_to_external_fs("/empty", host_path) != -1);
+    check_host_file(0, 0);
+
+    assert(tfs_copy_to_external_fs("/f1", host_path) == -1);
+    assert(tfs_copy_to_external_fs("/f2", "/nonexistent/dir/file") == -1);
+
+    assert(tfs_destroy() != -1);
+    unlink(host_path);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
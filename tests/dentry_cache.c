@@ -0,0 +1,75 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// few inodes make a small dentry cache, so entries are evicted all the time
+#define INODE_COUNT (8)
+#define NAME_COUNT (64)
+#define ROUNDS (4)
+
+static void open_close(char const *path, tfs_file_mode_t mode, int expected) {
+    int f = tfs_open(path, mode);
+    assert((f != -1) == (expected != -1));
+    if (f != -1) {
+        assert(tfs_close(f) != -1);
+    }
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = INODE_COUNT;
+    assert(tfs_init(&params) != -1);
+
+    char path[MAX_FILE_NAME];
+
+    for (size_t round = 0; round < ROUNDS; round++) {
+        // cache negative entries for every name, then create some of them
+        for (size_t i = 0; i < NAME_COUNT; i++) {
+            sprintf(path, "/n%zu", i);
+            open_close(path, 0, -1);
+        }
+        for (size_t i = round; i < NAME_COUNT; i += NAME_COUNT / 4) {
+            sprintf(path, "/n%zu", i);
+            open_close(path, TFS_O_CREAT, 0);
+        }
+        for (size_t i = 0; i < NAME_COUNT; i++) {
+            sprintf(path, "/n%zu", i);
+            open_close(path, 0, i % (NAME_COUNT / 4) == round ? 0 : -1);
+        }
+
+        // and forget them again
+        for (size_t i = round; i < NAME_COUNT; i += NAME_COUNT / 4) {
+            sprintf(path, "/n%zu", i);
+            assert(tfs_unlink(path) != -1);
+            open_close(path, 0, -1);
+        }
+    }
+
+    // a removed directory's inumber is reused for a new one: the names cached
+    // under the old directory must not show up in the new one
+    assert(tfs_mkdir("/d1") != -1);
+    open_close("/d1/f", TFS_O_CREAT, 0);
+    open_close("/d1/g", 0, -1);
+    assert(tfs_unlink("/d1/f") != -1);
+    assert(tfs_rmdir("/d1") != -1);
+    open_close("/d1/f", 0, -1);
+
+    assert(tfs_mkdir("/d2") != -1);
+    open_close("/d2/f", 0, -1);
+    open_close("/d2/g", 0, -1);
+    open_close("/d2/f", TFS_O_CREAT, 0);
+    open_close("/d2/f", 0, 0);
+
+    // a name that changes type: file, then directory
+    assert(tfs_unlink("/d2/f") != -1);
+    assert(tfs_mkdir("/d2/f") != -1);
+    open_close("/d2/f", 0, -1);
+    open_close("/d2/f/x", TFS_O_CREAT, 0);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,94 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// 2 directory entries per node, 11 extents per extent block
+#define BLOCK_SIZE (100)
+#define BLOCKS_PER_FILE (40)
+// root directory, the blocks of both files and 3 extent blocks per file (8 of
+// their 40 extents fit in the inode)
+#define BLOCK_COUNT (1 + 2 * BLOCKS_PER_FILE + 2 * 3)
+
+char const *paths[] = {"/f1", "/f2"};
+uint8_t block[BLOCK_SIZE];
+uint8_t buffer[BLOCKS_PER_FILE * BLOCK_SIZE];
+
+static void fill_block(size_t file, size_t i) {
+    memset(block, (int)(file * BLOCKS_PER_FILE + i), sizeof(block));
+}
+
+static void check_file(size_t file) {
+    int f = tfs_open(paths[file], 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    for (size_t i = 0; i < BLOCKS_PER_FILE; i++) {
+        fill_block(file, i);
+        assert(memcmp(buffer + i * BLOCK_SIZE, block, BLOCK_SIZE) == 0);
+    }
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = BLOCK_COUNT;
+    assert(tfs_init(&params) != -1);
+
+    int f[2];
+    for (size_t file = 0; file < 2; file++) {
+        f[file] = tfs_open(paths[file], TFS_O_CREAT);
+        assert(f[file] != -1);
+    }
+
+    // interleaved appends: no file can grow in place, so every block becomes
+    // an extent of its own
+    for (size_t i = 0; i < BLOCKS_PER_FILE; i++) {
+        for (size_t file = 0; file < 2; file++) {
+            fill_block(file, i);
+            assert(tfs_write(f[file], block, BLOCK_SIZE) == BLOCK_SIZE);
+        }
+    }
+
+    // the filesystem is full
+    assert(tfs_write(f[0], block, 1) == -1);
+
+    for (size_t file = 0; file < 2; file++) {
+        assert(tfs_close(f[file]) != -1);
+        check_file(file);
+    }
+
+    // freeing one file leaves holes in the free space, which a long write
+    // fills with several extents
+    assert(tfs_unlink(paths[1]) != -1);
+    int g = tfs_open(paths[1], TFS_O_CREAT);
+    assert(g != -1);
+    for (size_t i = 0; i < BLOCKS_PER_FILE; i++) {
+        fill_block(1, i);
+        memcpy(buffer + i * BLOCK_SIZE, block, BLOCK_SIZE);
+    }
+    assert(tfs_write(g, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(tfs_close(g) != -1);
+
+    check_file(0);
+    check_file(1);
+
+    // with every file gone, the same long write is a single extent, so one
+    // file can now use every block but the root directory's
+    assert(tfs_unlink(paths[0]) != -1);
+    assert(tfs_unlink(paths[1]) != -1);
+    g = tfs_open(paths[0], TFS_O_CREAT);
+    assert(g != -1);
+    for (size_t i = 0; i < BLOCK_COUNT - 1; i++) {
+        assert(tfs_write(g, block, BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(tfs_write(g, block, 1) == -1);
+    assert(tfs_close(g) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,182 @@
+#include "fs/operations.h"
+#include "fs/state.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE (256)
+#define BLOCK_COUNT (64)
+
+char const data[] = "kept in the image";
+char image[64];
+char journal[80];
+
+static void check_file(char const *path) {
+    char buffer[sizeof(data)];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, data, sizeof(data)) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+static void write_file(char const *path) {
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, data, sizeof(data)) == sizeof(data));
+    assert(tfs_close(f) != -1);
+}
+
+// stop a process with the image mounted, leaving it not clean
+static void crash_mounted(void) {
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(tfs_mount(image) != -1);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// find the inode of a one-extent file of a given size in the image bytes
+static inode_t *find_inode(char *bytes, size_t size, size_t file_size) {
+    for (size_t i = 0; i + sizeof(inode_t) <= size; i += sizeof(size_t)) {
+        inode_t *inode = (inode_t *)(bytes + i);
+        if (inode->i_node_type == T_FILE && inode->i_size == file_size &&
+            inode->i_extent_count == 1 && inode->i_extent_block == -1 &&
+            inode->hard_links == 1) {
+            return inode;
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    sprintf(image, "/tmp/tfs_image_mount_%d", (int)getpid());
+    sprintf(journal, "%s.journal", image);
+    unlink(image);
+
+    // a host file that is not an image cannot be mounted
+    FILE *fp = fopen(image, "w");
+    assert(fp != NULL);
+    assert(fputs("not an image", fp) >= 0);
+    assert(fclose(fp) == 0);
+    assert(tfs_mount(image) == -1);
+    unlink(image);
+    assert(tfs_mount(image) == -1);
+
+    // the image is created with a non-default geometry...
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = BLOCK_COUNT;
+    params.image_path = image;
+    assert(tfs_init(&params) != -1);
+    assert(tfs_mkdir("/d") != -1);
+    write_file("/d/f");
+    assert(tfs_unmount() != -1);
+    assert(tfs_unmount() == -1);
+
+    // ...which mounting recovers from the superblock
+    assert(tfs_mount(image) != -1);
+    check_file("/d/f");
+    assert(tfs_unmount() != -1);
+
+    // a process that stops without unmounting leaves the image not clean
+    // (with what it synced)
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(tfs_mount(image) != -1);
+        write_file("/d/g");
+        assert(tfs_sync() != -1);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // the next mount rebuilds the block bitmap: after removing every file,
+    // all blocks but the directories' can be used by one file again
+    assert(tfs_mount(image) != -1);
+    check_file("/d/f");
+    check_file("/d/g");
+    assert(tfs_unlink("/d/f") != -1);
+    assert(tfs_unlink("/d/g") != -1);
+
+    char block[BLOCK_SIZE] = {0};
+    int f = tfs_open("/big", TFS_O_CREAT);
+    assert(f != -1);
+    for (size_t i = 0; i < BLOCK_COUNT - 2; i++) {
+        assert(tfs_write(f, block, sizeof(block)) == sizeof(block));
+    }
+    assert(tfs_write(f, block, 1) == -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unmount() != -1);
+
+    // an image whose inodes claim the same block is refused, rather than
+    // mounted with a block map that would hand it out again
+    assert(tfs_mount(image) != -1);
+    assert(tfs_unlink("/big") != -1);
+    write_file("/d/f");
+    f = tfs_open("/d/g", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, data, sizeof(data) - 1) == sizeof(data) - 1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unmount() != -1);
+    crash_mounted();
+
+    struct stat st;
+    assert(stat(image, &st) == 0);
+    size_t size = (size_t)st.st_size;
+    char *bytes = malloc(size);
+    assert(bytes != NULL);
+    int fd = open(image, O_RDWR);
+    assert(fd != -1);
+    assert(pread(fd, bytes, size, 0) == (ssize_t)size);
+    inode_t *inode_f = find_inode(bytes, size, sizeof(data));
+    inode_t *inode_g = find_inode(bytes, size, sizeof(data) - 1);
+    assert(inode_f != NULL && inode_g != NULL);
+    extent_t extent_g = inode_g->i_extents[0];
+    inode_g->i_extents[0] = inode_f->i_extents[0];
+    off_t offset = (char *)inode_g - bytes;
+    assert(pwrite(fd, inode_g, sizeof(inode_t), offset) == sizeof(inode_t));
+    assert(tfs_mount(image) == -1);
+    // (which leaves it as it was, and the filesystem free to be initialized)
+    assert(tfs_mount(image) == -1);
+    assert(tfs_init(NULL) != -1);
+    assert(tfs_destroy() != -1);
+
+    // and so is one whose extents run past the last block
+    inode_g->i_extents[0].e_block = BLOCK_COUNT - 1;
+    inode_g->i_extents[0].e_length = 2;
+    assert(pwrite(fd, inode_g, sizeof(inode_t), offset) == sizeof(inode_t));
+    assert(tfs_mount(image) == -1);
+
+    // once repaired, it mounts again
+    inode_g->i_extents[0] = extent_g;
+    assert(pwrite(fd, inode_g, sizeof(inode_t), offset) == sizeof(inode_t));
+    assert(close(fd) == 0);
+    free(bytes);
+    assert(tfs_mount(image) != -1);
+    check_file("/d/f");
+    assert(tfs_unmount() != -1);
+
+    // without an image there is nothing to unmount
+    assert(tfs_init(NULL) != -1);
+    assert(tfs_unmount() == -1);
+    assert(tfs_destroy() != -1);
+
+    unlink(image);
+    unlink(journal);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE (256)
+#define MANY_FILES (24)
+#define THREAD_COUNT (4)
+
+char root[64];
+// host paths created, relative to root, removed in reverse order at the end
+char created[64][MAX_FILE_NAME * 2];
+size_t created_count;
+
+static void host_path(char *path, char const *relative) {
+    sprintf(path, "%s/%s", root, relative);
+}
+
+static size_t contents(char const *relative, char *buffer) {
+    // sizes from empty to a few blocks
+    size_t size = strlen(relative) * 37 % (4 * BLOCK_SIZE);
+    for (size_t i = 0; i < size; i++) {
+        buffer[i] = relative[i % strlen(relative)];
+    }
+    return size;
+}
+
+static void make_host_dir(char const *relative) {
+    char path[128];
+    host_path(path, relative);
+    assert(mkdir(path, 0755) == 0);
+    strcpy(created[created_count++], relative);
+}
+
+static void make_host_file(char const *relative) {
+    char path[128];
+    char buffer[4 * BLOCK_SIZE];
+    host_path(path, relative);
+    FILE *fp = fopen(path, "w");
+    assert(fp != NULL);
+    size_t size = contents(relative, buffer);
+    assert(fwrite(buffer, 1, size, fp) == size);
+    assert(fclose(fp) == 0);
+    strcpy(created[created_count++], relative);
+}
+
+static void check_file(char const *prefix, char const *relative) {
+    char path[128];
+    char expected[4 * BLOCK_SIZE];
+    char buffer[4 * BLOCK_SIZE + 1];
+    sprintf(path, "%s/%s", prefix, relative);
+    size_t size = contents(relative, expected);
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)size);
+    assert(memcmp(buffer, expected, size) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+static void check_tree(char const *prefix) {
+    check_file(prefix, "a");
+    check_file(prefix, "sub/b");
+    check_file(prefix, "sub/deeper/c");
+    char path[128];
+    for (size_t i = 0; i < MANY_FILES; i++) {
+        sprintf(path, "many/file%zu", i);
+        check_file(prefix, path);
+    }
+
+    // the empty directory is there, and the symbolic link is not
+    char name[MAX_FILE_NAME];
+    sprintf(path, "%s/empty", prefix);
+    assert(tfs_readdir(path, NULL, name) == 0);
+    sprintf(path, "%s/link", prefix);
+    assert(tfs_open(path, 0) == -1);
+}
+
+int main() {
+    sprintf(root, "/tmp/tfs_import_tree_%d", (int)getpid());
+    assert(mkdir(root, 0755) == 0);
+    make_host_file("a");
+    make_host_dir("sub");
+    make_host_file("sub/b");
+    make_host_dir("sub/deeper");
+    make_host_file("sub/deeper/c");
+    make_host_dir("empty");
+    make_host_dir("many");
+    char relative[MAX_FILE_NAME];
+    for (size_t i = 0; i < MANY_FILES; i++) {
+        sprintf(relative, "many/file%zu", i);
+        make_host_file(relative);
+    }
+    char path[128];
+    host_path(path, "link");
+    assert(symlink("a", path) == 0);
+    strcpy(created[created_count++], "link");
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_inode_count = 128;
+    assert(tfs_init(&params) != -1);
+
+    assert(tfs_import_tree(root, "/data", THREAD_COUNT) != -1);
+    check_tree("/data");
+
+    // into an existing directory, with the calling thread alone: files are
+    // overwritten
+    int f = tfs_open("/data/a", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, "stale", 5) == 5);
+    assert(tfs_close(f) != -1);
+    assert(tfs_import_tree(root, "/data", 1) != -1);
+    check_tree("/data");
+    assert(tfs_import_tree(root, "/", THREAD_COUNT) != -1);
+    check_tree("");
+
+    // a name that does not fit fails the import, not the rest of the tree
+    char long_name[MAX_FILE_NAME + 1];
+    memset(long_name, 'x', MAX_FILE_NAME);
+    long_name[MAX_FILE_NAME] = '\0';
+    make_host_file(long_name);
+    assert(tfs_import_tree(root, "/again", THREAD_COUNT) == -1);
+    check_tree("/again");
+
+    assert(tfs_import_tree(root, "/data", 0) == -1);
+    assert(tfs_import_tree(root, "/data/a", THREAD_COUNT) == -1);
+    assert(tfs_import_tree(root, "relative", THREAD_COUNT) == -1);
+    assert(tfs_import_tree("/nonexistent/dir", "/other", THREAD_COUNT) ==
+           -1);
+
+    assert(tfs_destroy() != -1);
+
+    while (created_count > 0) {
+        host_path(path, created[--created_count]);
+        assert(remove(path) == 0);
+    }
+    assert(rmdir(root) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE (512)
+#define THREAD_COUNT (4)
+#define WRITES_PER_THREAD (64)
+
+char image[64];
+char journal[80];
+
+static size_t file_size(char const *path) {
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    return (size_t)st.st_size;
+}
+
+static void create_file(char const *path, char fill, size_t size) {
+    char buffer[size];
+    memset(buffer, fill, size);
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, buffer, size) == (ssize_t)size);
+    assert(tfs_close(f) != -1);
+}
+
+static void check_file(char const *path, char fill, size_t size) {
+    char buffer[size + 1];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, size + 1) == (ssize_t)size);
+    for (size_t i = 0; i < size; i++) {
+        assert(buffer[i] == fill);
+    }
+    assert(tfs_close(f) != -1);
+}
+
+// files are created and rewritten while other threads sync
+void *write_files_thread_func(void *arg) {
+    char path[MAX_FILE_NAME];
+    sprintf(path, "/w%zu", (size_t)arg);
+    for (size_t i = 0; i < WRITES_PER_THREAD; i++) {
+        create_file(path, (char)('a' + i % 26), 1 + i * 13 % (3 * BLOCK_SIZE));
+    }
+    return NULL;
+}
+
+void *sync_thread_func() {
+    for (size_t i = 0; i < WRITES_PER_THREAD / 4; i++) {
+        assert(tfs_sync() != -1);
+    }
+    return NULL;
+}
+
+int main() {
+    sprintf(image, "/tmp/tfs_incremental_sync_%d", (int)getpid());
+    sprintf(journal, "%s.journal", image);
+    unlink(image);
+    unlink(journal);
+
+    // without an image there is nothing to flush
+    assert(tfs_sync() == -1);
+    assert(tfs_init(NULL) != -1);
+    assert(tfs_sync() != -1);
+    assert(tfs_destroy() != -1);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.image_path = image;
+    assert(tfs_init(&params) != -1);
+
+    pthread_t writers[THREAD_COUNT];
+    pthread_t syncer;
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&writers[i], NULL, write_files_thread_func,
+                              (void *)i) == 0);
+    }
+    assert(pthread_create(&syncer, NULL, sync_thread_func, NULL) == 0);
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(writers[i], NULL) == 0);
+    }
+    assert(pthread_join(syncer, NULL) == 0);
+
+    assert(tfs_unmount() != -1);
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        // a sync makes the journal unnecessary
+        assert(tfs_mount(image) != -1);
+        create_file("/synced", 's', BLOCK_SIZE + 1);
+        assert(file_size(journal) > 0);
+        assert(tfs_sync() != -1);
+        assert(file_size(journal) == 0);
+
+        size_t image_size = file_size(image);
+        char *snapshot = malloc(image_size);
+        assert(snapshot != NULL);
+        FILE *fp = fopen(image, "r");
+        assert(fp != NULL);
+        assert(fread(snapshot, 1, image_size, fp) == image_size);
+        assert(fclose(fp) == 0);
+
+        // what changes after the sync is journaled again: losing it from the
+        // image, and then stopping, only loses the data written since
+        create_file("/after", 'x', 10);
+        assert(tfs_unlink("/synced") != -1);
+        fp = fopen(image, "r+");
+        assert(fp != NULL);
+        assert(fwrite(snapshot, 1, image_size, fp) == image_size);
+        assert(fclose(fp) == 0);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    assert(tfs_mount(image) != -1);
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        char path[MAX_FILE_NAME];
+        sprintf(path, "/w%zu", i);
+        size_t last = WRITES_PER_THREAD - 1;
+        check_file(path, (char)('a' + last % 26),
+                   1 + last * 13 % (3 * BLOCK_SIZE));
+    }
+    check_file("/after", 'x', 0);
+    assert(tfs_open("/synced", 0) == -1);
+    assert(tfs_unmount() != -1);
+
+    // a background flusher empties the journal by itself
+    params.flush_interval_ms = 10;
+    assert(tfs_init(&params) != -1);
+    create_file("/flushed", 'f', 1);
+    struct timespec wait = {.tv_sec = 0, .tv_nsec = 10000000};
+    for (int i = 0; i < 500 && file_size(journal) > 0; i++) {
+        nanosleep(&wait, NULL);
+    }
+    assert(file_size(journal) == 0);
+    check_file("/flushed", 'f', 1);
+    assert(tfs_unmount() != -1);
+
+    unlink(image);
+    unlink(journal);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FILE_COUNT (3000)
+
+// small blocks: 5 entries per directory node, so the tree gets deep
+#define BLOCK_SIZE (256)
+
+static void path_of(char *path, size_t i) {
+    // created in a scrambled order
+    sprintf(path, "/file%05zu", (i * 7919) % FILE_COUNT);
+}
+
+// lists the root directory, checking the names come in increasing order
+static size_t count_entries(void) {
+    char name[MAX_FILE_NAME];
+    char previous[MAX_FILE_NAME];
+    size_t count = 0;
+    int r;
+
+    while ((r = tfs_readdir("/", count == 0 ? NULL : previous, name)) == 1) {
+        if (count > 0) {
+            assert(strcmp(previous, name) < 0);
+        }
+        strcpy(previous, name);
+        count++;
+    }
+    assert(r == 0);
+    return count;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = FILE_COUNT + 1;
+    params.max_block_count = 4096;
+    params.block_size = BLOCK_SIZE;
+    assert(tfs_init(&params) != -1);
+
+    char path[MAX_FILE_NAME];
+    for (size_t i = 0; i < FILE_COUNT; i++) {
+        path_of(path, i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    assert(count_entries() == FILE_COUNT);
+
+    // every name can be found again
+    for (size_t i = 0; i < FILE_COUNT; i++) {
+        path_of(path, i);
+        int f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_open("/file", 0) == -1);
+    assert(tfs_open("/file99999", 0) == -1);
+
+    // remove half of the entries
+    for (size_t i = 0; i < FILE_COUNT; i += 2) {
+        path_of(path, i);
+        assert(tfs_unlink(path) != -1);
+        assert(tfs_unlink(path) == -1);
+    }
+    assert(count_entries() == FILE_COUNT / 2);
+    for (size_t i = 0; i < FILE_COUNT; i++) {
+        path_of(path, i);
+        int f = tfs_open(path, 0);
+        assert((f == -1) == (i % 2 == 0));
+        if (f != -1) {
+            assert(tfs_close(f) != -1);
+        }
+    }
+
+    // and add them back
+    for (size_t i = 0; i < FILE_COUNT; i += 2) {
+        path_of(path, i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    assert(count_entries() == FILE_COUNT);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK_SIZE (1024)
+#define FILE_BLOCKS (4)
+#define ACCESS_NS (1000000)
+#define UNCHARGED_NS (1000000000) // (far more than any run takes)
+
+char buffer[FILE_BLOCKS * BLOCK_SIZE];
+
+static double elapsed(struct timespec const *start, clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (double)(now.tv_sec - start->tv_sec) * 1e9 +
+           (double)(now.tv_nsec - start->tv_nsec);
+}
+
+// time (wall and CPU) to read a file of FILE_BLOCKS blocks back
+static void read_file(double *wall_ns, double *cpu_ns) {
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(tfs_close(f) != -1);
+
+    struct timespec wall, cpu;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    f = tfs_open("/f", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(tfs_close(f) != -1);
+    *wall_ns = elapsed(&wall, CLOCK_MONOTONIC);
+    *cpu_ns = elapsed(&cpu, CLOCK_PROCESS_CPUTIME_ID);
+}
+
+int main() {
+    memset(buffer, 'x', sizeof(buffer));
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.cache_frames = 0; // every access pays
+    double wall, cpu;
+
+    // no cost at all
+    params.latency.mode = TFS_LATENCY_NONE;
+    params.latency.seek_ns[TFS_STRUCT_DATA] = UNCHARGED_NS;
+    assert(tfs_init(&params) != -1);
+    read_file(&wall, &cpu);
+    assert(wall < UNCHARGED_NS);
+    assert(tfs_destroy() != -1);
+
+    // only reading the data blocks costs: the read goes through the file's
+    // one extent at least, and the transfer of each of its blocks is charged
+    params.latency.mode = TFS_LATENCY_SPIN;
+    memset(params.latency.seek_ns, 0, sizeof(params.latency.seek_ns));
+    params.latency.ns_per_kib[TFS_STRUCT_DATA] = ACCESS_NS;
+    assert(tfs_init(&params) != -1);
+    read_file(&wall, &cpu);
+    assert(wall >= ACCESS_NS);
+    assert(cpu >= ACCESS_NS / 2); // spinning burns the time
+    assert(tfs_destroy() != -1);
+
+    // the same cost, sleeping: the time passes, without using the CPU (for
+    // most of what is charged, whatever else runs)
+    params.latency.mode = TFS_LATENCY_SLEEP;
+    assert(tfs_init(&params) != -1);
+    read_file(&wall, &cpu);
+    assert(wall >= ACCESS_NS);
+    assert(cpu < FILE_BLOCKS * ACCESS_NS / 2);
+    assert(tfs_destroy() != -1);
+
+    // seeks: the inode access costs (the directory lookups may be cached)
+    params.latency.mode = TFS_LATENCY_SPIN;
+    params.latency.ns_per_kib[TFS_STRUCT_DATA] = 0;
+    params.latency.seek_ns[TFS_STRUCT_INODE] = ACCESS_NS;
+    assert(tfs_init(&params) != -1);
+    read_file(&wall, &cpu);
+    assert(wall >= ACCESS_NS);
+    assert(tfs_destroy() != -1);
+
+    params.latency.mode = (tfs_latency_mode_t)42;
+    assert(tfs_init(&params) == -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
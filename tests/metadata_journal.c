@@ -0,0 +1,229 @@
+#include "fs/operations.h"
+#include "fs/journal.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define THREAD_COUNT (4)
+#define FILES_PER_THREAD (16)
+#define SUPERBLOCK_BYTES (64) // (what the superblock takes in the image)
+
+char const data[] = "written before the snapshot";
+char const redone[] = "written by the checkpoint!!"; // (as long as data)
+char image[64];
+char journal[80];
+
+static void check_file(char const *path) {
+    char buffer[sizeof(data)];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, data, sizeof(data)) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+static void check_missing(char const *path) {
+    assert(tfs_open(path, 0) == -1);
+}
+
+static void create_file(char const *path) {
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+}
+
+// concurrent metadata operations, whose records are committed in groups
+void *create_files_thread_func(void *arg) {
+    char path[MAX_FILE_NAME];
+    for (size_t i = 0; i < FILES_PER_THREAD; i++) {
+        sprintf(path, "/d/t%zu_%zu", (size_t)arg, i);
+        create_file(path);
+        if (i % 2 == 1) {
+            assert(tfs_unlink(path) != -1);
+        }
+    }
+    return NULL;
+}
+
+static size_t file_size(char const *path) {
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    return (size_t)st.st_size;
+}
+
+static char *read_host_file(char const *path, size_t size) {
+    char *contents = malloc(size);
+    assert(contents != NULL);
+    FILE *fp = fopen(path, "r");
+    assert(fp != NULL);
+    assert(fread(contents, 1, size, fp) == size);
+    assert(fclose(fp) == 0);
+    return contents;
+}
+
+// the offset of data in the image, as a host file
+static uint64_t find_data(char const *path, size_t size) {
+    char *contents = read_host_file(path, size);
+    size_t offset = 0;
+    while (memcmp(contents + offset, data, sizeof(data)) != 0) {
+        assert(++offset + sizeof(data) <= size);
+    }
+    free(contents);
+    return offset;
+}
+
+// a checkpoint that rewrites data in the image
+uint64_t checkpoint_offset;
+size_t checkpoint_lost_length;
+
+static void checkpoint_capture(void) {
+    journal_image(checkpoint_offset, redone, sizeof(redone));
+}
+
+static void checkpoint_lost(uint64_t offset, size_t length) {
+    assert(offset == checkpoint_offset);
+    checkpoint_lost_length += length;
+}
+
+static void write_host_file(char const *path, char const *contents,
+                            size_t size) {
+    FILE *fp = fopen(path, "r+");
+    assert(fp != NULL);
+    assert(fwrite(contents, 1, size, fp) == size);
+    assert(fclose(fp) == 0);
+}
+
+int main() {
+    sprintf(image, "/tmp/tfs_metadata_journal_%d", (int)getpid());
+    sprintf(journal, "%s.journal", image);
+    unlink(image);
+    unlink(journal);
+
+    tfs_params params = tfs_default_params();
+    params.image_path = image;
+    assert(tfs_init(&params) != -1);
+    assert(tfs_mkdir("/d") != -1);
+    int f = tfs_open("/keep", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, data, sizeof(data)) == sizeof(data));
+    assert(tfs_close(f) != -1);
+    create_file("/gone");
+    assert(tfs_mkdir("/empty") != -1);
+    assert(tfs_unmount() != -1);
+    assert(file_size(journal) == 0);
+
+    // the image as it is on disk right after it was flushed
+    size_t image_size = file_size(image);
+    char *snapshot = read_host_file(image, image_size);
+
+    // a process changes the namespace and stops without unmounting
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(tfs_mount(image) != -1);
+
+        pthread_t threads[THREAD_COUNT];
+        for (size_t i = 0; i < THREAD_COUNT; i++) {
+            assert(pthread_create(&threads[i], NULL, create_files_thread_func,
+                                  (void *)i) == 0);
+        }
+        for (size_t i = 0; i < THREAD_COUNT; i++) {
+            assert(pthread_join(threads[i], NULL) == 0);
+        }
+
+        assert(tfs_link("/keep", "/d/keep2") != -1);
+        assert(tfs_sym_link("/d/keep2", "/sym") != -1);
+        assert(tfs_unlink("/gone") != -1);
+        assert(tfs_rmdir("/empty") != -1);
+        assert(tfs_mkdir("/d/sub") != -1);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(file_size(journal) > 0);
+
+    // none of its changes reached the image itself (which only a checkpoint
+    // writes), beyond marking it in use: only the journal has them
+    char *stopped = read_host_file(image, image_size);
+    assert(memcmp(stopped + SUPERBLOCK_BYTES, snapshot + SUPERBLOCK_BYTES,
+                  image_size - SUPERBLOCK_BYTES) == 0);
+    free(stopped);
+    write_host_file(image, snapshot, image_size);
+
+    assert(tfs_mount(image) != -1);
+    assert(file_size(journal) == 0);
+
+    char path[MAX_FILE_NAME];
+    for (size_t t = 0; t < THREAD_COUNT; t++) {
+        for (size_t i = 0; i < FILES_PER_THREAD; i++) {
+            sprintf(path, "/d/t%zu_%zu", t, i);
+            if (i % 2 == 1) {
+                check_missing(path);
+            } else {
+                // it exists, empty (file data is not journaled)
+                f = tfs_open(path, 0);
+                assert(f != -1);
+                assert(tfs_read(f, path, 1) == 0);
+                assert(tfs_close(f) != -1);
+            }
+        }
+    }
+    check_file("/keep");
+    check_file("/d/keep2");
+    check_file("/sym");
+    check_missing("/gone");
+    assert(tfs_mkdir("/empty") != -1); // the name is free again
+    create_file("/d/sub/x");
+
+    // the redone link count holds: the file outlives its first name
+    assert(tfs_unlink("/keep") != -1);
+    check_file("/d/keep2");
+    assert(tfs_unmount() != -1);
+
+    // and the result is in the image after a clean unmount
+    assert(tfs_mount(image) != -1);
+    check_missing("/keep");
+    check_file("/d/keep2");
+    assert(tfs_unlink("/sym") != -1);
+    assert(tfs_unmount() != -1);
+
+    // a checkpoint that was logged, but stopped before the image was written
+    // (here, because it cannot be), is finished by the next mount
+    checkpoint_offset = find_data(image, image_size);
+    int fd = open(image, O_RDONLY);
+    assert(fd != -1);
+    assert(journal_open(journal, fd) != -1);
+    assert(journal_checkpoint(checkpoint_capture, checkpoint_lost) == -1);
+    assert(checkpoint_lost_length == sizeof(redone));
+    journal_close();
+    assert(close(fd) == 0);
+    assert(file_size(journal) > 0);
+    assert(find_data(image, image_size) == checkpoint_offset);
+
+    assert(tfs_mount(image) != -1);
+    assert(file_size(journal) == 0);
+    char buffer[sizeof(redone)];
+    f = tfs_open("/d/keep2", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, redone, sizeof(redone)) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/d/keep2") != -1);
+    check_missing("/d/keep2");
+    assert(tfs_unmount() != -1);
+    free(snapshot);
+
+    unlink(image);
+    unlink(journal);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK_SIZE (128)
+#define FILE_SIZE (100 * BLOCK_SIZE + 17)
+// data blocks of the file (a single extent), plus the root directory
+#define BLOCK_COUNT (101 + 1)
+
+char const path[] = "/f1";
+uint8_t contents[FILE_SIZE];
+uint8_t buffer[FILE_SIZE];
+
+static void write_file(int f) {
+    // odd-sized writes, so that most of them cross a block boundary
+    size_t written = 0;
+    while (written < FILE_SIZE) {
+        size_t len = FILE_SIZE - written < 77 ? FILE_SIZE - written : 77;
+        assert(tfs_write(f, contents + written, len) == len);
+        written += len;
+    }
+}
+
+int main() {
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        contents[i] = (uint8_t)(i * 31 + i / BLOCK_SIZE);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = BLOCK_COUNT;
+    assert(tfs_init(&params) != -1);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    write_file(f);
+    assert(tfs_close(f) != -1);
+
+    // read it back in one go
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == FILE_SIZE);
+    assert(memcmp(buffer, contents, FILE_SIZE) == 0);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 0);
+    assert(tfs_close(f) != -1);
+
+    // every block is in use, so no other file can grow
+    int g = tfs_open("/f2", TFS_O_CREAT);
+    assert(g != -1);
+    assert(tfs_write(g, contents, 1) == -1);
+    assert(tfs_close(g) != -1);
+
+    // truncating frees every block, so the whole file can be written again
+    f = tfs_open(path, TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 0);
+    write_file(f);
+    assert(tfs_close(f) != -1);
+
+    // and so does unlinking it
+    assert(tfs_unlink(path) != -1);
+    f = tfs_open("/f3", TFS_O_CREAT);
+    assert(f != -1);
+    write_file(f);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/f3", 0);
+    assert(f != -1);
+    for (size_t read = 0; read < FILE_SIZE; read += BLOCK_SIZE + 1) {
+        size_t len = FILE_SIZE - read < BLOCK_SIZE + 1 ? FILE_SIZE - read
+                                                       : BLOCK_SIZE + 1;
+        assert(tfs_read(f, buffer, len) == len);
+        assert(memcmp(buffer, contents + read, len) == 0);
+    }
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREAD_COUNT (4)
+#define ROUNDS (20)
+
+// every thread builds, fills and tears down its own subtree under /shared
+void *subtree_thread_func(void *arg) {
+    size_t id = (size_t)arg;
+    char dir[MAX_FILE_NAME];
+    char path[2 * MAX_FILE_NAME];
+    sprintf(dir, "/shared/t%zu", id);
+    sprintf(path, "%s/f", dir);
+
+    for (int round = 0; round < ROUNDS; round++) {
+        assert(tfs_mkdir(dir) != -1);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, &id, sizeof(id)) == sizeof(id));
+        assert(tfs_close(f) != -1);
+
+        assert(tfs_rmdir(dir) == -1); // not empty
+        assert(tfs_unlink(path) != -1);
+        assert(tfs_rmdir(dir) != -1);
+    }
+
+    return NULL;
+}
+
+int main() {
+    char const data[] = "nested";
+    char buffer[sizeof(data)];
+
+    assert(tfs_init(NULL) != -1);
+
+    assert(tfs_mkdir("/a") != -1);
+    assert(tfs_mkdir("/a") == -1);
+    assert(tfs_mkdir("/a/b") != -1);
+    assert(tfs_mkdir("/x/y") == -1); // missing parent
+
+    int f = tfs_open("/a/b/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, data, sizeof(data)) == sizeof(data));
+    assert(tfs_close(f) != -1);
+
+    // files are not directories, and directories cannot be opened
+    assert(tfs_mkdir("/a/b/f/g") == -1);
+    assert(tfs_open("/a/b/f/g", TFS_O_CREAT) == -1);
+    assert(tfs_open("/a/b", 0) == -1);
+    assert(tfs_unlink("/a/b") == -1);
+    assert(tfs_open("/a//b/f", 0) == -1);
+
+    // links across directories
+    assert(tfs_link("/a/b/f", "/a/hard") != -1);
+    assert(tfs_sym_link("/a/b/f", "/soft") != -1);
+    f = tfs_open("/soft", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, data, sizeof(buffer)) == 0);
+    assert(tfs_close(f) != -1);
+
+    char name[MAX_FILE_NAME];
+    assert(tfs_readdir("/a", NULL, name) == 1);
+    assert(strcmp(name, "b") == 0);
+    assert(tfs_readdir("/a", "b", name) == 1);
+    assert(strcmp(name, "hard") == 0);
+    assert(tfs_readdir("/a", "hard", name) == 0);
+    assert(tfs_readdir("/a/b/f", NULL, name) == -1);
+
+    // only empty directories can be removed
+    assert(tfs_rmdir("/a/b") == -1);
+    assert(tfs_unlink("/a/b/f") != -1);
+    assert(tfs_rmdir("/a/b/f") == -1);
+    assert(tfs_rmdir("/a/b") != -1);
+    assert(tfs_rmdir("/a/b") == -1);
+    assert(tfs_rmdir("/") == -1);
+
+    // the hard link keeps the data alive
+    f = tfs_open("/a/hard", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, data, sizeof(buffer)) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_mkdir("/shared") != -1);
+    pthread_t threads[THREAD_COUNT];
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&threads[i], NULL, subtree_thread_func,
+                              (void *)i) == 0);
+    }
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(tfs_readdir("/shared", NULL, name) == 0);
+    assert(tfs_rmdir("/shared") != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+char const data[] = "survives a restart";
+
+int main() {
+    char image[64];
+    char journal[80];
+    sprintf(image, "/tmp/tfs_persistent_image_%d", (int)getpid());
+    sprintf(journal, "%s.journal", image);
+    unlink(image);
+
+    tfs_params params = tfs_default_params();
+    params.image_path = image;
+    char buffer[sizeof(data)];
+
+    // a new image starts empty
+    assert(tfs_init(&params) != -1);
+    assert(tfs_open("/d/f", 0) == -1);
+    assert(tfs_mkdir("/d") != -1);
+    int f = tfs_open("/d/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, data, sizeof(data)) == sizeof(data));
+    assert(tfs_close(f) != -1);
+    assert(tfs_link("/d/f", "/hard") != -1);
+    assert(tfs_destroy() != -1);
+
+    // reattaching finds everything where it was
+    assert(tfs_init(&params) != -1);
+    f = tfs_open("/hard", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, data, sizeof(data)) == 0);
+    assert(tfs_close(f) != -1);
+
+    // and allocates around the blocks and inodes already in use
+    f = tfs_open("/d/g", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "other", 5) == 5);
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/d/f", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, data, sizeof(data)) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_unlink("/d/f") != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init(&params) != -1);
+    assert(tfs_open("/d/f", 0) == -1);
+    f = tfs_open("/hard", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, data, sizeof(data)) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    // an image only fits the geometry it was made with
+    params.max_block_count *= 2;
+    assert(tfs_init(&params) == -1);
+
+    unlink(image);
+    unlink(journal);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREAD_COUNT (8)
+#define RECORD_COUNT (200)
+#define READS_PER_THREAD (500)
+
+int shared_handle;
+
+// random record reads through one shared handle
+void *read_records_thread_func(void *arg) {
+    uint32_t seed = (uint32_t)(size_t)arg + 1;
+    for (size_t i = 0; i < READS_PER_THREAD; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t record = (seed >> 8) % RECORD_COUNT;
+        uint32_t value;
+        assert(tfs_pread(shared_handle, &value, sizeof(value),
+                         record * sizeof(value)) == sizeof(value));
+        assert(value == record * 3);
+    }
+    return NULL;
+}
+
+int main() {
+    char buffer[16];
+    assert(tfs_init(NULL) != -1);
+
+    int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+
+    // positional writes do not move the handle's offset
+    assert(tfs_pwrite(f, "world", 5, 6) == 5);
+    assert(tfs_pwrite(f, "hello", 5, 0) == 5);
+    assert(tfs_write(f, "H", 1) == 1);
+    assert(tfs_pread(f, buffer, sizeof(buffer), 0) == 11);
+    assert(memcmp(buffer, "Hello\0world", 11) == 0); // the gap reads as zero
+
+    // nor do positional reads
+    assert(tfs_pread(f, buffer, 3, 8) == 3);
+    assert(memcmp(buffer, "rld", 3) == 0);
+    assert(tfs_pread(f, buffer, 3, 11) == 0);
+    assert(tfs_pread(f, buffer, 3, 100) == 0);
+    assert(tfs_read(f, buffer, 4) == 4);
+    assert(memcmp(buffer, "ello", 4) == 0);
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_pread(f, buffer, 1, 0) == -1);
+    assert(tfs_pwrite(f, buffer, 1, 0) == -1);
+
+    // records written out of order, then read in parallel
+    shared_handle = tfs_open("/records", TFS_O_CREAT);
+    assert(shared_handle != -1);
+    for (uint32_t i = RECORD_COUNT; i-- > 0;) {
+        uint32_t value = i * 3;
+        assert(tfs_pwrite(shared_handle, &value, sizeof(value),
+                          i * sizeof(value)) == sizeof(value));
+    }
+
+    pthread_t threads[THREAD_COUNT];
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&threads[i], NULL, read_records_thread_func,
+                              (void *)i) == 0);
+    }
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(tfs_close(shared_handle) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE (1024)
+#define FILE_BLOCKS (64)
+#define ACCESS_NS (1000000)
+
+char image[64];
+char journal[80];
+char contents[FILE_BLOCKS * BLOCK_SIZE];
+
+static double elapsed_ns(struct timespec const *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) * 1e9 +
+           (double)(now.tv_nsec - start->tv_nsec);
+}
+
+// mount the image (with a cold cache) and read the file block by block
+static double read_file(tfs_params *params, void (*reader)(int f),
+                        tfs_cache_stats_t *stats) {
+    assert(tfs_init(params) != -1);
+    int f = tfs_open("/f", 0);
+    assert(f != -1);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    reader(f);
+    double ns = elapsed_ns(&start);
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_cache_stats(stats) != -1);
+    assert(tfs_unmount() != -1);
+    return ns;
+}
+
+static void read_sequential(int f) {
+    char block[BLOCK_SIZE];
+    for (size_t i = 0; i < FILE_BLOCKS; i++) {
+        assert(tfs_read(f, block, BLOCK_SIZE) == BLOCK_SIZE);
+        assert(memcmp(block, contents + i * BLOCK_SIZE, BLOCK_SIZE) == 0);
+    }
+    assert(tfs_read(f, block, BLOCK_SIZE) == 0);
+}
+
+// every other block, backwards: never sequential
+static void read_random(int f) {
+    char block[BLOCK_SIZE];
+    for (size_t i = FILE_BLOCKS; i > 0; i -= 2) {
+        assert(tfs_pread(f, block, BLOCK_SIZE, (i - 1) * BLOCK_SIZE) ==
+               BLOCK_SIZE);
+    }
+}
+
+int main() {
+    sprintf(image, "/tmp/tfs_readahead_%d", (int)getpid());
+    sprintf(journal, "%s.journal", image);
+    unlink(image);
+    unlink(journal);
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)(i * 11 + i / BLOCK_SIZE);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.image_path = image;
+    params.latency.mode = TFS_LATENCY_NONE;
+    assert(tfs_init(&params) != -1);
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+    assert(tfs_unmount() != -1);
+
+    // each block costs a seek
+    params.latency.mode = TFS_LATENCY_SLEEP;
+    params.latency.seek_ns[TFS_STRUCT_DATA] = ACCESS_NS;
+    tfs_cache_stats_t stats;
+
+    params.readahead_max_blocks = 0;
+    double plain = read_file(&params, read_sequential, &stats);
+    assert(stats.prefetches == 0);
+    assert(plain >= FILE_BLOCKS * ACCESS_NS);
+
+    // the blocks ahead are read in a few runs, one seek each
+    params.readahead_max_blocks = 16;
+    double ahead = read_file(&params, read_sequential, &stats);
+    assert(stats.prefetches >= FILE_BLOCKS / 2);
+    assert(ahead < plain / 2);
+
+    // nothing is read ahead of reads that are not sequential
+    read_file(&params, read_random, &stats);
+    assert(stats.prefetches == 0);
+
+    unlink(image);
+    unlink(journal);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREAD_COUNT (8)
+
+char const path[] = "/f1";
+atomic_int successful_closes;
+
+void *close_thread_func(void *arg) {
+    int f = *(int *)arg;
+    if (tfs_close(f) == 0) {
+        atomic_fetch_add(&successful_closes, 1);
+    }
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_open_files_count = 1; // every open reuses the same slot
+    assert(tfs_init(&params) != -1);
+
+    int f1 = tfs_open(path, TFS_O_CREAT);
+    assert(f1 != -1);
+    assert(tfs_open(path, 0) == -1); // table is full
+    assert(tfs_close(f1) != -1);
+
+    int f2 = tfs_open(path, 0);
+    assert(f2 != -1);
+    assert(f2 != f1);
+
+    // the old handle refers to the same slot, but must not reach the new file
+    char buffer[4];
+    assert(tfs_write(f1, "AAA!", 4) == -1);
+    assert(tfs_read(f1, buffer, sizeof(buffer)) == -1);
+    assert(tfs_close(f1) == -1);
+
+    // several threads closing the same handle: only one of them succeeds
+    pthread_t threads[THREAD_COUNT];
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&threads[i], NULL, close_thread_func, &f2) == 0);
+    }
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(successful_closes == 1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREAD_COUNT (8)
+#define FILES_PER_THREAD (40)
+#define ROUNDS (3)
+
+// every thread creates, and then unlinks, its own set of files
+void *create_files_thread_func(void *arg) {
+    size_t id = (size_t)arg;
+    char path[MAX_FILE_NAME];
+
+    for (int round = 0; round < ROUNDS; round++) {
+        for (size_t i = 0; i < FILES_PER_THREAD; i++) {
+            sprintf(path, "/t%zu_%zu", id, i);
+            int f = tfs_open(path, TFS_O_CREAT);
+            assert(f != -1);
+            assert(tfs_write(f, &id, sizeof(id)) == sizeof(id));
+            assert(tfs_close(f) != -1);
+        }
+
+        for (size_t i = 0; i < FILES_PER_THREAD; i++) {
+            sprintf(path, "/t%zu_%zu", id, i);
+            int f = tfs_open(path, 0);
+            assert(f != -1);
+            size_t owner;
+            assert(tfs_read(f, &owner, sizeof(owner)) == sizeof(owner));
+            assert(owner == id); // no inode was handed out twice
+            assert(tfs_close(f) != -1);
+            assert(tfs_unlink(path) != -1);
+        }
+    }
+
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    // exactly enough inodes for every file plus the root directory
+    params.max_inode_count = THREAD_COUNT * FILES_PER_THREAD + 1;
+    params.block_size = 16384; // the root directory must fit every name
+    assert(tfs_init(&params) != -1);
+
+    pthread_t threads[THREAD_COUNT];
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&threads[i], NULL, create_files_thread_func,
+                              (void *)i) == 0);
+    }
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    // every inode went back to the free list
+    char path[MAX_FILE_NAME];
+    for (size_t i = 0; i < THREAD_COUNT * FILES_PER_THREAD; i++) {
+        sprintf(path, "/f%zu", i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_open("/one_too_many", TFS_O_CREAT) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
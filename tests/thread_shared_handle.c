@@ -0,0 +1,97 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREAD_COUNT (8)
+#define RECORDS_PER_THREAD (50)
+#define RECORD_SIZE (24)
+
+int shared_handle;
+
+// every thread appends whole records through the same handle; each write must
+// land at its own offset, and no two records may overlap
+void *write_records_thread_func(void *arg) {
+    char record[RECORD_SIZE];
+    memset(record, 'a' + (int)(size_t)arg, sizeof(record));
+
+    for (size_t i = 0; i < RECORDS_PER_THREAD; i++) {
+        assert(tfs_write(shared_handle, record, sizeof(record)) ==
+               sizeof(record));
+    }
+    return NULL;
+}
+
+// meanwhile, other threads work on files of their own
+void *private_file_thread_func(void *arg) {
+    char path[MAX_FILE_NAME];
+    sprintf(path, "/private%zu", (size_t)arg);
+    size_t value = (size_t)arg;
+
+    for (size_t i = 0; i < RECORDS_PER_THREAD; i++) {
+        int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, &value, sizeof(value)) == sizeof(value));
+        assert(tfs_close(f) != -1);
+
+        f = tfs_open(path, 0);
+        assert(f != -1);
+        size_t read_value;
+        assert(tfs_read(f, &read_value, sizeof(read_value)) ==
+               sizeof(read_value));
+        assert(read_value == value);
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 4096;
+    assert(tfs_init(&params) != -1);
+
+    shared_handle = tfs_open("/shared", TFS_O_CREAT);
+    assert(shared_handle != -1);
+
+    pthread_t writers[THREAD_COUNT];
+    pthread_t others[THREAD_COUNT];
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&writers[i], NULL, write_records_thread_func,
+                              (void *)i) == 0);
+        assert(pthread_create(&others[i], NULL, private_file_thread_func,
+                              (void *)i) == 0);
+    }
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(writers[i], NULL) == 0);
+        assert(pthread_join(others[i], NULL) == 0);
+    }
+    assert(tfs_close(shared_handle) != -1);
+
+    // every record is whole, and each thread wrote all of its records
+    size_t counts[THREAD_COUNT] = {0};
+    char record[RECORD_SIZE];
+    int f = tfs_open("/shared", 0);
+    assert(f != -1);
+    for (size_t i = 0; i < THREAD_COUNT * RECORDS_PER_THREAD; i++) {
+        assert(tfs_read(f, record, sizeof(record)) == sizeof(record));
+        size_t owner = (size_t)(record[0] - 'a');
+        assert(owner < THREAD_COUNT);
+        for (size_t j = 1; j < RECORD_SIZE; j++) {
+            assert(record[j] == record[0]);
+        }
+        counts[owner]++;
+    }
+    assert(tfs_read(f, record, sizeof(record)) == 0);
+    assert(tfs_close(f) != -1);
+
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(counts[i] == RECORDS_PER_THREAD);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK_SIZE (100) // small, but with room for 2 entries per directory node
+#define THREAD_COUNT (4)
+#define RECORDS_PER_THREAD (40)
+
+char const header[] = "<header>";
+char const trailer[] = "</trailer>";
+#define PAYLOAD_SIZE (150) // longer than a block
+#define RECORD_SIZE (sizeof(header) + PAYLOAD_SIZE + sizeof(trailer))
+
+int shared_handle;
+
+static void fill_payload(char *payload, size_t id) {
+    for (size_t i = 0; i < PAYLOAD_SIZE; i++) {
+        payload[i] = (char)('A' + (id + i) % 26);
+    }
+}
+
+// each record is written as one vector, so records never interleave
+void *write_records_thread_func(void *arg) {
+    char payload[PAYLOAD_SIZE];
+    fill_payload(payload, (size_t)arg);
+
+    struct iovec iov[] = {
+        {.iov_base = (void *)header, .iov_len = sizeof(header)},
+        {.iov_base = NULL, .iov_len = 0},
+        {.iov_base = payload, .iov_len = sizeof(payload)},
+        {.iov_base = (void *)trailer, .iov_len = sizeof(trailer)},
+    };
+    for (size_t i = 0; i < RECORDS_PER_THREAD; i++) {
+        assert(tfs_writev(shared_handle, iov, 4) == RECORD_SIZE);
+    }
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    assert(tfs_init(&params) != -1);
+
+    shared_handle = tfs_open("/records", TFS_O_CREAT);
+    assert(shared_handle != -1);
+
+    pthread_t threads[THREAD_COUNT];
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&threads[i], NULL, write_records_thread_func,
+                              (void *)i) == 0);
+    }
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(tfs_close(shared_handle) != -1);
+
+    // read the records back split differently: the header and the start of
+    // the payload in one buffer, the rest in another
+    int f = tfs_open("/records", 0);
+    assert(f != -1);
+    size_t counts[THREAD_COUNT] = {0};
+    char first[sizeof(header) + 10];
+    char rest[RECORD_SIZE - sizeof(first)];
+    char payload[PAYLOAD_SIZE];
+    struct iovec iov[] = {
+        {.iov_base = first, .iov_len = sizeof(first)},
+        {.iov_base = rest, .iov_len = sizeof(rest)},
+    };
+    for (size_t i = 0; i < THREAD_COUNT * RECORDS_PER_THREAD; i++) {
+        assert(tfs_readv(f, iov, 2) == RECORD_SIZE);
+        assert(memcmp(first, header, sizeof(header)) == 0);
+
+        size_t id = (size_t)(first[sizeof(header)] - 'A');
+        assert(id < THREAD_COUNT);
+        fill_payload(payload, id);
+        assert(memcmp(first + sizeof(header), payload, 10) == 0);
+        assert(memcmp(rest, payload + 10, PAYLOAD_SIZE - 10) == 0);
+        assert(memcmp(rest + PAYLOAD_SIZE - 10, trailer, sizeof(trailer)) ==
+               0);
+        counts[id]++;
+    }
+    assert(tfs_readv(f, iov, 2) == 0);
+    assert(tfs_readv(f, iov, -1) == -1);
+    assert(tfs_readv(f, NULL, 0) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_readv(f, iov, 2) == -1);
+
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(counts[i] == RECORDS_PER_THREAD);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}